@@ -0,0 +1,55 @@
+#!/bin/bash
+# Runs iperf3 through two WireGuard interfaces in their own namespaces, joined by a veth pair,
+# with data messages taken straight from the veth interfaces on the receiving side.
+[[ $UID != 0 ]] && exec sudo bash "$(readlink -f "$0")" "$@"
+set -ex
+cd "$(dirname "$(readlink -f "$0")")/../../src"
+
+cleanup() {
+	set +e
+	killall iperf3
+	ip netns del wgfast1
+	ip netns del wgfast2
+	exit 0
+}
+
+trap cleanup EXIT
+
+n1() { ip netns exec wgfast1 "$@"; }
+n2() { ip netns exec wgfast2 "$@"; }
+
+ip netns del wgfast1 2>/dev/null || true
+ip netns del wgfast2 2>/dev/null || true
+ip netns add wgfast1
+ip netns add wgfast2
+n1 ip link set lo up
+n2 ip link set lo up
+
+ip link add veth1 netns wgfast1 type veth peer name veth2 netns wgfast2
+n1 ip addr add 10.0.0.1/24 dev veth1
+n2 ip addr add 10.0.0.2/24 dev veth2
+n1 ip addr add fd00::1/64 dev veth1 nodad
+n2 ip addr add fd00::2/64 dev veth2 nodad
+n1 ip link set veth1 up
+n2 ip link set veth2 up
+
+n1 ip link add dev wg0 type wireguard
+n2 ip link add dev wg0 type wireguard
+n1 ip addr add 192.168.241.1/24 dev wg0
+n2 ip addr add 192.168.241.2/24 dev wg0
+
+key1="$(tools/wg genkey)"
+key2="$(tools/wg genkey)"
+
+n1 tools/wg set wg0 private-key <(echo "$key1") listen-port 38281 fast-path veth1 peer "$(tools/wg pubkey <<<"$key2")" allowed-ips 192.168.241.2/32 endpoint "${ENDPOINT2:-10.0.0.2}:43928"
+n2 tools/wg set wg0 private-key <(echo "$key2") listen-port 43928 fast-path veth2 peer "$(tools/wg pubkey <<<"$key1")" allowed-ips 192.168.241.1/32 endpoint "${ENDPOINT1:-10.0.0.1}:38281"
+
+n1 ip link set wg0 up
+n2 ip link set wg0 up
+
+n1 tools/wg show wg0
+n2 ping -c 3 192.168.241.1
+n2 iperf3 -s -D
+sleep 1
+stdbuf -o 0 ip netns exec wgfast1 iperf3 -i 1 -t 10 "$@" -c 192.168.241.2
+n2 tools/wg show wg0
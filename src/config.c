@@ -8,12 +8,37 @@
 #include "timers.h"
 #include "hashtables.h"
 #include "peer.h"
+#include "cpumap.h"
+#include "drops.h"
 #include "uapi.h"
+#include <linux/log2.h>
+#include <linux/rtnetlink.h>
 
-static int set_peer_dst(struct wireguard_peer *peer, void *data)
+static int set_crypto_cpus(struct wireguard_device *wg, const __u64 mask[WG_CPUMASK_WORDS])
 {
-	socket_set_peer_dst(peer);
-	return 0;
+	unsigned int cpu;
+
+	mutex_lock(&wg->crypt_cpu_map_lock);
+	cpumask_clear(wg->crypt_cpumask);
+	for (cpu = 0; cpu < min_t(unsigned int, nr_cpu_ids, WG_CPUMASK_WORDS * 64); ++cpu) {
+		if (mask[cpu / 64] & (1ULL << (cpu % 64)))
+			cpumask_set_cpu(cpu, wg->crypt_cpumask);
+	}
+	mutex_unlock(&wg->crypt_cpu_map_lock);
+	return cpu_map_update(wg);
+}
+
+static void get_crypto_cpus(struct wireguard_device *wg, __u64 mask[WG_CPUMASK_WORDS])
+{
+	unsigned int cpu;
+
+	mutex_lock(&wg->crypt_cpu_map_lock);
+	for_each_cpu(cpu, wg->crypt_cpumask) {
+		if (cpu >= WG_CPUMASK_WORDS * 64)
+			break;
+		mask[cpu / 64] |= 1ULL << (cpu % 64);
+	}
+	mutex_unlock(&wg->crypt_cpu_map_lock);
 }
 
 static int set_device_port(struct wireguard_device *wg, u16 port)
@@ -22,81 +47,94 @@ static int set_device_port(struct wireguard_device *wg, u16 port)
 		return -EINVAL;
 	socket_uninit(wg);
 	wg->incoming_port = port;
-	if (netdev_pub(wg)->flags & IFF_UP) {
-		peer_for_each_unlocked(wg, set_peer_dst, NULL);
+	if (netdev_pub(wg)->flags & IFF_UP)
 		return socket_init(wg);
-	}
+	return 0;
+}
+
+int config_set_ipmask(struct wireguard_peer *peer, const struct wgipmask *ipmask)
+{
+	if (ipmask->family == AF_INET && ipmask->cidr <= 32)
+		return routing_table_insert_v4(&peer->device->peer_routing_table, &ipmask->ip4, ipmask->cidr, peer);
+	else if (ipmask->family == AF_INET6 && ipmask->cidr <= 128)
+		return routing_table_insert_v6(&peer->device->peer_routing_table, &ipmask->ip6, ipmask->cidr, peer);
 	return 0;
 }
 
 static int set_ipmask(struct wireguard_peer *peer, void __user *user_ipmask)
 {
-	int ret = 0;
 	struct wgipmask in_ipmask;
 
-	ret = copy_from_user(&in_ipmask, user_ipmask, sizeof(in_ipmask));
-	if (ret) {
-		ret = -EFAULT;
-		return ret;
-	}
-
-	if (in_ipmask.family == AF_INET && in_ipmask.cidr <= 32)
-		ret = routing_table_insert_v4(&peer->device->peer_routing_table, &in_ipmask.ip4, in_ipmask.cidr, peer);
-	else if (in_ipmask.family == AF_INET6 && in_ipmask.cidr <= 128)
-		ret = routing_table_insert_v6(&peer->device->peer_routing_table, &in_ipmask.ip6, in_ipmask.cidr, peer);
-
-	return ret;
+	if (copy_from_user(&in_ipmask, user_ipmask, sizeof(in_ipmask)))
+		return -EFAULT;
+	return config_set_ipmask(peer, &in_ipmask);
 }
 
 static const uint8_t zeros[WG_KEY_LEN] = { 0 };
 
-static int set_peer(struct wireguard_device *wg, void __user *user_peer, size_t *len)
+struct wireguard_peer *config_update_peer(struct wireguard_device *wg, struct wgpeer *in_peer, struct list_head *removed)
 {
-	int ret = 0;
-	size_t i;
-	struct wgpeer in_peer;
-	void __user *user_ipmask;
-	struct wireguard_peer *peer = NULL;
+	struct wireguard_peer *peer;
 
-	ret = copy_from_user(&in_peer, user_peer, sizeof(in_peer));
-	if (ret) {
-		ret = -EFAULT;
-		return ret;
-	}
+	ASSERT_RTNL(); /* So that the device can't go up or down under the IFF_UP checks. */
+	lockdep_assert_held(&wg->device_update_lock);
 
-	if (!memcmp(zeros, in_peer.public_key, NOISE_PUBLIC_KEY_LEN))
-		return -EINVAL; /* Can't add a peer with no public key. */
+	if (!memcmp(zeros, in_peer->public_key, NOISE_PUBLIC_KEY_LEN))
+		return ERR_PTR(-EINVAL); /* Can't add a peer with no public key. */
 
-	peer = pubkey_hashtable_lookup(&wg->peer_hashtable, in_peer.public_key);
+	peer = pubkey_hashtable_lookup(&wg->peer_hashtable, in_peer->public_key);
 	if (!peer) { /* Peer doesn't exist yet. Add a new one. */
-		if (in_peer.remove_me)
-			return -ENODEV; /* Tried to remove a non existing peer. */
-		peer = peer_create(wg, in_peer.public_key);
+		if (in_peer->remove_me)
+			return ERR_PTR(-ENODEV); /* Tried to remove a non existing peer. */
+		peer = peer_create(wg, in_peer->public_key);
 		if (!peer)
-			return -ENOMEM;
+			return ERR_PTR(-ENOMEM);
 		rcu_read_lock();
 		peer = peer_get(peer);
 		rcu_read_unlock();
 		if (!peer) {
 			pr_err("Peer disappeared while creating\n");
-			return -EAGAIN;
+			return ERR_PTR(-EAGAIN);
 		}
 		if (netdev_pub(wg)->flags & IFF_UP)
 			timers_init_peer(peer);
 	} else
 		pr_debug("Peer %Lu (%pISpfsc) modified\n", peer->internal_id, &peer->endpoint_addr);
 
-	if (in_peer.remove_me) {
+	if (in_peer->remove_me) {
 		peer_put(peer);
-		peer_remove(peer);
-		return 0;
+		peer_remove_deferred(peer, removed);
+		return NULL;
 	}
 
-	if (in_peer.endpoint.ss_family == AF_INET || in_peer.endpoint.ss_family == AF_INET6)
-		socket_set_peer_addr(peer, &in_peer.endpoint);
+	if (in_peer->max_endpoints)
+		socket_set_peer_max_endpoints(peer, in_peer->max_endpoints);
+
+	if (in_peer->endpoints[0].ss_family == AF_INET || in_peer->endpoints[0].ss_family == AF_INET6)
+		socket_set_peer_endpoints(peer, in_peer->endpoints, WG_MAX_ENDPOINTS);
+
+	return peer;
+}
+
+static int set_peer(struct wireguard_device *wg, void __user *user_peer, size_t *len, struct list_head *removed)
+{
+	int ret = 0;
+	size_t i;
+	struct wgpeer in_peer;
+	void __user *user_ipmask;
+	struct wireguard_peer *peer;
+
+	if (copy_from_user(&in_peer, user_peer, sizeof(in_peer)))
+		return -EFAULT;
+
+	peer = config_update_peer(wg, &in_peer, removed);
+	if (IS_ERR(peer))
+		return PTR_ERR(peer);
+	if (!peer) {
+		*len = sizeof(struct wgpeer) + (in_peer.num_ipmasks * sizeof(struct wgipmask));
+		return 0;
+	}
 
-	if (in_peer.replace_ipmasks)
-		routing_table_remove_by_peer(&wg->peer_routing_table, peer);
 	for (i = 0, user_ipmask = user_peer + sizeof(struct wgpeer); i < in_peer.num_ipmasks; ++i, user_ipmask += sizeof(struct wgipmask)) {
 		ret = set_ipmask(peer, user_ipmask);
 		if (ret)
@@ -114,17 +152,158 @@ static int set_peer(struct wireguard_device *wg, void __user *user_peer, size_t
 	return ret;
 }
 
+/*
+ * Before touching anything, walk the new configuration once to check that every
+ * peer in it can be applied, pulling each existing peer it mentions onto the
+ * kept list and flagging those whose ipmasks are to be replaced. Nothing here is
+ * visible outside of the device update lock, and unkeep_peers undoes it all, so
+ * the device-wide options, which can still fail, are applied only after this has
+ * succeeded and before commit_peers is.
+ */
+static int validate_peers(struct wireguard_device *wg, struct wgdevice *in_device, void __user *user_device, struct list_head *kept, bool *replacing)
+{
+	int ret = 0;
+	size_t i;
+	struct wgpeer in_peer;
+	void __user *user_peer;
+	struct wireguard_peer *peer;
+
+	*replacing = false;
+
+	for (i = 0, user_peer = user_device + sizeof(struct wgdevice); i < in_device->num_peers; ++i, user_peer += sizeof(struct wgpeer) + (in_peer.num_ipmasks * sizeof(struct wgipmask))) {
+		if (copy_from_user(&in_peer, user_peer, sizeof(in_peer))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (!memcmp(zeros, in_peer.public_key, NOISE_PUBLIC_KEY_LEN)) {
+			ret = -EINVAL; /* Can't add a peer with no public key. */
+			break;
+		}
+		peer = pubkey_hashtable_lookup(&wg->peer_hashtable, in_peer.public_key);
+		if (!peer) {
+			if (in_peer.remove_me) {
+				ret = -ENODEV; /* Tried to remove a non existing peer. */
+				break;
+			}
+			continue;
+		}
+		if (!peer->replacing_ipmasks && (in_device->replace_peer_list || in_peer.replace_ipmasks) && !in_peer.remove_me) {
+			peer->replacing_ipmasks = true;
+			*replacing = true;
+		}
+		list_move_tail(&peer->peer_list, kept);
+		peer_put(peer);
+	}
+	return ret;
+}
+
+static void unkeep_peers(struct wireguard_device *wg, struct list_head *kept)
+{
+	struct wireguard_peer *peer;
+
+	list_for_each_entry (peer, kept, peer_list)
+		peer->replacing_ipmasks = false;
+	list_splice_tail_init(kept, &wg->peer_list);
+}
+
+/*
+ * Commits to the change: peers left behind on the device list are removed when
+ * replacing the peer list, and the ipmasks of peers whose ipmasks are being
+ * replaced are marked stale, so that the apply pass can rewrite them in place
+ * without ever dropping a route that the new configuration still contains.
+ */
+static void commit_peers(struct wireguard_device *wg, struct wgdevice *in_device, struct list_head *kept, struct list_head *removed, bool replacing)
+{
+	struct wireguard_peer *peer, *temp;
+
+	if (in_device->replace_peer_list) {
+		list_for_each_entry_safe (peer, temp, &wg->peer_list, peer_list)
+			peer_remove_deferred(peer, removed);
+	}
+	if (replacing)
+		routing_table_mark_stale(&wg->peer_routing_table);
+	unkeep_peers(wg, kept);
+}
+
+int config_check_device_options(const struct wgdevice *in_device)
+{
+	if (in_device->replay_window && (!is_power_of_2(in_device->replay_window) || in_device->replay_window < WG_REPLAY_WINDOW_MIN || in_device->replay_window > WG_REPLAY_WINDOW_MAX))
+		return -EINVAL;
+	return 0;
+}
+
+int config_set_device_options(struct wireguard_device *wg, const struct wgdevice *in_device)
+{
+	int ret;
+
+	ASSERT_RTNL();
+	lockdep_assert_held(&wg->device_update_lock);
+
+	if (in_device->port) {
+		ret = set_device_port(wg, in_device->port);
+		if (ret)
+			return ret;
+	}
+
+	if (in_device->set_fast_path) {
+		ret = socket_set_fast_path(wg, in_device->fast_path_ifindex);
+		if (ret)
+			return ret;
+	}
+
+	if (in_device->set_crypto_cpus) {
+		ret = set_crypto_cpus(wg, in_device->crypto_cpus);
+		if (ret)
+			return ret;
+	}
+
+	/* Nothing below can fail, so that a failure above leaves these as they were. */
+	if (in_device->set_spread_source_ports)
+		wg->spread_source_ports = in_device->spread_source_ports;
+
+	if (in_device->set_keep_sessions)
+		wg->keep_sessions = in_device->keep_sessions;
+
+	if (in_device->replay_window)
+		WRITE_ONCE(wg->replay_window, in_device->replay_window);
+
+	if (in_device->set_auto_mtu) {
+		wg->auto_mtu = in_device->auto_mtu;
+		if (wg->auto_mtu)
+			schedule_work(&wg->mtu_work);
+	}
+
+	if (in_device->remove_private_key)
+		noise_set_static_identity_private_key(&wg->static_identity, NULL);
+	else if (memcmp(zeros, in_device->private_key, WG_KEY_LEN))
+		noise_set_static_identity_private_key(&wg->static_identity, in_device->private_key);
+
+	if (in_device->remove_preshared_key)
+		noise_set_static_identity_preshared_key(&wg->static_identity, NULL);
+	else if (memcmp(zeros, in_device->preshared_key, WG_KEY_LEN))
+		noise_set_static_identity_preshared_key(&wg->static_identity, in_device->preshared_key);
+
+	return 0;
+}
+
 int config_set_device(struct wireguard_device *wg, void __user *user_device)
 {
 	int ret = 0;
 	size_t i, offset;
 	struct wgdevice in_device;
 	void __user *user_peer;
+	bool replacing;
+	LIST_HEAD(kept);
+	LIST_HEAD(removed);
 
 	BUILD_BUG_ON(WG_KEY_LEN != NOISE_PUBLIC_KEY_LEN);
 	BUILD_BUG_ON(WG_KEY_LEN != NOISE_SYMMETRIC_KEY_LEN);
+	BUILD_BUG_ON(WG_MAX_ENDPOINTS != MAX_ENDPOINTS_PER_PEER);
+	BUILD_BUG_ON(WG_REPLAY_WINDOW_MIN != COUNTER_BITS_TOTAL);
+	BUILD_BUG_ON(WG_REPLAY_WINDOW_MAX != COUNTER_BITS_MAX);
 
 	mutex_lock(&wg->device_update_lock);
+	++wg->device_update_gen;
 
 	ret = copy_from_user(&in_device, user_device, sizeof(in_device));
 	if (ret) {
@@ -132,31 +311,33 @@ int config_set_device(struct wireguard_device *wg, void __user *user_device)
 		goto out;
 	}
 
-	if (in_device.port) {
-		ret = set_device_port(wg, in_device.port);
-		if (ret)
-			goto out;
-	}
-
-	if (in_device.replace_peer_list)
-		peer_remove_all(wg);
+	ret = -EPROTO;
+	if (in_device.version_magic != WG_API_VERSION_MAGIC)
+		goto out;
 
-	if (in_device.remove_private_key)
-		noise_set_static_identity_private_key(&wg->static_identity, NULL);
-	else if (memcmp(zeros, in_device.private_key, WG_KEY_LEN))
-		noise_set_static_identity_private_key(&wg->static_identity, in_device.private_key);
+	ret = config_check_device_options(&in_device);
+	if (ret)
+		goto out;
 
-	if (in_device.remove_preshared_key)
-		noise_set_static_identity_preshared_key(&wg->static_identity, NULL);
-	else if (memcmp(zeros, in_device.preshared_key, WG_KEY_LEN))
-		noise_set_static_identity_preshared_key(&wg->static_identity, in_device.preshared_key);
+	ret = validate_peers(wg, &in_device, user_device, &kept, &replacing);
+	if (!ret)
+		ret = config_set_device_options(wg, &in_device);
+	if (ret) {
+		unkeep_peers(wg, &kept);
+		goto out;
+	}
+	commit_peers(wg, &in_device, &kept, &removed, replacing);
 
 	for (i = 0, offset = 0, user_peer = user_device + sizeof(struct wgdevice); i < in_device.num_peers; ++i, user_peer += offset) {
-		ret = set_peer(wg, user_peer, &offset);
+		ret = set_peer(wg, user_peer, &offset, &removed);
 		if (ret)
 			break;
 	}
 
+	if (replacing)
+		routing_table_remove_stale(&wg->peer_routing_table);
+	peer_remove_finish(wg, &removed);
+
 out:
 	mutex_unlock(&wg->device_update_lock);
 	memzero_explicit(&in_device.private_key, NOISE_PUBLIC_KEY_LEN);
@@ -220,6 +401,17 @@ static int populate_ipmask(void *ctx, union nf_inet_addr ip, uint8_t cidr, int f
 }
 
 
+void config_get_peer(struct wireguard_peer *peer, struct wgpeer *out_peer)
+{
+	memcpy(out_peer->public_key, peer->handshake.remote_static, NOISE_PUBLIC_KEY_LEN);
+	socket_get_peer_endpoints(peer, out_peer->endpoints);
+	out_peer->max_endpoints = peer->max_endpoints;
+	out_peer->last_handshake_time = peer->walltime_last_handshake;
+	out_peer->tx_bytes = peer->tx_bytes;
+	out_peer->rx_bytes = peer->rx_bytes;
+	out_peer->mtu = READ_ONCE(peer->mtu);
+}
+
 static int populate_peer(struct wireguard_peer *peer, void *ctx)
 {
 	int ret = 0;
@@ -234,13 +426,7 @@ static int populate_peer(struct wireguard_peer *peer, void *ctx)
 	if (ret)
 		return ret;
 
-	memcpy(out_peer.public_key, peer->handshake.remote_static, NOISE_PUBLIC_KEY_LEN);
-	read_lock_bh(&peer->endpoint_lock);
-	out_peer.endpoint = peer->endpoint_addr;
-	read_unlock_bh(&peer->endpoint_lock);
-	out_peer.last_handshake_time = peer->walltime_last_handshake;
-	out_peer.tx_bytes = peer->tx_bytes;
-	out_peer.rx_bytes = peer->rx_bytes;
+	config_get_peer(peer, &out_peer);
 
 	ipmasks_data.out_len = data->out_len;
 	ipmasks_data.data = data->data;
@@ -257,11 +443,40 @@ static int populate_peer(struct wireguard_peer *peer, void *ctx)
 	return ret;
 }
 
+void config_get_device_options(struct wireguard_device *wg, struct wgdevice *out_device)
+{
+	struct net_device *dev = netdev_pub(wg), *fast_path_dev;
+
+	lockdep_assert_held(&wg->device_update_lock);
+
+	out_device->port = wg->incoming_port;
+	out_device->spread_source_ports = wg->spread_source_ports;
+	out_device->keep_sessions = wg->keep_sessions;
+	out_device->auto_mtu = wg->auto_mtu;
+	out_device->replay_window = wg->replay_window;
+	/* Netlink dumps don't hold RTNL, but the interface can't be freed until a grace period after
+	 * its unregistration has cleared this. */
+	rcu_read_lock();
+	fast_path_dev = READ_ONCE(wg->fast_path_dev);
+	out_device->fast_path_ifindex = fast_path_dev ? fast_path_dev->ifindex : 0;
+	rcu_read_unlock();
+	get_crypto_cpus(wg, out_device->crypto_cpus);
+	drops_sum(wg, out_device->drops);
+	strncpy(out_device->interface, dev->name, IFNAMSIZ - 1);
+	out_device->interface[IFNAMSIZ - 1] = 0;
+
+	down_read(&wg->static_identity.lock);
+	if (wg->static_identity.has_identity) {
+		memcpy(out_device->private_key, wg->static_identity.static_private, WG_KEY_LEN);
+		memcpy(out_device->public_key, wg->static_identity.static_public, WG_KEY_LEN);
+		memcpy(out_device->preshared_key, wg->static_identity.preshared_key, WG_KEY_LEN);
+	}
+	up_read(&wg->static_identity.lock);
+}
 
 int config_get_device(struct wireguard_device *wg, void __user *udevice)
 {
 	int ret = 0;
-	struct net_device *dev = netdev_pub(wg);
 	struct data_remaining peer_data = { NULL };
 	struct wgdevice out_device;
 	struct wgdevice in_device;
@@ -283,18 +498,12 @@ int config_get_device(struct wireguard_device *wg, void __user *udevice)
 		ret = -EFAULT;
 		goto out;
 	}
+	ret = -EPROTO;
+	if (in_device.version_magic != WG_API_VERSION_MAGIC)
+		goto out;
 
-	out_device.port = wg->incoming_port;
-	strncpy(out_device.interface, dev->name, IFNAMSIZ - 1);
-	out_device.interface[IFNAMSIZ - 1] = 0;
-
-	down_read(&wg->static_identity.lock);
-	if (wg->static_identity.has_identity) {
-		memcpy(out_device.private_key, wg->static_identity.static_private, WG_KEY_LEN);
-		memcpy(out_device.public_key, wg->static_identity.static_public, WG_KEY_LEN);
-		memcpy(out_device.preshared_key, wg->static_identity.preshared_key, WG_KEY_LEN);
-	}
-	up_read(&wg->static_identity.lock);
+	config_get_device_options(wg, &out_device);
+	out_device.version_magic = WG_API_VERSION_MAGIC;
 
 	peer_data.out_len = in_device.peers_size;
 	peer_data.data = udevice + sizeof(struct wgdevice);
@@ -3,9 +3,32 @@
 #ifndef WGCONFIG_H
 #define WGCONFIG_H
 
+#include <linux/list.h>
+
 struct wireguard_device;
+struct wireguard_peer;
+struct wgdevice;
+struct wgpeer;
+struct wgipmask;
 
 int config_get_device(struct wireguard_device *wg, void __user *udevice);
 int config_set_device(struct wireguard_device *wg, void __user *udevice);
 
+/* These are shared with the netlink interface, which speaks in the same structures, a field at a time. */
+
+/* Fills in everything about the device but its peers. The caller holds device_update_lock. */
+void config_get_device_options(struct wireguard_device *wg, struct wgdevice *out_device);
+/* Fills in everything about the peer but its ipmasks. */
+void config_get_peer(struct wireguard_peer *peer, struct wgpeer *out_peer);
+
+/* Checks the device wide settings, before anything is applied. */
+int config_check_device_options(const struct wgdevice *in_device);
+/* Applies the device wide settings, but not the peers. The caller holds RTNL and device_update_lock. */
+int config_set_device_options(struct wireguard_device *wg, const struct wgdevice *in_device);
+/* Finds the peer with the public key of `in_peer`, creating it if there's none, and applies everything but its
+ * ipmasks. Returns a reference to the peer, NULL if it was moved onto `removed`, or an ERR_PTR. The caller holds
+ * device_update_lock, and calls peer_remove_finish on `removed` before dropping it. */
+struct wireguard_peer *config_update_peer(struct wireguard_device *wg, struct wgpeer *in_peer, struct list_head *removed);
+int config_set_ipmask(struct wireguard_peer *peer, const struct wgipmask *ipmask);
+
 #endif
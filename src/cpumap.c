@@ -0,0 +1,207 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#include "wireguard.h"
+#include "cpumap.h"
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+
+/* Packets encrypted or decrypted with the same key must all go through the same CPU, so that padata
+ * hands them back in order. Rather than walking the online mask on every packet, and reshuffling every
+ * key's CPU whenever one comes or goes, each device keeps a table of CPU_MAP_SLOTS slots. A key always
+ * lands in the same slot, and rebuilding the table only moves the slots that have to move. */
+struct cpu_map {
+	unsigned int generation;
+	struct rcu_head rcu;
+	u16 cpus[CPU_MAP_SLOTS];
+};
+
+static atomic_t cpu_map_generation = ATOMIC_INIT(0);
+
+#define UNASSIGNED U16_MAX
+
+/* Slots whose CPU is still in `set` stay put, up to each CPU's fair share. The rest go to whichever CPUs
+ * are below their share, so that a CPU coming online takes only the excess from the others. */
+static void fill_row(u16 *row, const u16 *old_row, const struct cpumask *set, unsigned int *count)
+{
+	unsigned int i, cpu, share = DIV_ROUND_UP(CPU_MAP_SLOTS, cpumask_weight(set));
+
+	memset(count, 0, nr_cpu_ids * sizeof(*count));
+	for (i = 0; i < CPU_MAP_SLOTS; ++i) {
+		cpu = old_row ? old_row[i] : UNASSIGNED;
+		if (cpu < nr_cpu_ids && cpumask_test_cpu(cpu, set) && count[cpu] < share) {
+			row[i] = cpu;
+			++count[cpu];
+		} else
+			row[i] = UNASSIGNED;
+	}
+
+	cpu = cpumask_first(set);
+	for (i = 0; i < CPU_MAP_SLOTS; ++i) {
+		if (row[i] != UNASSIGNED)
+			continue;
+		while (count[cpu] >= share) {
+			cpu = cpumask_next(cpu, set);
+			if (cpu >= nr_cpu_ids)
+				cpu = cpumask_first(set);
+		}
+		row[i] = cpu;
+		++count[cpu];
+	}
+}
+
+int cpu_map_update(struct wireguard_device *wg)
+{
+	struct cpu_map *map, *old;
+	cpumask_var_t allowed, set;
+	unsigned int *count;
+	unsigned int generation;
+	int ret = -ENOMEM;
+
+	BUILD_BUG_ON(NR_CPUS >= UNASSIGNED);
+	BUILD_BUG_ON(CPU_MAP_SLOTS & (CPU_MAP_SLOTS - 1));
+
+	map = kzalloc(sizeof(struct cpu_map), GFP_KERNEL);
+	count = kcalloc(nr_cpu_ids, sizeof(*count), GFP_KERNEL);
+	if (!map || !count)
+		goto out;
+	if (!alloc_cpumask_var(&allowed, GFP_KERNEL))
+		goto out;
+	if (!alloc_cpumask_var(&set, GFP_KERNEL))
+		goto out_allowed;
+
+	mutex_lock(&wg->crypt_cpu_map_lock);
+	/* Read before looking at the online mask, so that a CPU changing underneath us leaves this map stale. */
+	generation = atomic_read(&cpu_map_generation);
+	get_online_cpus();
+	if (!cpumask_and(allowed, wg->crypt_cpumask, cpu_online_mask))
+		cpumask_copy(allowed, cpu_online_mask);
+	old = rcu_dereference_protected(wg->crypt_cpu_map, lockdep_is_held(&wg->crypt_cpu_map_lock));
+	/* We prefer the CPUs of the underlying interface's node, where the packets' memory most likely is. The
+	 * node is fixed per map, rather than being that of whichever CPU asks, so that a key always gets the
+	 * same CPU, and padata never has to hand its packets back from two places. */
+	if (wg->crypt_node < 0 || wg->crypt_node >= nr_node_ids || !cpumask_and(set, allowed, cpumask_of_node(wg->crypt_node)))
+		cpumask_copy(set, allowed);
+	fill_row(map->cpus, old ? old->cpus : NULL, set, count);
+	put_online_cpus();
+	map->generation = generation;
+	rcu_assign_pointer(wg->crypt_cpu_map, map);
+	mutex_unlock(&wg->crypt_cpu_map_lock);
+	if (old)
+		kfree_rcu(old, rcu);
+	map = NULL;
+	ret = 0;
+
+	free_cpumask_var(set);
+out_allowed:
+	free_cpumask_var(allowed);
+out:
+	kfree(count);
+	kfree(map);
+	return ret;
+}
+
+void cpu_map_queued_update(struct work_struct *work)
+{
+	struct wireguard_device *wg = container_of(work, struct wireguard_device, crypt_cpu_map_work);
+	if (cpu_map_update(wg) < 0)
+		net_dbg_ratelimited("Could not rebuild the crypto CPU map of %s\n", netdev_pub(wg)->name);
+}
+
+void cpu_map_set_node(struct wireguard_device *wg, int node)
+{
+	mutex_lock(&wg->crypt_cpu_map_lock);
+	wg->crypt_node = node;
+	mutex_unlock(&wg->crypt_cpu_map_lock);
+	queue_work(wg->workqueue, &wg->crypt_cpu_map_work);
+}
+
+void cpu_map_free(struct wireguard_device *wg)
+{
+	struct cpu_map *map;
+
+	cancel_work_sync(&wg->crypt_cpu_map_work);
+	mutex_lock(&wg->crypt_cpu_map_lock);
+	map = rcu_dereference_protected(wg->crypt_cpu_map, lockdep_is_held(&wg->crypt_cpu_map_lock));
+	RCU_INIT_POINTER(wg->crypt_cpu_map, NULL);
+	mutex_unlock(&wg->crypt_cpu_map_lock);
+	if (map)
+		kfree_rcu(map, rcu);
+}
+
+unsigned int cpu_map_choose(struct wireguard_device *wg, u32 key)
+{
+	struct cpu_map *map;
+	unsigned int cpu = nr_cpu_ids;
+
+	rcu_read_lock();
+	map = rcu_dereference(wg->crypt_cpu_map);
+	if (likely(map)) {
+		cpu = map->cpus[key & (CPU_MAP_SLOTS - 1)];
+		if (unlikely(map->generation != atomic_read(&cpu_map_generation)))
+			queue_work(wg->workqueue, &wg->crypt_cpu_map_work);
+	}
+	rcu_read_unlock();
+
+	/* Until the rebuild has run, a slot might still point at a CPU that just went away. */
+	if (unlikely(cpu >= nr_cpu_ids || !cpu_online(cpu)))
+		cpu = cpumask_first(cpu_online_mask);
+	return cpu;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+static int cpu_online_state, cpu_dead_state;
+
+static int cpu_changed(unsigned int cpu)
+{
+	atomic_inc(&cpu_map_generation);
+	return 0;
+}
+
+int cpu_map_init(void)
+{
+	int ret = cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN, "net/wireguard:online", cpu_changed, NULL);
+	if (ret < 0)
+		return ret;
+	cpu_online_state = ret;
+	/* The teardown of a prepare state runs once the CPU is fully dead, rather than while it's still going. */
+	ret = cpuhp_setup_state_nocalls(CPUHP_BP_PREPARE_DYN, "net/wireguard:dead", NULL, cpu_changed);
+	if (ret < 0) {
+		cpuhp_remove_state_nocalls(cpu_online_state);
+		return ret;
+	}
+	cpu_dead_state = ret;
+	return 0;
+}
+
+void cpu_map_uninit(void)
+{
+	cpuhp_remove_state_nocalls(cpu_dead_state);
+	cpuhp_remove_state_nocalls(cpu_online_state);
+}
+#else
+static int cpu_changed(struct notifier_block *nb, unsigned long action, void *hcpu)
+{
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_ONLINE:
+	case CPU_DEAD:
+		atomic_inc(&cpu_map_generation);
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block cpu_notifier = { .notifier_call = cpu_changed };
+
+int cpu_map_init(void)
+{
+	return register_cpu_notifier(&cpu_notifier);
+}
+
+void cpu_map_uninit(void)
+{
+	unregister_cpu_notifier(&cpu_notifier);
+}
+#endif
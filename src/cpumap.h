@@ -0,0 +1,22 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#ifndef WGCPUMAP_H
+#define WGCPUMAP_H
+
+#include <linux/types.h>
+
+struct wireguard_device;
+struct work_struct;
+
+enum { CPU_MAP_SLOTS = 256 };
+
+int cpu_map_init(void);
+void cpu_map_uninit(void);
+
+int cpu_map_update(struct wireguard_device *wg);
+void cpu_map_queued_update(struct work_struct *work);
+void cpu_map_set_node(struct wireguard_device *wg, int node);
+void cpu_map_free(struct wireguard_device *wg);
+unsigned int cpu_map_choose(struct wireguard_device *wg, u32 key);
+
+#endif
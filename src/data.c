@@ -5,6 +5,10 @@
 #include "messages.h"
 #include "packets.h"
 #include "hashtables.h"
+#include "cpumap.h"
+#include "trace.h"
+#include "latency.h"
+#include "drops.h"
 #include <crypto/algapi.h>
 #include <net/xfrm.h>
 #include <linux/rcupdate.h>
@@ -17,6 +21,7 @@ static inline bool counter_validate(union noise_counter *counter, u64 their_coun
 {
 	bool ret = false;
 	unsigned long index, index_current, top, i;
+	const unsigned long words = counter->receive.bits / BITS_PER_LONG, window = counter->receive.bits - COUNTER_REDUNDANT_BITS;
 	spin_lock_bh(&counter->receive.lock);
 
 	if (unlikely(counter->receive.counter >= REJECT_AFTER_MESSAGES + 1 || their_counter >= REJECT_AFTER_MESSAGES))
@@ -24,20 +29,20 @@ static inline bool counter_validate(union noise_counter *counter, u64 their_coun
 
 	++their_counter;
 
-	if (unlikely((COUNTER_WINDOW_SIZE + their_counter) < counter->receive.counter))
+	if (unlikely((window + their_counter) < counter->receive.counter))
 		goto out;
 
 	index = their_counter >> ilog2(COUNTER_REDUNDANT_BITS);
 
 	if (likely(their_counter > counter->receive.counter)) {
 		index_current = counter->receive.counter >> ilog2(COUNTER_REDUNDANT_BITS);
-		top = min_t(unsigned long, index - index_current, COUNTER_BITS_TOTAL / BITS_PER_LONG);
+		top = min_t(unsigned long, index - index_current, words);
 		for (i = 1; i <= top; ++i)
-			counter->receive.backtrack[(i + index_current) & ((COUNTER_BITS_TOTAL / BITS_PER_LONG) - 1)] = 0;
+			counter->receive.backtrack[(i + index_current) & (words - 1)] = 0;
 		counter->receive.counter = their_counter;
 	}
 
-	index &= (COUNTER_BITS_TOTAL / BITS_PER_LONG) - 1;
+	index &= words - 1;
 	ret = !test_and_set_bit(their_counter & (COUNTER_REDUNDANT_BITS - 1), &counter->receive.backtrack[index]);
 
 out:
@@ -48,100 +53,117 @@ out:
 #ifdef DEBUG
 bool packet_counter_selftest(void)
 {
+	static const unsigned int sizes[] = { COUNTER_BITS_TOTAL, COUNTER_BITS_TOTAL * 2, COUNTER_BITS_MAX };
 	bool success = true;
-	unsigned int test_num = 0, i;
+	unsigned int test_num = 0, i, j, window;
 	union noise_counter counter;
+	unsigned long *backtrack = kmalloc(COUNTER_BITS_MAX / BITS_PER_BYTE, GFP_KERNEL);
 
-#define T_INIT do { memset(&counter, 0, sizeof(union noise_counter)); spin_lock_init(&counter.receive.lock); } while (0)
-#define T_LIM (COUNTER_WINDOW_SIZE + 1)
+	if (!backtrack) {
+		pr_info("nonce counter self-tests: out of memory\n");
+		return false;
+	}
+
+#define T_INIT do { memset(&counter, 0, sizeof(union noise_counter)); memset(backtrack, 0, sizeof(unsigned long) * BITS_TO_LONGS(sizes[j])); counter.receive.backtrack = backtrack; counter.receive.bits = sizes[j]; spin_lock_init(&counter.receive.lock); } while (0)
+#define T_LIM (window + 1)
 #define T(n, v) do { ++test_num; if (counter_validate(&counter, n) != v) { pr_info("nonce counter self-test %u: FAIL\n", test_num); success = false; } } while (0)
-	T_INIT;
-	/*  1 */ T(0, true);
-	/*  2 */ T(1, true);
-	/*  3 */ T(1, false);
-	/*  4 */ T(9, true);
-	/*  5 */ T(8, true);
-	/*  6 */ T(7, true);
-	/*  7 */ T(7, false);
-	/*  8 */ T(T_LIM, true);
-	/*  9 */ T(T_LIM - 1, true);
-	/* 10 */ T(T_LIM - 1, false);
-	/* 11 */ T(T_LIM - 2, true);
-	/* 12 */ T(2, true);
-	/* 13 */ T(2, false);
-	/* 14 */ T(T_LIM + 16, true);
-	/* 15 */ T(3, false);
-	/* 16 */ T(T_LIM + 16, false);
-	/* 17 */ T(T_LIM * 4, true);
-	/* 18 */ T(T_LIM * 4 - (T_LIM - 1), true);
-	/* 19 */ T(10, false);
-	/* 20 */ T(T_LIM * 4 - T_LIM, false);
-	/* 21 */ T(T_LIM * 4 - (T_LIM + 1), false);
-	/* 22 */ T(T_LIM * 4 - (T_LIM - 2), true);
-	/* 23 */ T(T_LIM * 4 + 1 - T_LIM, false);
-	/* 24 */ T(0, false);
-	/* 25 */ T(REJECT_AFTER_MESSAGES, false);
-	/* 26 */ T(REJECT_AFTER_MESSAGES - 1, true);
-	/* 27 */ T(REJECT_AFTER_MESSAGES, false);
-	/* 28 */ T(REJECT_AFTER_MESSAGES - 1, false);
-	/* 29 */ T(REJECT_AFTER_MESSAGES - 2, true);
-	/* 30 */ T(REJECT_AFTER_MESSAGES + 1, false);
-	/* 31 */ T(REJECT_AFTER_MESSAGES + 2, false);
-	/* 32 */ T(REJECT_AFTER_MESSAGES - 2, false);
-	/* 33 */ T(REJECT_AFTER_MESSAGES - 3, true);
-	/* 34 */ T(0, false);
-
-	T_INIT;
-	for (i = 1; i <= COUNTER_WINDOW_SIZE; ++i)
-		T(i, true);
-	T(0, true);
-	T(0, false);
-
-	T_INIT;
-	for (i = 2; i <= COUNTER_WINDOW_SIZE + 1; ++i)
-		T(i, true);
-	T(1, true);
-	T(0, false);
-
-	T_INIT;
-	for (i = COUNTER_WINDOW_SIZE + 1; i-- > 0 ;)
-		T(i, true);
-
-	T_INIT;
-	for (i = COUNTER_WINDOW_SIZE + 2; i-- > 1 ;)
-		T(i, true);
-	T(0, false);
-
-	T_INIT;
-	for (i = COUNTER_WINDOW_SIZE + 1; i-- > 1 ;)
-		T(i, true);
-	T(COUNTER_WINDOW_SIZE + 1, true);
-	T(0, false);
-
-	T_INIT;
-	for (i = COUNTER_WINDOW_SIZE + 1; i-- > 1 ;)
-		T(i, true);
-	T(0, true);
-	T(COUNTER_WINDOW_SIZE + 1, true);
+	for (j = 0; j < ARRAY_SIZE(sizes); ++j) {
+		window = sizes[j] - COUNTER_REDUNDANT_BITS;
+
+		T_INIT;
+		/*  1 */ T(0, true);
+		/*  2 */ T(1, true);
+		/*  3 */ T(1, false);
+		/*  4 */ T(9, true);
+		/*  5 */ T(8, true);
+		/*  6 */ T(7, true);
+		/*  7 */ T(7, false);
+		/*  8 */ T(T_LIM, true);
+		/*  9 */ T(T_LIM - 1, true);
+		/* 10 */ T(T_LIM - 1, false);
+		/* 11 */ T(T_LIM - 2, true);
+		/* 12 */ T(2, true);
+		/* 13 */ T(2, false);
+		/* 14 */ T(T_LIM + 16, true);
+		/* 15 */ T(3, false);
+		/* 16 */ T(T_LIM + 16, false);
+		/* 17 */ T(T_LIM * 4, true);
+		/* 18 */ T(T_LIM * 4 - (T_LIM - 1), true);
+		/* 19 */ T(10, false);
+		/* 20 */ T(T_LIM * 4 - T_LIM, false);
+		/* 21 */ T(T_LIM * 4 - (T_LIM + 1), false);
+		/* 22 */ T(T_LIM * 4 - (T_LIM - 2), true);
+		/* 23 */ T(T_LIM * 4 + 1 - T_LIM, false);
+		/* 24 */ T(0, false);
+		/* 25 */ T(REJECT_AFTER_MESSAGES, false);
+		/* 26 */ T(REJECT_AFTER_MESSAGES - 1, true);
+		/* 27 */ T(REJECT_AFTER_MESSAGES, false);
+		/* 28 */ T(REJECT_AFTER_MESSAGES - 1, false);
+		/* 29 */ T(REJECT_AFTER_MESSAGES - 2, true);
+		/* 30 */ T(REJECT_AFTER_MESSAGES + 1, false);
+		/* 31 */ T(REJECT_AFTER_MESSAGES + 2, false);
+		/* 32 */ T(REJECT_AFTER_MESSAGES - 2, false);
+		/* 33 */ T(REJECT_AFTER_MESSAGES - 3, true);
+		/* 34 */ T(0, false);
+
+		T_INIT;
+		for (i = 1; i <= window; ++i)
+			T(i, true);
+		T(0, true);
+		T(0, false);
+
+		T_INIT;
+		for (i = 2; i <= window + 1; ++i)
+			T(i, true);
+		T(1, true);
+		T(0, false);
+
+		T_INIT;
+		for (i = window + 1; i-- > 0 ;)
+			T(i, true);
+
+		T_INIT;
+		for (i = window + 2; i-- > 1 ;)
+			T(i, true);
+		T(0, false);
+
+		T_INIT;
+		for (i = window + 1; i-- > 1 ;)
+			T(i, true);
+		T(window + 1, true);
+		T(0, false);
+
+		T_INIT;
+		for (i = window + 1; i-- > 1 ;)
+			T(i, true);
+		T(0, true);
+		T(window + 1, true);
+
+		/* Only windows larger than the default take a packet just beyond it. */
+		T_INIT;
+		T(COUNTER_WINDOW_SIZE + 1, true);
+		T(0, window > COUNTER_WINDOW_SIZE);
+	}
 #undef T
 #undef T_LIM
 #undef T_INIT
 
+	kfree(backtrack);
 	if (success)
 		pr_info("nonce counter self-tests: pass\n");
 	return success;
 }
 #endif
 
-static inline size_t skb_padding(struct sk_buff *skb)
+static inline size_t skb_padding(struct sk_buff *skb, unsigned int mtu)
 {
 	/* We do this modulo business with the MTU, just in case the networking layer
 	 * gives us a packet that's bigger than the MTU. Now that we support GSO, this
 	 * shouldn't be a real problem, and this can likely be removed. But, caution! */
-	size_t last_unit = skb->len % skb->dev->mtu;
+	size_t last_unit = skb->len % mtu;
 	size_t padded_size = (last_unit + MESSAGE_PADDING_MULTIPLE - 1) & ~(MESSAGE_PADDING_MULTIPLE - 1);
-	if (padded_size > skb->dev->mtu)
-		padded_size = skb->dev->mtu;
+	if (padded_size > mtu)
+		padded_size = mtu;
 	return padded_size - last_unit;
 }
 
@@ -160,6 +182,14 @@ static inline void skb_reset(struct sk_buff *skb)
 	skb_reset_network_header(skb);
 }
 
+/* When spreading source ports, the socket layer picks the outer port from the hash of the
+ * inner flow, which skb_reset() would otherwise have wiped out. */
+static inline void skb_restore_flow_hash(struct sk_buff *skb, struct packet_data_encryption_ctx *ctx)
+{
+	if (ctx->flow_hash)
+		skb_set_hash(skb, ctx->flow_hash, PKT_HASH_TYPE_L4);
+}
+
 static inline void skb_encrypt(struct sk_buff *skb, struct packet_data_encryption_ctx *ctx)
 {
 	struct scatterlist sg[ctx->num_frags]; /* This should be bound to at most 128 by the caller. */
@@ -226,12 +256,39 @@ static inline bool get_encryption_nonce(uint64_t *nonce, struct noise_symmetric_
 }
 
 #ifdef CONFIG_WIREGUARD_PARALLEL
+/* The padata instances are shared by every device, and each orders everything on it in one sequence,
+ * so a device gets only its share of the slots there, and the rest is left for the others. This count
+ * also tells destruct when nothing of the device's is left waiting behind another device's packets. */
+static inline bool parallel_get(struct wireguard_device *wg)
+{
+	return atomic_add_unless(&wg->parallel_in_flight, 1, MAX_PARALLEL_PER_DEVICE);
+}
+
+static inline void parallel_put(struct wireguard_device *wg)
+{
+	/* The read side keeps destruct from freeing the wait queue before we're done waking it. */
+	rcu_read_lock();
+	if (atomic_dec_and_test(&wg->parallel_in_flight))
+		wake_up(&wg->parallel_drained);
+	rcu_read_unlock();
+}
+
+void packet_parallel_wait(struct wireguard_device *wg)
+{
+	wait_event(wg->parallel_drained, !atomic_read(&wg->parallel_in_flight));
+	synchronize_rcu();
+}
+
 static void do_encryption(struct padata_priv *padata)
 {
 	struct packet_data_encryption_ctx *ctx = container_of(padata, struct packet_data_encryption_ctx, padata);
+	struct wireguard_device *wg = ctx->peer->device;
 
+	ctx->latency = latency_record(wg, LATENCY_TX_PARALLEL, ctx->latency);
 	skb_encrypt(ctx->skb, ctx);
 	skb_reset(ctx->skb);
+	skb_restore_flow_hash(ctx->skb, ctx);
+	ctx->latency = latency_record(wg, LATENCY_TX_ENCRYPT, ctx->latency);
 
 	padata_do_serial(padata);
 }
@@ -239,8 +296,12 @@ static void do_encryption(struct padata_priv *padata)
 static void finish_encryption(struct padata_priv *padata)
 {
 	struct packet_data_encryption_ctx *ctx = container_of(padata, struct packet_data_encryption_ctx, padata);
+	struct wireguard_device *wg = ctx->peer->device;
 
+	trace_wg_crypt_dequeue(ctx->peer, true, ctx->skb->len, smp_processor_id());
+	latency_record(wg, LATENCY_TX_REORDER, ctx->latency);
 	ctx->callback(ctx->skb, ctx->peer);
+	parallel_put(wg);
 }
 
 static inline int start_encryption(struct padata_instance *padata, struct padata_priv *priv, int cb_cpu)
@@ -250,19 +311,6 @@ static inline int start_encryption(struct padata_instance *padata, struct padata
 	priv->serial = finish_encryption;
 	return padata_do_parallel(padata, priv, cb_cpu);
 }
-
-static inline unsigned int choose_cpu(__le32 key)
-{
-	unsigned int cpu_index, cpu, cb_cpu;
-
-	/* This ensures that packets encrypted to the same key are sent in-order. */
-	cpu_index = ((__force unsigned int)key) % cpumask_weight(cpu_online_mask);
-	cb_cpu = cpumask_first(cpu_online_mask);
-	for (cpu = 0; cpu < cpu_index; ++cpu)
-		cb_cpu = cpumask_next(cb_cpu, cpu_online_mask);
-
-	return cb_cpu;
-}
 #endif
 
 int packet_create_data(struct sk_buff *skb, struct wireguard_peer *peer, void(*callback)(struct sk_buff *, struct wireguard_peer *), bool parallel)
@@ -273,7 +321,7 @@ int packet_create_data(struct sk_buff *skb, struct wireguard_peer *peer, void(*c
 	u64 nonce;
 	struct sk_buff *trailer = NULL;
 	size_t plaintext_len, padding_len, trailer_len;
-	unsigned int num_frags;
+	unsigned int num_frags, mtu;
 
 	rcu_read_lock();
 	keypair = rcu_dereference(peer->keypairs.current_keypair);
@@ -285,7 +333,11 @@ int packet_create_data(struct sk_buff *skb, struct wireguard_peer *peer, void(*c
 	if (unlikely(!get_encryption_nonce(&nonce, &keypair->sending)))
 		goto err;
 
-	padding_len = skb_padding(skb);
+	/* Padding mustn't push a packet that fits the peer's path over it. */
+	mtu = READ_ONCE(peer->mtu);
+	if (!mtu || mtu > skb->dev->mtu)
+		mtu = skb->dev->mtu;
+	padding_len = skb_padding(skb, mtu);
 	trailer_len = padding_len + noise_encrypted_len(0);
 	plaintext_len = skb->len + padding_len;
 
@@ -317,18 +369,31 @@ int packet_create_data(struct sk_buff *skb, struct wireguard_peer *peer, void(*c
 	ctx->plaintext_len = plaintext_len;
 	ctx->nonce = nonce;
 	ctx->keypair = keypair;
+	/* Packets without a key go back on the queue, so their wait there is only counted once it ends here. */
+	ctx->latency = latency_record(peer->device, LATENCY_TX_QUEUE, LATENCY_CB(skb)->queued);
+	ctx->flow_hash = peer->device->spread_source_ports || peer->max_endpoints > 1 ? skb_get_hash(skb) : 0;
+
+	trace_wg_packet_create_data(peer, skb->len, padding_len, nonce, parallel);
 
 #ifdef CONFIG_WIREGUARD_PARALLEL
 	if (parallel && cpumask_weight(cpu_online_mask) > 1) {
-		unsigned int cpu = choose_cpu(keypair->remote_index);
+		unsigned int cpu = cpu_map_choose(peer->device, (__force u32)keypair->remote_index);
+		ret = -EBUSY;
+		if (unlikely(!parallel_get(peer->device)))
+			goto err;
+		trace_wg_crypt_enqueue(peer, true, skb->len, cpu);
 		ret = start_encryption(peer->device->parallel_send, &ctx->padata, cpu);
-		if (unlikely(ret < 0))
+		if (unlikely(ret < 0)) {
+			parallel_put(peer->device);
 			goto err;
+		}
 	} else
 #endif
 	{
 		skb_encrypt(skb, ctx);
 		skb_reset(skb);
+		skb_restore_flow_hash(skb, ctx);
+		latency_record(peer->device, LATENCY_TX_ENCRYPT, ctx->latency);
 		callback(skb, peer);
 	}
 	return 0;
@@ -343,11 +408,13 @@ err_rcu:
 
 struct packet_data_decryption_ctx {
 	struct padata_priv padata;
+	struct wireguard_device *wg;
 	struct sk_buff *skb;
 	void (*callback)(struct sk_buff *skb, struct wireguard_peer *, struct sockaddr_storage *, bool used_new_key, int err);
 	struct noise_keypair *keypair;
 	struct sockaddr_storage addr;
 	uint64_t nonce;
+	u64 latency;
 	unsigned int num_frags;
 	int ret;
 };
@@ -390,6 +457,7 @@ static void finish_decrypt_packet(struct packet_data_decryption_ctx *ctx)
 	return;
 
 err:
+	drop_count(ctx->wg, ret == -ERANGE ? WG_DROP_RX_INVALID_NONCE : WG_DROP_RX_DECRYPT);
 	noise_keypair_put(ctx->keypair);
 	ctx->callback(ctx->skb, NULL, NULL, false, ret);
 }
@@ -398,15 +466,22 @@ err:
 static void do_decryption(struct padata_priv *padata)
 {
 	struct packet_data_decryption_ctx *ctx = container_of(padata, struct packet_data_decryption_ctx, padata);
+	ctx->latency = latency_record(ctx->wg, LATENCY_RX_PARALLEL, ctx->latency);
 	begin_decrypt_packet(ctx);
+	ctx->latency = latency_record(ctx->wg, LATENCY_RX_DECRYPT, ctx->latency);
 	padata_do_serial(padata);
 }
 
 static void finish_decryption(struct padata_priv *padata)
 {
 	struct packet_data_decryption_ctx *ctx = container_of(padata, struct packet_data_decryption_ctx, padata);
+	struct wireguard_device *wg = ctx->wg;
+	/* A packet that failed to decrypt has already given up its reference to the peer. */
+	trace_wg_crypt_dequeue(ctx->ret ? NULL : ctx->keypair->entry.peer, false, ctx->skb->len, smp_processor_id());
+	latency_record(wg, LATENCY_RX_REORDER, ctx->latency);
 	finish_decrypt_packet(ctx);
 	kfree(ctx);
+	parallel_put(wg);
 }
 
 static inline int start_decryption(struct padata_instance *padata, struct padata_priv *priv, int cb_cpu)
@@ -425,13 +500,16 @@ void packet_consume_data(struct sk_buff *skb, size_t offset, struct wireguard_de
 	struct sk_buff *trailer;
 	struct message_data *header;
 	struct noise_keypair *keypair;
+	enum wg_drop_reason reason;
 	uint64_t nonce;
 	__le32 idx;
 
+	reason = WG_DROP_RX_INVALID;
 	ret = socket_addr_from_skb(&addr, skb);
 	if (unlikely(ret < 0))
 		goto err;
 
+	/* Failing to pull the header means the packet is too short to hold one. */
 	ret = -ENOMEM;
 	if (unlikely(!pskb_may_pull(skb, offset + sizeof(struct message_data))))
 		goto err;
@@ -443,6 +521,7 @@ void packet_consume_data(struct sk_buff *skb, size_t offset, struct wireguard_de
 	idx = header->key_idx;
 	nonce = le64_to_cpu(header->counter);
 
+	reason = WG_DROP_RX_NO_MEMORY;
 	ret = skb_cow_data(skb, 0, &trailer);
 	if (unlikely(ret < 0))
 		goto err;
@@ -451,6 +530,7 @@ void packet_consume_data(struct sk_buff *skb, size_t offset, struct wireguard_de
 	if (unlikely(num_frags > 128))
 		goto err;
 	ret = -EINVAL;
+	reason = WG_DROP_RX_NO_KEYPAIR;
 	rcu_read_lock();
 	keypair = (struct noise_keypair *)index_hashtable_lookup(&wg->index_hashtable, INDEX_HASHTABLE_KEYPAIR, idx);
 	if (unlikely(!keypair)) {
@@ -459,24 +539,36 @@ void packet_consume_data(struct sk_buff *skb, size_t offset, struct wireguard_de
 	}
 	kref_get(&keypair->refcount);
 	rcu_read_unlock();
+	trace_wg_packet_consume_data(keypair->entry.peer, skb->len, nonce, le32_to_cpu(idx));
 #ifdef CONFIG_WIREGUARD_PARALLEL
 	if (cpumask_weight(cpu_online_mask) > 1) {
 		struct packet_data_decryption_ctx *ctx;
-		unsigned int cpu = choose_cpu(idx);
+		unsigned int cpu = cpu_map_choose(wg, (__force u32)idx);
 
 		ret = -ENOMEM;
+		reason = WG_DROP_RX_NO_MEMORY;
 		ctx = kzalloc(sizeof(struct packet_data_decryption_ctx), GFP_ATOMIC);
 		if (unlikely(!ctx))
 			goto err_peer;
 
+		ctx->wg = wg;
 		ctx->skb = skb;
 		ctx->keypair = keypair;
 		ctx->callback = callback;
 		ctx->nonce = nonce;
 		ctx->num_frags = num_frags;
 		ctx->addr = addr;
+		ctx->latency = latency_now(wg);
+		trace_wg_crypt_enqueue(keypair->entry.peer, false, skb->len, cpu);
+		reason = WG_DROP_RX_BUSY;
+		ret = -EBUSY;
+		if (unlikely(!parallel_get(wg))) {
+			kfree(ctx);
+			goto err_peer;
+		}
 		ret = start_decryption(wg->parallel_receive, &ctx->padata, cpu);
 		if (unlikely(ret)) {
+			parallel_put(wg);
 			kfree(ctx);
 			goto err_peer;
 		}
@@ -484,14 +576,17 @@ void packet_consume_data(struct sk_buff *skb, size_t offset, struct wireguard_de
 #endif
 	{
 		struct packet_data_decryption_ctx ctx = {
+			.wg = wg,
 			.skb = skb,
 			.keypair = keypair,
 			.callback = callback,
 			.nonce = nonce,
 			.num_frags = num_frags,
-			.addr = addr
+			.addr = addr,
+			.latency = latency_now(wg)
 		};
 		begin_decrypt_packet(&ctx);
+		latency_record(wg, LATENCY_RX_DECRYPT, ctx.latency);
 		finish_decrypt_packet(&ctx);
 	}
 	return;
@@ -502,5 +597,6 @@ err_peer:
 	noise_keypair_put(keypair);
 #endif
 err:
+	drop_count(wg, reason);
 	callback(skb, NULL, NULL, false, ret);
 }
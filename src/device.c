@@ -7,8 +7,13 @@
 #include "device.h"
 #include "config.h"
 #include "peer.h"
+#include "cpumap.h"
+#include "skbpool.h"
+#include "latency.h"
+#include "drops.h"
 #include "uapi.h"
 #include "messages.h"
+#include "trace.h"
 #include <linux/module.h>
 #include <linux/rtnetlink.h>
 #include <linux/inet.h>
@@ -18,6 +23,7 @@
 #include <net/icmp.h>
 #include <net/rtnetlink.h>
 #include <net/ip_tunnels.h>
+#include <net/ipv6.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_nat_core.h>
 
@@ -32,12 +38,13 @@ static int init(struct net_device *dev)
 }
 static void uninit(struct net_device *dev)
 {
+	socket_uninit_fast_path(netdev_priv(dev));
+	latency_device_uninit(netdev_priv(dev));
 	free_percpu(dev->tstats);
 }
 
 static int open_peer(struct wireguard_peer *peer, void *data)
 {
-	socket_set_peer_dst(peer);
 	timers_init_peer(peer);
 	packet_send_queue(peer);
 	return 0;
@@ -55,8 +62,14 @@ static int open(struct net_device *dev)
 
 static int stop_peer(struct wireguard_peer *peer, void *data)
 {
-	timers_uninit_peer_wait(peer);
 	noise_handshake_clear(&peer->handshake);
+	/* Kept keypairs remain bounded by REJECT_AFTER_TIME, which is checked whenever they're used, and
+	 * are still zeroed out by their timer if the device stays down for longer than that. */
+	if (peer->device->keep_sessions) {
+		timers_uninit_peer_keeping_sessions(peer);
+		return 0;
+	}
+	timers_uninit_peer_wait(peer);
 	noise_keypairs_clear(&peer->keypairs);
 	return 0;
 }
@@ -65,47 +78,76 @@ static int stop(struct net_device *dev)
 {
 	struct wireguard_device *wg = netdev_priv(dev);
 	peer_for_each(wg, stop_peer, NULL);
-	skb_queue_purge(&wg->incoming_handshakes);
+	packet_handshake_queue_purge(wg);
 	socket_uninit(wg);
 	return 0;
 }
 
-static void skb_unsendable(struct sk_buff *skb, struct net_device *dev)
+/* This conntrack stuff is because the rate limiting needs to be applied
+ * to the original src IP, so we have to restore saddr in the IP header. */
+static void skb_restore_saddr(struct sk_buff *skb)
 {
-	/* This conntrack stuff is because the rate limiting needs to be applied
-	 * to the original src IP, so we have to restore saddr in the IP header. */
-	struct nf_conn *ct = NULL;
 #if defined(CONFIG_NF_CONNTRACK) || defined(CONFIG_NF_CONNTRACK_MODULE)
 	enum ip_conntrack_info ctinfo;
-	ct = nf_ct_get(skb, &ctinfo);
+	struct nf_conn *ct = nf_ct_get(skb, &ctinfo);
+
+	if (!ct)
+		return;
+	if (ip_hdr(skb)->version == 4)
+		ip_hdr(skb)->saddr = ct->tuplehash[0].tuple.src.u3.ip;
+	else if (ip_hdr(skb)->version == 6)
+		ipv6_hdr(skb)->saddr = ct->tuplehash[0].tuple.src.u3.in6;
 #endif
-	++dev->stats.tx_errors;
+}
+
+static void skb_unsendable(struct sk_buff *skb, struct net_device *dev, enum wg_drop_reason reason)
+{
+	drop_count(netdev_priv(dev), reason);
 
 	if (skb->len < sizeof(struct iphdr))
 		goto free;
 
-	if (ip_hdr(skb)->version == 4) {
-		if (ct)
-			ip_hdr(skb)->saddr = ct->tuplehash[0].tuple.src.u3.ip;
+	skb_restore_saddr(skb);
+	if (ip_hdr(skb)->version == 4)
 		icmp_send(skb, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, 0);
-	} else if (ip_hdr(skb)->version == 6) {
-		if (ct)
-			ipv6_hdr(skb)->saddr = ct->tuplehash[0].tuple.src.u3.in6;
+	else if (ip_hdr(skb)->version == 6)
 		icmpv6_send(skb, ICMPV6_DEST_UNREACH, ICMPV6_ADDR_UNREACH, 0);
-	}
 free:
 	kfree_skb(skb);
 }
 
+/* Tells the sender of a packet too big for the path to its peer what does fit, and drops the packet,
+ * unless it may be fragmented, in which case the outer packet is fragmented instead. */
+static bool skb_too_big(struct sk_buff *skb, struct net_device *dev, unsigned int mtu)
+{
+	if (ip_hdr(skb)->version == 4) {
+		if (!(ip_hdr(skb)->frag_off & htons(IP_DF)))
+			return false;
+	} else if (ip_hdr(skb)->version != 6 || mtu < IPV6_MIN_MTU)
+		return false;
+
+	if (skb_dst(skb))
+		skb_dst(skb)->ops->update_pmtu(skb_dst(skb), NULL, skb, mtu);
+	skb_restore_saddr(skb);
+	if (ip_hdr(skb)->version == 4)
+		icmp_send(skb, ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED, htonl(mtu));
+	else
+		icmpv6_send(skb, ICMPV6_PKT_TOOBIG, 0, mtu);
+	drop_count(netdev_priv(dev), WG_DROP_TX_TOO_BIG);
+	kfree_skb(skb);
+	return true;
+}
+
 static netdev_tx_t xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct wireguard_device *wg = netdev_priv(dev);
 	struct wireguard_peer *peer;
+	unsigned int mtu;
 	int ret;
 
 	if (unlikely(dev_recursion_level() > 4)) {
 		net_dbg_ratelimited("Routing loop detected\n");
-		skb_unsendable(skb, dev);
+		skb_unsendable(skb, dev, WG_DROP_TX_LOOP);
 		return -ELOOP;
 	}
 
@@ -113,31 +155,32 @@ static netdev_tx_t xmit(struct sk_buff *skb, struct net_device *dev)
 
 	peer = routing_table_lookup_dst(&wg->peer_routing_table, skb);
 	if (unlikely(!peer)) {
-		skb_unsendable(skb, dev);
+		skb_unsendable(skb, dev, WG_DROP_TX_NO_PEER);
 		return -ENOKEY;
 	}
 
-	read_lock_bh(&peer->endpoint_lock);
-	ret = unlikely(peer->endpoint_addr.ss_family != AF_INET && peer->endpoint_addr.ss_family != AF_INET6);
-	read_unlock_bh(&peer->endpoint_lock);
-	if (ret) {
+	if (unlikely(!rcu_access_pointer(peer->endpoints[0]))) {
 		net_dbg_ratelimited("No valid endpoint has been configured or discovered for device\n");
 		peer_put(peer);
-		skb_unsendable(skb, dev);
+		skb_unsendable(skb, dev, WG_DROP_TX_NO_ENDPOINT);
 		return -EHOSTUNREACH;
 	}
 
+	trace_wg_xmit(peer, skb);
+
 	/* If the queue is getting too big, we start removing the oldest packets until it's small again.
 	 * We do this before adding the new packet, so we don't remove GSO segments that are in excess. */
-	while (skb_queue_len(&peer->tx_packet_queue) > MAX_QUEUED_PACKETS)
+	while (skb_queue_len(&peer->tx_packet_queue) > MAX_QUEUED_PACKETS) {
 		dev_kfree_skb(skb_dequeue(&peer->tx_packet_queue));
+		drop_count(wg, WG_DROP_TX_QUEUE_FULL);
+	}
 
 	if (!skb_is_gso(skb))
 		skb->next = NULL;
 	else {
 		struct sk_buff *segs = skb_gso_segment(skb, 0);
 		if (unlikely(IS_ERR(segs))) {
-			skb_unsendable(skb, dev);
+			skb_unsendable(skb, dev, WG_DROP_TX_GSO);
 			peer_put(peer);
 			return PTR_ERR(segs);
 		}
@@ -149,13 +192,24 @@ static netdev_tx_t xmit(struct sk_buff *skb, struct net_device *dev)
 		skb->next = skb->prev = NULL;
 
 		skb = skb_share_check(skb, GFP_ATOMIC);
-		if (unlikely(!skb))
+		if (unlikely(!skb)) {
+			drop_count(wg, WG_DROP_TX_NO_MEMORY);
+			skb = next;
 			continue;
+		}
+
+		/* Without automatic MTU, outer packets go without DF, so the path is left to fragment them. */
+		mtu = wg->auto_mtu ? READ_ONCE(peer->mtu) : 0;
+		if (unlikely(mtu && skb->len > mtu && skb_too_big(skb, dev, mtu))) {
+			skb = next;
+			continue;
+		}
 
 		/* We only need to keep the original dst around for icmp,
 		 * so at this point we're in a position to drop it. */
 		skb_dst_drop(skb);
 
+		LATENCY_CB(skb)->queued = latency_now(wg);
 		skb_queue_tail(&peer->tx_packet_queue, skb);
 		skb = next;
 	}
@@ -182,16 +236,70 @@ static int ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 	return -EINVAL;
 }
 
+/* With automatic MTU, the device takes the largest MTU that any of its peers' paths allow, so that no
+ * peer is held to the limits of another's path. Each peer's own limit is still enforced by xmit. This
+ * runs on the system queue, never on wg->workqueue, since peer removal flushes that one while holding
+ * RTNL and the device update lock, both of which this takes. */
+static void update_mtu(struct work_struct *work)
+{
+	struct wireguard_device *wg = container_of(work, struct wireguard_device, mtu_work);
+	struct net_device *dev = netdev_pub(wg);
+	struct wireguard_peer *peer;
+	unsigned int mtu = 0;
+
+	rtnl_lock();
+	if (dev->reg_state != NETREG_REGISTERED)
+		goto out;
+	mutex_lock(&wg->device_update_lock);
+	if (wg->auto_mtu) {
+		list_for_each_entry (peer, &wg->peer_list, peer_list)
+			mtu = max(mtu, READ_ONCE(peer->mtu));
+	}
+	mutex_unlock(&wg->device_update_lock);
+	if (mtu)
+		dev_set_mtu(dev, max_t(unsigned int, mtu, IPV6_MIN_MTU));
+out:
+	rtnl_unlock();
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+static void get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats)
+{
+	ip_tunnel_get_stats64(dev, stats);
+	drops_fold_stats(netdev_priv(dev), stats);
+}
+#else
+static struct rtnl_link_stats64 *get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats)
+{
+	ip_tunnel_get_stats64(dev, stats);
+	drops_fold_stats(netdev_priv(dev), stats);
+	return stats;
+}
+#endif
+
 static const struct net_device_ops netdev_ops = {
 	.ndo_init		= init,
 	.ndo_uninit		= uninit,
 	.ndo_open		= open,
 	.ndo_stop		= stop,
 	.ndo_start_xmit		= xmit,
-	.ndo_get_stats64	= ip_tunnel_get_stats64,
+	.ndo_get_stats64	= get_stats64,
 	.ndo_do_ioctl		= ioctl
 };
 
+/* Every device shares these, so that many interfaces don't mean many competing crypto pools. Each
+ * device's handshake work gives the queue back after MAX_BURST_HANDSHAKES, which keeps devices
+ * taking turns. Each padata instance orders all of its objects in one sequence, whichever device
+ * they're from, so a device may only have MAX_PARALLEL_PER_DEVICE of them in flight at once, which
+ * keeps one busy device from taking all of the slots and leaving the others nothing but -EBUSY. That
+ * is only a cap, not fair scheduling: a device's packets still wait behind the slowest object of any
+ * other device in the same sequence. */
+static struct workqueue_struct *device_workqueue, *device_handshake_send_wq;
+#ifdef CONFIG_WIREGUARD_PARALLEL
+static struct workqueue_struct *device_parallelqueue;
+static struct padata_instance *device_parallel_send, *device_parallel_receive;
+#endif
+
 static void destruct(struct net_device *dev)
 {
 	struct wireguard_device *wg = netdev_priv(dev);
@@ -199,18 +307,26 @@ static void destruct(struct net_device *dev)
 	mutex_lock(&wg->device_update_lock);
 	peer_remove_all(wg);
 	wg->incoming_port = 0;
-	destroy_workqueue(wg->workqueue);
+	socket_uninit(wg);
+	/* The queues are shared with other devices, so rather than destroying them, we wait for
+	 * whatever of ours might still be on them. */
+	cancel_work_sync(&wg->incoming_handshakes_work);
 #ifdef CONFIG_WIREGUARD_PARALLEL
-	destroy_workqueue(wg->parallelqueue);
-	padata_free(wg->parallel_send);
-	padata_free(wg->parallel_receive);
+	/* Flushing the queue isn't enough, since our packets can be parked in the reorder queue behind
+	 * another device's, and their serial callbacks still use the device. */
+	packet_parallel_wait(wg);
 #endif
+	cpu_map_free(wg);
+	free_cpumask_var(wg->crypt_cpumask);
+	latency_free(wg);
+	free_percpu(wg->drops);
 	routing_table_free(&wg->peer_routing_table);
 	memzero_explicit(&wg->static_identity, sizeof(struct noise_static_identity));
-	skb_queue_purge(&wg->incoming_handshakes);
-	socket_uninit(wg);
+	packet_handshake_queue_purge(wg);
 	cookie_checker_uninit(&wg->cookie_checker);
 	mutex_unlock(&wg->device_update_lock);
+	/* With no peers and no sockets left, nothing can queue this again. */
+	cancel_work_sync(&wg->mtu_work);
 
 	put_net(wg->creating_net);
 
@@ -258,40 +374,38 @@ static int newlink(struct net *src_net, struct net_device *dev, struct nlattr *t
 	init_rwsem(&wg->static_identity.lock);
 	mutex_init(&wg->socket_update_lock);
 	mutex_init(&wg->device_update_lock);
-	skb_queue_head_init(&wg->incoming_handshakes);
+	packet_handshake_queue_init(wg);
 	INIT_WORK(&wg->incoming_handshakes_work, packet_process_queued_handshake_packets);
 	pubkey_hashtable_init(&wg->peer_hashtable);
 	index_hashtable_init(&wg->index_hashtable);
 	routing_table_init(&wg->peer_routing_table);
 	INIT_LIST_HEAD(&wg->peer_list);
-
-	wg->workqueue = alloc_workqueue(KBUILD_MODNAME "-%s", WQ_UNBOUND | WQ_FREEZABLE, 0, dev->name);
-	if (!wg->workqueue) {
-		ret = -ENOMEM;
-		goto err;
-	}
-
+	spin_lock_init(&wg->rekey_limit_lock);
+	mutex_init(&wg->crypt_cpu_map_lock);
+	INIT_WORK(&wg->crypt_cpu_map_work, cpu_map_queued_update);
+	wg->crypt_node = NUMA_NO_NODE;
+	INIT_WORK(&wg->mtu_work, update_mtu);
+	init_waitqueue_head(&wg->parallel_drained);
+	wg->replay_window = COUNTER_BITS_TOTAL;
+	wg->device_update_gen = 1; /* Netlink takes a dump sequence of 0 to mean that there is none. */
+
+	wg->workqueue = device_workqueue;
+	wg->handshake_send_wq = device_handshake_send_wq;
 #ifdef CONFIG_WIREGUARD_PARALLEL
-	wg->parallelqueue = alloc_workqueue(KBUILD_MODNAME "-crypt-%s", WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 1, dev->name);
-	if (!wg->parallelqueue) {
-		ret = -ENOMEM;
-		goto err;
-	}
+	wg->parallelqueue = device_parallelqueue;
+	wg->parallel_send = device_parallel_send;
+	wg->parallel_receive = device_parallel_receive;
+#endif
 
-	wg->parallel_send = padata_alloc_possible(wg->parallelqueue);
-	if (!wg->parallel_send) {
-		ret = -ENOMEM;
+	ret = -ENOMEM;
+	wg->drops = alloc_percpu(struct drop_counters);
+	if (!wg->drops)
 		goto err;
-	}
-	padata_start(wg->parallel_send);
-
-	wg->parallel_receive = padata_alloc_possible(wg->parallelqueue);
-	if (!wg->parallel_receive) {
-		ret = -ENOMEM;
+	if (!zalloc_cpumask_var(&wg->crypt_cpumask, GFP_KERNEL))
+		goto err;
+	ret = cpu_map_update(wg);
+	if (ret < 0)
 		goto err;
-	}
-	padata_start(wg->parallel_receive);
-#endif
 
 	ret = cookie_checker_init(&wg->cookie_checker, wg);
 	if (ret < 0)
@@ -301,24 +415,19 @@ static int newlink(struct net *src_net, struct net_device *dev, struct nlattr *t
 	if (ret < 0)
 		goto err;
 
+	latency_device_init(wg);
+
 	pr_debug("Device %s has been created\n", dev->name);
 
 	return 0;
 
 err:
 	put_net(src_net);
-	if (wg->workqueue)
-		destroy_workqueue(wg->workqueue);
-#ifdef CONFIG_WIREGUARD_PARALLEL
-	if (wg->parallelqueue)
-		destroy_workqueue(wg->parallelqueue);
-	if (wg->parallel_send)
-		padata_free(wg->parallel_send);
-	if (wg->parallel_receive)
-		padata_free(wg->parallel_receive);
-#endif
 	if (wg->cookie_checker.device)
 		cookie_checker_uninit(&wg->cookie_checker);
+	cpu_map_free(wg);
+	free_cpumask_var(wg->crypt_cpumask);
+	free_percpu(wg->drops);
 	return ret;
 }
 
@@ -335,11 +444,102 @@ static struct rtnl_link_ops link_ops __read_mostly = {
 	.dellink		= dellink
 };
 
+static void free_shared_queues(void)
+{
+#ifdef CONFIG_WIREGUARD_PARALLEL
+	if (device_parallel_receive)
+		padata_free(device_parallel_receive);
+	if (device_parallel_send)
+		padata_free(device_parallel_send);
+	if (device_parallelqueue)
+		destroy_workqueue(device_parallelqueue);
+#endif
+	if (device_handshake_send_wq)
+		destroy_workqueue(device_handshake_send_wq);
+	if (device_workqueue)
+		destroy_workqueue(device_workqueue);
+}
+
+static int alloc_shared_queues(void)
+{
+	device_workqueue = alloc_workqueue(KBUILD_MODNAME, WQ_UNBOUND | WQ_FREEZABLE, 0);
+	if (!device_workqueue)
+		goto err;
+
+	/* Sending initiations is latency sensitive, so it's done by a high priority worker on the CPU
+	 * that asked for it, rather than wherever the unbound queue happens to find the time. Creating
+	 * one takes the noise locks, which may sleep, so it can't be done inline from xmit. */
+	device_handshake_send_wq = alloc_workqueue(KBUILD_MODNAME "-handshake", WQ_HIGHPRI | WQ_FREEZABLE, 0);
+	if (!device_handshake_send_wq)
+		goto err;
+
+#ifdef CONFIG_WIREGUARD_PARALLEL
+	device_parallelqueue = alloc_workqueue(KBUILD_MODNAME "-crypt", WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 1);
+	if (!device_parallelqueue)
+		goto err;
+
+	device_parallel_send = padata_alloc_possible(device_parallelqueue);
+	if (!device_parallel_send)
+		goto err;
+	padata_start(device_parallel_send);
+
+	device_parallel_receive = padata_alloc_possible(device_parallelqueue);
+	if (!device_parallel_receive)
+		goto err;
+	padata_start(device_parallel_receive);
+#endif
+	return 0;
+
+err:
+	free_shared_queues();
+	return -ENOMEM;
+}
+
 int device_init(void)
 {
-	int ret = rtnl_link_register(&link_ops);
+	int ret = alloc_shared_queues();
+	if (ret < 0) {
+		pr_err("Cannot allocate shared queues\n");
+		return ret;
+	}
+	ret = socket_init_route_notifiers();
+	if (ret < 0) {
+		pr_err("Cannot register route notifiers\n");
+		free_shared_queues();
+		return ret;
+	}
+	ret = cpu_map_init();
+	if (ret < 0) {
+		pr_err("Cannot register CPU hotplug callbacks\n");
+		socket_uninit_route_notifiers();
+		free_shared_queues();
+		return ret;
+	}
+	ret = skb_pool_init();
+	if (ret < 0) {
+		pr_err("Cannot allocate skb pools\n");
+		cpu_map_uninit();
+		socket_uninit_route_notifiers();
+		free_shared_queues();
+		return ret;
+	}
+	ret = latency_init();
+	if (ret < 0) {
+		pr_err("Cannot register latency notifier\n");
+		skb_pool_uninit();
+		cpu_map_uninit();
+		socket_uninit_route_notifiers();
+		free_shared_queues();
+		return ret;
+	}
+	ret = rtnl_link_register(&link_ops);
 	if (ret < 0) {
 		pr_err("Cannot register link_ops\n");
+		latency_uninit();
+		skb_pool_uninit();
+		cpu_map_uninit();
+		socket_uninit_route_notifiers();
+		free_shared_queues();
 		return ret;
 	}
 	return ret;
@@ -348,5 +548,10 @@ int device_init(void)
 void device_uninit(void)
 {
 	rtnl_link_unregister(&link_ops);
+	latency_uninit();
+	skb_pool_uninit();
+	cpu_map_uninit();
+	socket_uninit_route_notifiers();
 	rcu_barrier();
+	free_shared_queues();
 }
@@ -0,0 +1,33 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#include "drops.h"
+#include <linux/netdevice.h>
+
+void drops_sum(struct wireguard_device *wg, __u64 sums[WG_DROP_REASONS])
+{
+	unsigned int i;
+	int cpu;
+
+	BUILD_BUG_ON(WG_DROP_REASON_COUNT > WG_DROP_REASONS);
+	memset(sums, 0, sizeof(__u64) * WG_DROP_REASONS);
+	for_each_possible_cpu(cpu) {
+		struct drop_counters *counters = per_cpu_ptr(wg->drops, cpu);
+		for (i = 0; i < WG_DROP_REASON_COUNT; ++i)
+			sums[i] += local64_read(&counters->count[i]);
+	}
+}
+
+/* The interface statistics take their error and drop totals from here too. Errors that the tunnel
+ * helpers count themselves, when sending, are left to them. */
+void drops_fold_stats(struct wireguard_device *wg, struct rtnl_link_stats64 *stats)
+{
+	__u64 sums[WG_DROP_REASONS];
+
+	drops_sum(wg, sums);
+	stats->tx_errors += sums[WG_DROP_TX_NO_PEER] + sums[WG_DROP_TX_NO_ENDPOINT] + sums[WG_DROP_TX_LOOP] + sums[WG_DROP_TX_GSO] + sums[WG_DROP_TX_ENCRYPT];
+	stats->tx_dropped += sums[WG_DROP_TX_TOO_BIG] + sums[WG_DROP_TX_QUEUE_FULL] + sums[WG_DROP_TX_NO_MEMORY] + sums[WG_DROP_TX_HANDSHAKE_TIMEOUT];
+	stats->rx_errors += sums[WG_DROP_RX_INVALID] + sums[WG_DROP_RX_NO_KEYPAIR] + sums[WG_DROP_RX_DECRYPT] + sums[WG_DROP_RX_INVALID_NONCE] + sums[WG_DROP_RX_INVALID_LENGTH] + sums[WG_DROP_RX_UNALLOWED_SOURCE];
+	stats->rx_length_errors += sums[WG_DROP_RX_INVALID_LENGTH];
+	stats->rx_frame_errors += sums[WG_DROP_RX_UNALLOWED_SOURCE];
+	stats->rx_dropped += sums[WG_DROP_RX_HANDSHAKE_QUEUE_FULL] + sums[WG_DROP_RX_NO_MEMORY] + sums[WG_DROP_RX_BUSY] + sums[WG_DROP_RX_STACK];
+}
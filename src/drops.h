@@ -0,0 +1,30 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#ifndef WGDROPS_H
+#define WGDROPS_H
+
+#include "wireguard.h"
+#include "uapi.h"
+#include <linux/percpu.h>
+#include <asm/local64.h>
+
+struct rtnl_link_stats64;
+
+/* Drops are counted per CPU and per reason, and only summed when read, so that the many CPUs that
+ * may be dropping packets at once never contend, nor lose counts to each other. They're local64_t,
+ * since plain 64-bit counters would be read torn on 32-bit machines, and drops are counted both from
+ * process context and from bottom halves that may interrupt it, which rules out u64_stats_sync. */
+struct drop_counters {
+	local64_t count[WG_DROP_REASONS];
+};
+
+static inline void drop_count(struct wireguard_device *wg, enum wg_drop_reason reason)
+{
+	local64_inc(&get_cpu_ptr(wg->drops)->count[reason]);
+	put_cpu_ptr(wg->drops);
+}
+
+void drops_sum(struct wireguard_device *wg, __u64 sums[WG_DROP_REASONS]);
+void drops_fold_stats(struct wireguard_device *wg, struct rtnl_link_stats64 *stats);
+
+#endif
@@ -0,0 +1,181 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#include "latency.h"
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/netdevice.h>
+#include <linux/bitops.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <net/rtnetlink.h>
+
+/* Each device gets a directory named after it under wireguard/ in debugfs, holding a latency file. Reading
+ * it gives a histogram per stage, summed over the CPUs, and writing "on", "off" or "reset" to it turns the
+ * histograms on or off or zeroes them. They are off to begin with, and only take memory once first on. */
+
+static const char *const stage_names[LATENCY_STAGES] = {
+	[LATENCY_TX_QUEUE] = "tx queue",
+	[LATENCY_TX_PARALLEL] = "tx parallel wait",
+	[LATENCY_TX_ENCRYPT] = "tx encrypt",
+	[LATENCY_TX_REORDER] = "tx reorder",
+	[LATENCY_TX_SEND] = "tx socket send",
+	[LATENCY_RX_PARALLEL] = "rx parallel wait",
+	[LATENCY_RX_DECRYPT] = "rx decrypt",
+	[LATENCY_RX_REORDER] = "rx reorder",
+	[LATENCY_RX_DELIVER] = "rx deliver",
+	[LATENCY_HANDSHAKE_QUEUE] = "handshake queue",
+	[LATENCY_HANDSHAKE_PROCESS] = "handshake process"
+};
+
+static struct dentry *debugfs_root;
+
+void latency_add(struct wireguard_device *wg, enum latency_stage stage, u64 start, u64 now)
+{
+	struct latency_histograms __percpu *histograms = READ_ONCE(wg->latency);
+
+	/* The histograms are allocated before they are first turned on, but nothing orders the two for us. */
+	if (unlikely(!histograms))
+		return;
+	this_cpu_inc(histograms->buckets[stage][min_t(unsigned int, fls64(now - start), LATENCY_BUCKETS - 1)]);
+}
+
+static int latency_show(struct seq_file *s, void *v)
+{
+	struct wireguard_device *wg = s->private;
+	u64 sums[LATENCY_BUCKETS];
+	unsigned int stage, bucket;
+	int cpu;
+
+	mutex_lock(&wg->device_update_lock);
+	seq_printf(s, "enabled: %s\n", wg->latency_enabled ? "on" : "off");
+	if (!wg->latency)
+		goto out;
+	for (stage = 0; stage < LATENCY_STAGES; ++stage) {
+		memset(sums, 0, sizeof(sums));
+		for_each_possible_cpu(cpu) {
+			struct latency_histograms *histograms = per_cpu_ptr(wg->latency, cpu);
+			for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+				sums[bucket] += READ_ONCE(histograms->buckets[stage][bucket]);
+		}
+		seq_printf(s, "%s:\n", stage_names[stage]);
+		for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+			if (!sums[bucket])
+				continue;
+			if (bucket == LATENCY_BUCKETS - 1)
+				seq_printf(s, "  >= %llu ns: %llu\n", 1ULL << (bucket - 1), sums[bucket]);
+			else
+				seq_printf(s, "  < %llu ns: %llu\n", 1ULL << bucket, sums[bucket]);
+		}
+	}
+out:
+	mutex_unlock(&wg->device_update_lock);
+	return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, latency_show, inode->i_private);
+}
+
+static ssize_t latency_write(struct file *file, const char __user *user_buf, size_t count, loff_t *ppos)
+{
+	struct wireguard_device *wg = ((struct seq_file *)file->private_data)->private;
+	char buf[8];
+	ssize_t ret = count;
+	int cpu;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, user_buf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	mutex_lock(&wg->device_update_lock);
+	if (sysfs_streq(buf, "on")) {
+		if (!wg->latency) {
+			struct latency_histograms __percpu *histograms = alloc_percpu(struct latency_histograms);
+			if (!histograms) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			WRITE_ONCE(wg->latency, histograms);
+		}
+		WRITE_ONCE(wg->latency_enabled, true);
+	} else if (sysfs_streq(buf, "off"))
+		WRITE_ONCE(wg->latency_enabled, false);
+	else if (sysfs_streq(buf, "reset")) {
+		/* Samples landing while we do this may survive it or be lost, which is fine for statistics. */
+		if (wg->latency) {
+			for_each_possible_cpu(cpu)
+				memset(per_cpu_ptr(wg->latency, cpu), 0, sizeof(struct latency_histograms));
+		}
+	} else
+		ret = -EINVAL;
+out:
+	mutex_unlock(&wg->device_update_lock);
+	return ret;
+}
+
+static const struct file_operations latency_fops = {
+	.owner = THIS_MODULE,
+	.open = latency_open,
+	.read = seq_read,
+	.write = latency_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+/* Devices with the same name in different namespaces can't both have a directory, so the later ones go
+ * without, as they do when debugfs isn't there at all. */
+void latency_device_init(struct wireguard_device *wg)
+{
+	if (IS_ERR_OR_NULL(debugfs_root))
+		return;
+	wg->debugfs_dir = debugfs_create_dir(netdev_pub(wg)->name, debugfs_root);
+	if (IS_ERR_OR_NULL(wg->debugfs_dir))
+		return;
+	debugfs_create_file("latency", 0600, wg->debugfs_dir, wg, &latency_fops);
+}
+
+void latency_device_uninit(struct wireguard_device *wg)
+{
+	debugfs_remove_recursive(wg->debugfs_dir);
+	wg->debugfs_dir = NULL;
+}
+
+void latency_free(struct wireguard_device *wg)
+{
+	free_percpu(wg->latency);
+	wg->latency = NULL;
+}
+
+static int netdevice_renamed(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+	struct wireguard_device *wg;
+
+	if (event != NETDEV_CHANGENAME || !dev->rtnl_link_ops || strcmp(dev->rtnl_link_ops->kind, KBUILD_MODNAME))
+		return 0;
+	wg = netdev_priv(dev);
+	if (!IS_ERR_OR_NULL(wg->debugfs_dir))
+		debugfs_rename(debugfs_root, wg->debugfs_dir, debugfs_root, dev->name);
+	return 0;
+}
+
+static struct notifier_block netdevice_notifier = { .notifier_call = netdevice_renamed };
+
+int latency_init(void)
+{
+	int ret = register_netdevice_notifier(&netdevice_notifier);
+	if (ret < 0)
+		return ret;
+	debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	return 0;
+}
+
+void latency_uninit(void)
+{
+	debugfs_remove_recursive(debugfs_root);
+	unregister_netdevice_notifier(&netdevice_notifier);
+}
@@ -0,0 +1,63 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#ifndef WGLATENCY_H
+#define WGLATENCY_H
+
+#include "wireguard.h"
+#include <linux/skbuff.h>
+#include <linux/ktime.h>
+
+enum latency_stage {
+	LATENCY_TX_QUEUE,
+	LATENCY_TX_PARALLEL,
+	LATENCY_TX_ENCRYPT,
+	LATENCY_TX_REORDER,
+	LATENCY_TX_SEND,
+	LATENCY_RX_PARALLEL,
+	LATENCY_RX_DECRYPT,
+	LATENCY_RX_REORDER,
+	LATENCY_RX_DELIVER,
+	LATENCY_HANDSHAKE_QUEUE,
+	LATENCY_HANDSHAKE_PROCESS,
+	LATENCY_STAGES
+};
+
+/* Bucket 0 counts samples of 0 ns, and bucket n those below 2^n ns, up to the last, which takes the rest. */
+enum { LATENCY_BUCKETS = 36 };
+
+struct latency_histograms {
+	u32 buckets[LATENCY_STAGES][LATENCY_BUCKETS];
+};
+
+/* Packets waiting in one of our queues carry the time they were queued at the end of their control
+ * block, clear of the bundle that packet_send_queue keeps at its start. */
+struct latency_cb {
+	u64 queued;
+};
+#define LATENCY_CB(skb) ((struct latency_cb *)((skb)->cb + sizeof((skb)->cb) - sizeof(struct latency_cb)))
+
+int latency_init(void);
+void latency_uninit(void);
+
+void latency_device_init(struct wireguard_device *wg);
+void latency_device_uninit(struct wireguard_device *wg);
+void latency_free(struct wireguard_device *wg);
+
+void latency_add(struct wireguard_device *wg, enum latency_stage stage, u64 start, u64 now);
+
+/* A timestamp to start a stage with, or 0 when the histograms are off, which is all they cost then. */
+static inline u64 latency_now(struct wireguard_device *wg)
+{
+	return unlikely(READ_ONCE(wg->latency_enabled)) ? ktime_get_ns() : 0;
+}
+
+/* Counts the time since start, if it was taken, towards stage, and returns a timestamp for the next. */
+static inline u64 latency_record(struct wireguard_device *wg, enum latency_stage stage, u64 start)
+{
+	u64 now = latency_now(wg);
+	if (unlikely(start && now))
+		latency_add(wg, stage, start, now);
+	return now;
+}
+
+#endif
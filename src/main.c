@@ -2,12 +2,15 @@
 
 #include "wireguard.h"
 #include "device.h"
+#include "netlink.h"
 #include "crypto/chacha20poly1305.h"
 #include "crypto/blake2s.h"
 #include "crypto/siphash24.h"
 #include "crypto/curve25519.h"
 #include "noise.h"
 #include "packets.h"
+#define CREATE_TRACE_POINTS
+#include "trace.h"
 #include <linux/init.h>
 #include <linux/module.h>
 #include <net/rtnetlink.h>
@@ -32,6 +35,13 @@ static int __init mod_init(void)
 	if (ret < 0)
 		return ret;
 
+	ret = netlink_init();
+	if (ret < 0) {
+		pr_err("Cannot register generic netlink family\n");
+		device_uninit();
+		return ret;
+	}
+
 	pr_info("WireGuard loaded. See www.wireguard.io for information.\n");
 	pr_info("(C) Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.\n");
 	return ret;
@@ -40,6 +50,7 @@ static int __init mod_init(void)
 static void __exit mod_exit(void)
 {
 	device_uninit();
+	netlink_uninit();
 	pr_debug("Wireguard has been unloaded\n");
 }
 
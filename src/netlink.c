@@ -0,0 +1,722 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#include "netlink.h"
+#include "wireguard.h"
+#include "config.h"
+#include "packets.h"
+#include "peer.h"
+#include "uapi.h"
+#include <net/genetlink.h>
+#include <net/sock.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 7, 0)
+#define nla_put_u64_64bit(skb, attrtype, value, padattr) nla_put_u64(skb, attrtype, value)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+#define WG_GENL_ADMIN_PERM GENL_UNS_ADMIN_PERM
+#else
+#define WG_GENL_ADMIN_PERM GENL_ADMIN_PERM
+#endif
+
+static inline int parse_nested(struct nlattr *attrs[], int maxtype, const struct nlattr *nla, const struct nla_policy *policy)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+	return nla_parse_nested(attrs, maxtype, nla, policy, NULL);
+#else
+	return nla_parse_nested(attrs, maxtype, nla, policy);
+#endif
+}
+
+static inline int parse_request(struct nlattr *attrs[], const struct nlmsghdr *nlh, const struct nla_policy *policy)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+	return nlmsg_parse(nlh, GENL_HDRLEN, attrs, WGDEVICE_A_MAX, policy, NULL);
+#else
+	return nlmsg_parse(nlh, GENL_HDRLEN, attrs, WGDEVICE_A_MAX, policy);
+#endif
+}
+
+static struct genl_family genl_family;
+
+static const struct nla_policy device_policy[WGDEVICE_A_MAX + 1] = {
+	[WGDEVICE_A_IFINDEX] = { .type = NLA_U32 },
+	[WGDEVICE_A_IFNAME] = { .type = NLA_NUL_STRING, .len = IFNAMSIZ - 1 },
+	[WGDEVICE_A_PRIVATE_KEY] = { .len = WG_KEY_LEN },
+	[WGDEVICE_A_PUBLIC_KEY] = { .len = WG_KEY_LEN },
+	[WGDEVICE_A_PRESHARED_KEY] = { .len = WG_KEY_LEN },
+	[WGDEVICE_A_FLAGS] = { .type = NLA_U32 },
+	[WGDEVICE_A_LISTEN_PORT] = { .type = NLA_U16 },
+	[WGDEVICE_A_SPREAD_SOURCE_PORTS] = { .type = NLA_U8 },
+	[WGDEVICE_A_KEEP_SESSIONS] = { .type = NLA_U8 },
+	[WGDEVICE_A_AUTO_MTU] = { .type = NLA_U8 },
+	[WGDEVICE_A_REPLAY_WINDOW] = { .type = NLA_U32 },
+	[WGDEVICE_A_FAST_PATH_IFINDEX] = { .type = NLA_U32 },
+	[WGDEVICE_A_CRYPTO_CPUS] = { .len = sizeof(__u64) * WG_CPUMASK_WORDS },
+	[WGDEVICE_A_DROPS] = { .len = sizeof(__u64) * WG_DROP_REASONS },
+	[WGDEVICE_A_PEERS] = { .type = NLA_NESTED }
+};
+
+static const struct nla_policy peer_policy[WGPEER_A_MAX + 1] = {
+	[WGPEER_A_PUBLIC_KEY] = { .len = WG_KEY_LEN },
+	[WGPEER_A_FLAGS] = { .type = NLA_U32 },
+	[WGPEER_A_ENDPOINTS] = { .type = NLA_NESTED },
+	[WGPEER_A_MAX_ENDPOINTS] = { .type = NLA_U8 },
+	[WGPEER_A_LAST_HANDSHAKE_TIME] = { .len = sizeof(struct timeval) },
+	[WGPEER_A_RX_BYTES] = { .type = NLA_U64 },
+	[WGPEER_A_TX_BYTES] = { .type = NLA_U64 },
+	[WGPEER_A_MTU] = { .type = NLA_U32 },
+	[WGPEER_A_IPMASKS] = { .type = NLA_NESTED },
+	[WGPEER_A_EVENT] = { .type = NLA_U8 },
+	[WGPEER_A_EVENTS_SUPPRESSED] = { .type = NLA_U32 }
+};
+
+static const struct nla_policy ipmask_policy[WGIPMASK_A_MAX + 1] = {
+	[WGIPMASK_A_FAMILY] = { .type = NLA_U16 },
+	[WGIPMASK_A_IP] = { .len = sizeof(struct in_addr) },
+	[WGIPMASK_A_CIDR] = { .type = NLA_U8 }
+};
+
+/* Returns the device with a reference held on it, to be dropped with dev_put. */
+static struct wireguard_device *lookup_interface(struct nlattr **attrs, struct sk_buff *skb)
+{
+	struct net_device *dev;
+
+	if (attrs[WGDEVICE_A_IFINDEX])
+		dev = dev_get_by_index(sock_net(skb->sk), nla_get_u32(attrs[WGDEVICE_A_IFINDEX]));
+	else if (attrs[WGDEVICE_A_IFNAME])
+		dev = dev_get_by_name(sock_net(skb->sk), nla_data(attrs[WGDEVICE_A_IFNAME]));
+	else
+		return ERR_PTR(-EINVAL);
+	if (!dev)
+		return ERR_PTR(-ENODEV);
+	if (!dev->rtnl_link_ops || !dev->rtnl_link_ops->kind || strcmp(dev->rtnl_link_ops->kind, KBUILD_MODNAME)) {
+		dev_put(dev);
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+	return netdev_priv(dev);
+}
+
+/* A dump is filled in one message at a time, each under its own hold of device_update_lock, and this is what
+ * is kept in between. The cursor holds a reference to the peer, which is either the next to be put, or the one
+ * whose ipmasks were cut short, from the one at next_ipmask on. */
+struct dump_ctx {
+	struct wireguard_device *wg;
+	struct wireguard_peer *next_peer;
+	unsigned long next_ipmask;
+	bool sent_device, done;
+};
+
+#define DUMP_CTX(cb) ((struct dump_ctx *)(cb)->args)
+
+struct dump_ipmasks {
+	struct sk_buff *skb;
+	unsigned long skip, count;
+};
+
+static int put_ipmask(void *ctx, union nf_inet_addr ip, uint8_t cidr, int family)
+{
+	struct dump_ipmasks *dump = ctx;
+	struct nlattr *ipmask_nest;
+
+	if (dump->count < dump->skip) {
+		++dump->count;
+		return 0;
+	}
+	ipmask_nest = nla_nest_start(dump->skb, 0);
+	if (!ipmask_nest)
+		return -EMSGSIZE;
+	if (nla_put_u16(dump->skb, WGIPMASK_A_FAMILY, family) ||
+	    nla_put(dump->skb, WGIPMASK_A_IP, family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr), &ip) ||
+	    nla_put_u8(dump->skb, WGIPMASK_A_CIDR, cidr)) {
+		nla_nest_cancel(dump->skb, ipmask_nest);
+		return -EMSGSIZE;
+	}
+	nla_nest_end(dump->skb, ipmask_nest);
+	++dump->count;
+	return 0;
+}
+
+/* Returns -EMSGSIZE if the peer didn't all fit, with *next_ipmask moved up to the first ipmask that didn't, or left
+ * alone if not even the first did, in which case none of the peer is in the message. */
+static int put_peer(struct sk_buff *skb, struct wireguard_peer *peer, unsigned long *next_ipmask)
+{
+	struct dump_ipmasks dump = { .skb = skb, .skip = *next_ipmask };
+	struct nlattr *peer_nest, *endpoints_nest, *ipmasks_nest;
+	struct wgpeer out_peer;
+	unsigned int i;
+	int ret;
+
+	memset(&out_peer, 0, sizeof(struct wgpeer));
+	config_get_peer(peer, &out_peer);
+
+	peer_nest = nla_nest_start(skb, 0);
+	if (!peer_nest)
+		return -EMSGSIZE;
+	if (nla_put(skb, WGPEER_A_PUBLIC_KEY, WG_KEY_LEN, out_peer.public_key))
+		goto err;
+
+	if (!dump.skip) {
+		if (nla_put_u8(skb, WGPEER_A_MAX_ENDPOINTS, out_peer.max_endpoints) ||
+		    nla_put(skb, WGPEER_A_LAST_HANDSHAKE_TIME, sizeof(struct timeval), &out_peer.last_handshake_time) ||
+		    nla_put_u64_64bit(skb, WGPEER_A_RX_BYTES, out_peer.rx_bytes, WGPEER_A_UNSPEC) ||
+		    nla_put_u64_64bit(skb, WGPEER_A_TX_BYTES, out_peer.tx_bytes, WGPEER_A_UNSPEC) ||
+		    nla_put_u32(skb, WGPEER_A_MTU, out_peer.mtu))
+			goto err;
+
+		endpoints_nest = nla_nest_start(skb, WGPEER_A_ENDPOINTS);
+		if (!endpoints_nest)
+			goto err;
+		for (i = 0; i < WG_MAX_ENDPOINTS; ++i) {
+			if (out_peer.endpoints[i].ss_family == AF_INET)
+				ret = nla_put(skb, 0, sizeof(struct sockaddr_in), &out_peer.endpoints[i]);
+			else if (out_peer.endpoints[i].ss_family == AF_INET6)
+				ret = nla_put(skb, 0, sizeof(struct sockaddr_in6), &out_peer.endpoints[i]);
+			else
+				break;
+			if (ret)
+				goto err;
+		}
+		nla_nest_end(skb, endpoints_nest);
+	}
+
+	ipmasks_nest = nla_nest_start(skb, WGPEER_A_IPMASKS);
+	if (!ipmasks_nest)
+		goto err;
+	ret = routing_table_walk_ips_by_peer(&peer->device->peer_routing_table, &dump, peer, put_ipmask);
+	if (ret && dump.count == dump.skip)
+		goto err;
+	nla_nest_end(skb, ipmasks_nest);
+	nla_nest_end(skb, peer_nest);
+	*next_ipmask = ret ? dump.count : 0;
+	return ret;
+
+err:
+	nla_nest_cancel(skb, peer_nest);
+	return -EMSGSIZE;
+}
+
+static int put_device(struct sk_buff *skb, struct wireguard_device *wg)
+{
+	static const u8 zeros[WG_KEY_LEN] = { 0 };
+	struct wgdevice out_device;
+	int ret = -EMSGSIZE;
+
+	memset(&out_device, 0, sizeof(struct wgdevice));
+	config_get_device_options(wg, &out_device);
+
+	if (memcmp(zeros, out_device.private_key, WG_KEY_LEN) && (
+	    nla_put(skb, WGDEVICE_A_PRIVATE_KEY, WG_KEY_LEN, out_device.private_key) ||
+	    nla_put(skb, WGDEVICE_A_PUBLIC_KEY, WG_KEY_LEN, out_device.public_key)))
+		goto out;
+	if (memcmp(zeros, out_device.preshared_key, WG_KEY_LEN) && nla_put(skb, WGDEVICE_A_PRESHARED_KEY, WG_KEY_LEN, out_device.preshared_key))
+		goto out;
+	if (nla_put_u16(skb, WGDEVICE_A_LISTEN_PORT, out_device.port) ||
+	    nla_put_u8(skb, WGDEVICE_A_SPREAD_SOURCE_PORTS, out_device.spread_source_ports) ||
+	    nla_put_u8(skb, WGDEVICE_A_KEEP_SESSIONS, out_device.keep_sessions) ||
+	    nla_put_u8(skb, WGDEVICE_A_AUTO_MTU, out_device.auto_mtu) ||
+	    nla_put_u32(skb, WGDEVICE_A_REPLAY_WINDOW, out_device.replay_window) ||
+	    nla_put_u32(skb, WGDEVICE_A_FAST_PATH_IFINDEX, out_device.fast_path_ifindex) ||
+	    nla_put(skb, WGDEVICE_A_CRYPTO_CPUS, sizeof(out_device.crypto_cpus), out_device.crypto_cpus) ||
+	    nla_put(skb, WGDEVICE_A_DROPS, sizeof(out_device.drops), out_device.drops))
+		goto out;
+	ret = 0;
+
+out:
+	memzero_explicit(&out_device.private_key, WG_KEY_LEN);
+	return ret;
+}
+
+static int get_device_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct dump_ctx *ctx = DUMP_CTX(cb);
+	struct nlattr *attrs[WGDEVICE_A_MAX + 1];
+	struct wireguard_peer *peer, *next_peer = NULL;
+	struct wireguard_device *wg;
+	struct nlattr *peers_nest;
+	bool done = true;
+	void *hdr;
+	int ret;
+
+	BUILD_BUG_ON(sizeof(struct dump_ctx) > sizeof(cb->args));
+
+	if (!ctx->wg) {
+		ret = parse_request(attrs, cb->nlh, device_policy);
+		if (ret < 0)
+			return ret;
+		wg = lookup_interface(attrs, cb->skb);
+		if (IS_ERR(wg))
+			return PTR_ERR(wg);
+		ctx->wg = wg;
+	}
+	if (ctx->done)
+		return 0;
+	wg = ctx->wg;
+
+	mutex_lock(&wg->device_update_lock);
+	cb->seq = wg->device_update_gen;
+	ret = -EMSGSIZE;
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq, &genl_family, NLM_F_MULTI, WG_CMD_GET_DEVICE);
+	if (!hdr)
+		goto out;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+	genl_dump_check_consistent(cb, hdr);
+#else
+	genl_dump_check_consistent(cb, hdr, &genl_family);
+#endif
+
+	if (nla_put_u32(skb, WGDEVICE_A_IFINDEX, netdev_pub(wg)->ifindex) || nla_put_string(skb, WGDEVICE_A_IFNAME, netdev_pub(wg)->name))
+		goto out_cancel;
+	if (!ctx->sent_device) {
+		ret = put_device(skb, wg);
+		if (ret)
+			goto out_cancel;
+	}
+
+	ret = -EMSGSIZE;
+	peers_nest = nla_nest_start(skb, WGDEVICE_A_PEERS);
+	if (!peers_nest)
+		goto out_cancel;
+	/* If the cursor has since been removed, the device has changed, which the sequence number tells
+	 * userspace already, so we just end the dump there. */
+	if (!ctx->next_peer || !ctx->next_peer->is_dead) {
+		peer = ctx->next_peer ?: list_first_entry(&wg->peer_list, struct wireguard_peer, peer_list);
+		list_for_each_entry_from(peer, &wg->peer_list, peer_list) {
+			if (put_peer(skb, peer, &ctx->next_ipmask)) {
+				next_peer = peer;
+				done = false;
+				break;
+			}
+		}
+	}
+	nla_nest_end(skb, peers_nest);
+	genlmsg_end(skb, hdr);
+
+	if (next_peer) {
+		rcu_read_lock();
+		next_peer = peer_get(next_peer);
+		rcu_read_unlock();
+	}
+	peer_put(ctx->next_peer);
+	ctx->next_peer = next_peer;
+	ctx->sent_device = true;
+	ctx->done = done;
+	ret = 0;
+
+out:
+	mutex_unlock(&wg->device_update_lock);
+	return ret ?: skb->len;
+
+out_cancel:
+	genlmsg_cancel(skb, hdr);
+	goto out;
+}
+
+static int get_device_done(struct netlink_callback *cb)
+{
+	struct dump_ctx *ctx = DUMP_CTX(cb);
+
+	peer_put(ctx->next_peer);
+	if (ctx->wg)
+		dev_put(netdev_pub(ctx->wg));
+	return 0;
+}
+
+static int set_device(struct sk_buff *skb, struct genl_info *info)
+{
+	struct wireguard_device *wg = lookup_interface(info->attrs, skb);
+	struct wgdevice in_device;
+	u32 flags = 0;
+	int ret;
+
+	if (IS_ERR(wg))
+		return PTR_ERR(wg);
+
+	memset(&in_device, 0, sizeof(struct wgdevice));
+	ret = -EINVAL;
+	if (info->attrs[WGDEVICE_A_PEERS])
+		goto out;
+	if (info->attrs[WGDEVICE_A_FLAGS])
+		flags = nla_get_u32(info->attrs[WGDEVICE_A_FLAGS]);
+	if (flags & ~(WGDEVICE_F_REMOVE_PRIVATE_KEY | WGDEVICE_F_REMOVE_PRESHARED_KEY))
+		goto out;
+	in_device.remove_private_key = !!(flags & WGDEVICE_F_REMOVE_PRIVATE_KEY);
+	in_device.remove_preshared_key = !!(flags & WGDEVICE_F_REMOVE_PRESHARED_KEY);
+
+	if (info->attrs[WGDEVICE_A_PRIVATE_KEY]) {
+		if (nla_len(info->attrs[WGDEVICE_A_PRIVATE_KEY]) != WG_KEY_LEN)
+			goto out;
+		memcpy(in_device.private_key, nla_data(info->attrs[WGDEVICE_A_PRIVATE_KEY]), WG_KEY_LEN);
+	}
+	if (info->attrs[WGDEVICE_A_PRESHARED_KEY]) {
+		if (nla_len(info->attrs[WGDEVICE_A_PRESHARED_KEY]) != WG_KEY_LEN)
+			goto out;
+		memcpy(in_device.preshared_key, nla_data(info->attrs[WGDEVICE_A_PRESHARED_KEY]), WG_KEY_LEN);
+	}
+	if (info->attrs[WGDEVICE_A_LISTEN_PORT])
+		in_device.port = nla_get_u16(info->attrs[WGDEVICE_A_LISTEN_PORT]);
+	if (info->attrs[WGDEVICE_A_SPREAD_SOURCE_PORTS]) {
+		in_device.set_spread_source_ports = true;
+		in_device.spread_source_ports = !!nla_get_u8(info->attrs[WGDEVICE_A_SPREAD_SOURCE_PORTS]);
+	}
+	if (info->attrs[WGDEVICE_A_KEEP_SESSIONS]) {
+		in_device.set_keep_sessions = true;
+		in_device.keep_sessions = !!nla_get_u8(info->attrs[WGDEVICE_A_KEEP_SESSIONS]);
+	}
+	if (info->attrs[WGDEVICE_A_AUTO_MTU]) {
+		in_device.set_auto_mtu = true;
+		in_device.auto_mtu = !!nla_get_u8(info->attrs[WGDEVICE_A_AUTO_MTU]);
+	}
+	if (info->attrs[WGDEVICE_A_REPLAY_WINDOW])
+		in_device.replay_window = nla_get_u32(info->attrs[WGDEVICE_A_REPLAY_WINDOW]);
+	if (info->attrs[WGDEVICE_A_FAST_PATH_IFINDEX]) {
+		in_device.set_fast_path = true;
+		in_device.fast_path_ifindex = nla_get_u32(info->attrs[WGDEVICE_A_FAST_PATH_IFINDEX]);
+	}
+	if (info->attrs[WGDEVICE_A_CRYPTO_CPUS]) {
+		in_device.set_crypto_cpus = true;
+		nla_memcpy(in_device.crypto_cpus, info->attrs[WGDEVICE_A_CRYPTO_CPUS], sizeof(in_device.crypto_cpus));
+	}
+
+	ret = config_check_device_options(&in_device);
+	if (ret)
+		goto out;
+
+	rtnl_lock();
+	mutex_lock(&wg->device_update_lock);
+	++wg->device_update_gen;
+	ret = config_set_device_options(wg, &in_device);
+	mutex_unlock(&wg->device_update_lock);
+	rtnl_unlock();
+
+out:
+	memzero_explicit(&in_device.private_key, WG_KEY_LEN);
+	dev_put(netdev_pub(wg));
+	return ret;
+}
+
+static int parse_ipmask(const struct nlattr *attr, struct wgipmask *ipmask)
+{
+	struct nlattr *attrs[WGIPMASK_A_MAX + 1];
+	int ret;
+
+	ret = parse_nested(attrs, WGIPMASK_A_MAX, attr, ipmask_policy);
+	if (ret < 0)
+		return ret;
+	if (!attrs[WGIPMASK_A_FAMILY] || !attrs[WGIPMASK_A_IP] || !attrs[WGIPMASK_A_CIDR])
+		return -EINVAL;
+
+	memset(ipmask, 0, sizeof(struct wgipmask));
+	ipmask->family = nla_get_u16(attrs[WGIPMASK_A_FAMILY]);
+	ipmask->cidr = nla_get_u8(attrs[WGIPMASK_A_CIDR]);
+	if (ipmask->family == AF_INET && ipmask->cidr <= 32 && nla_len(attrs[WGIPMASK_A_IP]) == sizeof(struct in_addr))
+		memcpy(&ipmask->ip4, nla_data(attrs[WGIPMASK_A_IP]), sizeof(struct in_addr));
+	else if (ipmask->family == AF_INET6 && ipmask->cidr <= 128 && nla_len(attrs[WGIPMASK_A_IP]) == sizeof(struct in6_addr))
+		memcpy(&ipmask->ip6, nla_data(attrs[WGIPMASK_A_IP]), sizeof(struct in6_addr));
+	else
+		return -EINVAL;
+	return 0;
+}
+
+static int parse_peer(const struct nlattr *attr, struct wgpeer *peer, struct nlattr **ipmasks)
+{
+	struct nlattr *attrs[WGPEER_A_MAX + 1], *nested;
+	struct wgipmask ipmask;
+	unsigned int i = 0;
+	u32 flags = 0;
+	int ret, rem;
+
+	ret = parse_nested(attrs, WGPEER_A_MAX, attr, peer_policy);
+	if (ret < 0)
+		return ret;
+	if (!attrs[WGPEER_A_PUBLIC_KEY] || nla_len(attrs[WGPEER_A_PUBLIC_KEY]) != WG_KEY_LEN || !memchr_inv(nla_data(attrs[WGPEER_A_PUBLIC_KEY]), 0, WG_KEY_LEN))
+		return -EINVAL;
+
+	memset(peer, 0, sizeof(struct wgpeer));
+	memcpy(peer->public_key, nla_data(attrs[WGPEER_A_PUBLIC_KEY]), WG_KEY_LEN);
+	if (attrs[WGPEER_A_FLAGS])
+		flags = nla_get_u32(attrs[WGPEER_A_FLAGS]);
+	if (flags & ~(WGPEER_F_REMOVE_ME | WGPEER_F_REPLACE_IPMASKS))
+		return -EINVAL;
+	peer->remove_me = !!(flags & WGPEER_F_REMOVE_ME);
+	peer->replace_ipmasks = !!(flags & WGPEER_F_REPLACE_IPMASKS);
+	if (attrs[WGPEER_A_MAX_ENDPOINTS])
+		peer->max_endpoints = nla_get_u8(attrs[WGPEER_A_MAX_ENDPOINTS]);
+
+	if (attrs[WGPEER_A_ENDPOINTS]) {
+		nla_for_each_nested(nested, attrs[WGPEER_A_ENDPOINTS], rem) {
+			const struct sockaddr *addr = nla_data(nested);
+
+			if (i == WG_MAX_ENDPOINTS)
+				return -EINVAL;
+			if (nla_len(nested) == sizeof(struct sockaddr_in) && addr->sa_family == AF_INET)
+				memcpy(&peer->endpoints[i], addr, sizeof(struct sockaddr_in));
+			else if (nla_len(nested) == sizeof(struct sockaddr_in6) && addr->sa_family == AF_INET6)
+				memcpy(&peer->endpoints[i], addr, sizeof(struct sockaddr_in6));
+			else
+				return -EINVAL;
+			++i;
+		}
+	}
+
+	*ipmasks = attrs[WGPEER_A_IPMASKS];
+	if (*ipmasks) {
+		nla_for_each_nested(nested, *ipmasks, rem) {
+			ret = parse_ipmask(nested, &ipmask);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static void clear_replacing_ipmasks(struct wireguard_device *wg)
+{
+	struct wireguard_peer *peer;
+
+	list_for_each_entry (peer, &wg->peer_list, peer_list)
+		peer->replacing_ipmasks = false;
+}
+
+static int set_peer(struct sk_buff *skb, struct genl_info *info)
+{
+	struct wireguard_device *wg = lookup_interface(info->attrs, skb);
+	struct nlattr *attr, *ipmasks, *ipmask_attr;
+	struct wireguard_peer *peer;
+	struct wgpeer in_peer;
+	struct wgipmask ipmask;
+	bool replacing = false;
+	int ret = 0, rem, ipmask_rem;
+	LIST_HEAD(removed);
+
+	if (IS_ERR(wg))
+		return PTR_ERR(wg);
+	if (!info->attrs[WGDEVICE_A_PEERS]) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* RTNL keeps the device from going up or down while peers are created, since that decides whether
+	 * their timers are started, and is always taken before the device update lock, as elsewhere. */
+	rtnl_lock();
+	mutex_lock(&wg->device_update_lock);
+	++wg->device_update_gen;
+
+	/* As with the ioctl, the whole message is checked before anything is applied, and the ipmasks of
+	 * every peer that is replacing them are marked stale in a single walk of the routing table. */
+	nla_for_each_nested(attr, info->attrs[WGDEVICE_A_PEERS], rem) {
+		ret = parse_peer(attr, &in_peer, &ipmasks);
+		if (ret)
+			break;
+		peer = pubkey_hashtable_lookup(&wg->peer_hashtable, in_peer.public_key);
+		if (!peer) {
+			if (in_peer.remove_me) {
+				ret = -ENODEV; /* Tried to remove a non existing peer. */
+				break;
+			}
+			continue;
+		}
+		if (in_peer.replace_ipmasks && !in_peer.remove_me) {
+			peer->replacing_ipmasks = true;
+			replacing = true;
+		}
+		peer_put(peer);
+	}
+	if (ret) {
+		if (replacing)
+			clear_replacing_ipmasks(wg);
+		goto out_unlock;
+	}
+	if (replacing) {
+		routing_table_mark_stale(&wg->peer_routing_table);
+		clear_replacing_ipmasks(wg);
+	}
+
+	nla_for_each_nested(attr, info->attrs[WGDEVICE_A_PEERS], rem) {
+		parse_peer(attr, &in_peer, &ipmasks);
+		peer = config_update_peer(wg, &in_peer, &removed);
+		if (IS_ERR(peer)) {
+			ret = PTR_ERR(peer);
+			break;
+		}
+		if (!peer)
+			continue;
+		if (ipmasks) {
+			nla_for_each_nested(ipmask_attr, ipmasks, ipmask_rem) {
+				parse_ipmask(ipmask_attr, &ipmask);
+				ret = config_set_ipmask(peer, &ipmask);
+				if (ret)
+					break;
+			}
+		}
+		if (netdev_pub(wg)->flags & IFF_UP)
+			packet_send_queue(peer);
+		peer_put(peer);
+		if (ret)
+			break;
+	}
+
+	if (replacing)
+		routing_table_remove_stale(&wg->peer_routing_table);
+	peer_remove_finish(wg, &removed);
+
+out_unlock:
+	mutex_unlock(&wg->device_update_lock);
+	rtnl_unlock();
+out:
+	dev_put(netdev_pub(wg));
+	return ret;
+}
+
+/* Peers can handshake and roam far more often than anyone watching needs to hear about, so each may only have
+ * PEER_EVENT_BURST events sent every PEER_EVENT_INTERVAL. Those beyond are counted instead, and the count goes
+ * out with the next one sent. The creation and removal of peers are always sent, since they can't be inferred. */
+enum {
+	PEER_EVENT_INTERVAL = HZ,
+	PEER_EVENT_BURST = 8
+};
+
+static bool peer_event_allowed(struct wireguard_peer *peer, enum wg_peer_event event, u32 *suppressed)
+{
+	unsigned long now = jiffies;
+	bool allowed = true;
+
+	spin_lock_bh(&peer->event_lock);
+	if (!time_in_range_open(now, peer->event_window, peer->event_window + PEER_EVENT_INTERVAL)) {
+		peer->event_window = now;
+		peer->events_in_window = 0;
+	}
+	if (peer->events_in_window < PEER_EVENT_BURST || event == WG_PEER_EVENT_CREATED || event == WG_PEER_EVENT_REMOVED) {
+		++peer->events_in_window;
+		*suppressed = peer->events_suppressed;
+		peer->events_suppressed = 0;
+	} else {
+		++peer->events_suppressed;
+		allowed = false;
+	}
+	spin_unlock_bh(&peer->event_lock);
+	return allowed;
+}
+
+static inline size_t peer_event_size(void)
+{
+	return nla_total_size(sizeof(u32)) + /* WGDEVICE_A_IFINDEX */
+	       nla_total_size(0) + /* WGDEVICE_A_PEERS */
+	       nla_total_size(0) + /* The peer */
+	       nla_total_size(WG_KEY_LEN) + /* WGPEER_A_PUBLIC_KEY */
+	       nla_total_size(sizeof(u8)) + /* WGPEER_A_EVENT */
+	       nla_total_size(sizeof(u32)) + /* WGPEER_A_EVENTS_SUPPRESSED */
+	       nla_total_size(0) + /* WGPEER_A_ENDPOINTS */
+	       nla_total_size(sizeof(struct sockaddr_in6)); /* The endpoint */
+}
+
+void netlink_notify_peer(struct wireguard_peer *peer, enum wg_peer_event event, const struct sockaddr_storage *endpoint)
+{
+	struct net_device *dev = netdev_pub(peer->device);
+	struct nlattr *peers_nest, *peer_nest, *endpoints_nest;
+	struct sk_buff *skb;
+	u32 suppressed;
+	void *hdr;
+
+	if (!genl_has_listeners(&genl_family, dev_net(dev), 0))
+		return;
+	if (!peer_event_allowed(peer, event, &suppressed))
+		return;
+
+	skb = genlmsg_new(peer_event_size(), GFP_ATOMIC);
+	if (!skb)
+		return;
+	hdr = genlmsg_put(skb, 0, 0, &genl_family, 0, WG_CMD_PEER_EVENT);
+	if (!hdr)
+		goto err;
+	if (nla_put_u32(skb, WGDEVICE_A_IFINDEX, dev->ifindex))
+		goto err;
+	peers_nest = nla_nest_start(skb, WGDEVICE_A_PEERS);
+	if (!peers_nest)
+		goto err;
+	peer_nest = nla_nest_start(skb, 0);
+	if (!peer_nest)
+		goto err;
+	/* The remote static key is set when the peer is created, and never changed after. */
+	if (nla_put(skb, WGPEER_A_PUBLIC_KEY, WG_KEY_LEN, peer->handshake.remote_static) ||
+	    nla_put_u8(skb, WGPEER_A_EVENT, event) ||
+	    (suppressed && nla_put_u32(skb, WGPEER_A_EVENTS_SUPPRESSED, suppressed)))
+		goto err;
+	if (endpoint && (endpoint->ss_family == AF_INET || endpoint->ss_family == AF_INET6)) {
+		endpoints_nest = nla_nest_start(skb, WGPEER_A_ENDPOINTS);
+		if (!endpoints_nest || nla_put(skb, 0, endpoint->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in), endpoint))
+			goto err;
+		nla_nest_end(skb, endpoints_nest);
+	}
+	nla_nest_end(skb, peer_nest);
+	nla_nest_end(skb, peers_nest);
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast_netns(&genl_family, dev_net(dev), skb, 0, 0, GFP_ATOMIC);
+	return;
+
+err:
+	nlmsg_free(skb);
+}
+
+/* Events name peers and their endpoints, which is no business of those without CAP_NET_ADMIN. */
+static int mcast_bind(struct net *net, int group)
+{
+	return ns_capable(net->user_ns, CAP_NET_ADMIN) ? 0 : -EPERM;
+}
+
+static const struct genl_multicast_group genl_mcgrps[] = {
+	{ .name = WG_GENL_MCGRP_PEERS }
+};
+
+static const struct genl_ops genl_ops[] = {
+	{
+		.cmd = WG_CMD_GET_DEVICE,
+		.dumpit = get_device_dump,
+		.done = get_device_done,
+		.policy = device_policy,
+		.flags = WG_GENL_ADMIN_PERM
+	}, {
+		.cmd = WG_CMD_SET_DEVICE,
+		.doit = set_device,
+		.policy = device_policy,
+		.flags = WG_GENL_ADMIN_PERM
+	}, {
+		.cmd = WG_CMD_SET_PEER,
+		.doit = set_peer,
+		.policy = device_policy,
+		.flags = WG_GENL_ADMIN_PERM
+	}
+};
+
+static struct genl_family genl_family
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+__ro_after_init = {
+	.ops = genl_ops,
+	.n_ops = ARRAY_SIZE(genl_ops),
+	.mcgrps = genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(genl_mcgrps),
+#else
+= {
+	.id = GENL_ID_GENERATE,
+#endif
+	.name = WG_GENL_NAME,
+	.version = WG_GENL_VERSION,
+	.maxattr = WGDEVICE_A_MAX,
+	.module = THIS_MODULE,
+	.netnsok = true,
+	.mcast_bind = mcast_bind
+};
+
+int netlink_init(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	return genl_register_family(&genl_family);
+#else
+	return genl_register_family_with_ops_groups(&genl_family, genl_ops, genl_mcgrps);
+#endif
+}
+
+void netlink_uninit(void)
+{
+	genl_unregister_family(&genl_family);
+}
@@ -0,0 +1,16 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#ifndef WGNETLINK_H
+#define WGNETLINK_H
+
+#include "uapi.h"
+
+struct wireguard_peer;
+
+int netlink_init(void);
+void netlink_uninit(void);
+
+/* May be called from any context. The endpoint is only for WG_PEER_EVENT_ENDPOINT_CHANGED, and otherwise NULL. */
+void netlink_notify_peer(struct wireguard_peer *peer, enum wg_peer_event event, const struct sockaddr_storage *endpoint);
+
+#endif
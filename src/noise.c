@@ -62,9 +62,12 @@ void noise_handshake_clear(struct noise_handshake *handshake)
 
 static struct noise_keypair *keypair_create(struct wireguard_peer *peer)
 {
-	struct noise_keypair *keypair = kzalloc(sizeof(struct noise_keypair), GFP_KERNEL);
+	unsigned int bits = READ_ONCE(peer->device->replay_window);
+	struct noise_keypair *keypair = kzalloc(sizeof(struct noise_keypair) + bits / BITS_PER_BYTE, GFP_KERNEL);
 	if (unlikely(!keypair))
 		return NULL;
+	keypair->receiving.counter.receive.backtrack = keypair->receiving_backtrack;
+	keypair->receiving.counter.receive.bits = bits;
 	keypair->internal_id = atomic64_inc_return(&keypair_counter);
 	keypair->entry.type = INDEX_HASHTABLE_KEYPAIR;
 	keypair->entry.peer = peer;
@@ -218,7 +221,6 @@ static void symmetric_key_init(struct noise_symmetric_key *key)
 {
 	spin_lock_init(&key->counter.receive.lock);
 	atomic64_set(&key->counter.counter, 0);
-	memset(key->counter.receive.backtrack, 0, sizeof(key->counter.receive.backtrack));
 	key->birthdate = get_jiffies_64();
 	key->is_valid = true;
 }
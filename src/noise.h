@@ -37,17 +37,23 @@ enum noise_lengths {
 	NOISE_HASH_LEN = BLAKE2S_OUTBYTES
 };
 
+/* The replay bitmap of each receiving key has COUNTER_BITS_TOTAL bits by default, and may be made any
+ * power of two up to COUNTER_BITS_MAX per device. It costs one bit per packet of window, for each of
+ * the up to three keypairs a peer has, so 8 KiB per keypair at the maximum. */
 enum counter_values {
 	COUNTER_BITS_TOTAL = 2048,
+	COUNTER_BITS_MAX = 65536,
 	COUNTER_REDUNDANT_BITS = BITS_PER_LONG,
-	COUNTER_WINDOW_SIZE = COUNTER_BITS_TOTAL - COUNTER_REDUNDANT_BITS
+	COUNTER_WINDOW_SIZE = COUNTER_BITS_TOTAL - COUNTER_REDUNDANT_BITS,
+	COUNTER_WINDOW_SIZE_MAX = COUNTER_BITS_MAX - COUNTER_REDUNDANT_BITS
 };
 
 enum wireguard_limits {
 	REKEY_AFTER_MESSAGES = U64_MAX - 0xffff,
-	REJECT_AFTER_MESSAGES = U64_MAX - COUNTER_WINDOW_SIZE - 1,
+	REJECT_AFTER_MESSAGES = U64_MAX - COUNTER_WINDOW_SIZE_MAX - 1,
 	REKEY_TIMEOUT = 5 * HZ,
 	REKEY_AFTER_TIME = 120 * HZ,
+	REKEY_JITTER_WINDOW = 20 * HZ,
 	REJECT_AFTER_TIME = 180 * HZ,
 	INITIATIONS_PER_SECOND = HZ / 50,
 	MAX_PEERS_PER_DEVICE = U16_MAX
@@ -56,7 +62,8 @@ enum wireguard_limits {
 union noise_counter {
 	struct {
 		u64 counter;
-		unsigned long backtrack[COUNTER_BITS_TOTAL / BITS_PER_LONG];
+		unsigned long *backtrack;
+		unsigned int bits;
 		spinlock_t lock;
 	} receive;
 	atomic64_t counter;
@@ -78,6 +85,7 @@ struct noise_keypair {
 	struct kref refcount;
 	struct rcu_head rcu;
 	uint64_t internal_id;
+	unsigned long receiving_backtrack[];
 };
 
 struct noise_keypairs {
@@ -11,7 +11,12 @@
 
 enum {
 	MAX_QUEUED_HANDSHAKES = 4096,
-	MAX_BURST_HANDSHAKES = 16
+	MAX_QUEUED_HANDSHAKES_PER_BUCKET = MAX_QUEUED_HANDSHAKES / 16,
+	MAX_BURST_HANDSHAKES = 16,
+	MAX_EARLY_REKEYS_PER_SECOND = 64,
+	MAX_REKEYS_PER_SECOND = 256,
+	MAX_REKEY_DEFERRAL = 30 * HZ,
+	MAX_PARALLEL_PER_DEVICE = 256
 };
 
 /* AF41, plus 00 ECN */
@@ -23,6 +28,8 @@ struct sk_buff;
 
 /* receive.c */
 void packet_receive(struct wireguard_device *wg, struct sk_buff *skb);
+void packet_handshake_queue_init(struct wireguard_device *wg);
+void packet_handshake_queue_purge(struct wireguard_device *wg);
 
 /* send.c */
 int packet_send_queue(struct wireguard_peer *peer);
@@ -47,10 +54,15 @@ struct packet_data_encryption_ctx {
 	struct sk_buff *trailer;
 	struct noise_keypair *keypair;
 	uint64_t nonce;
+	u64 latency;
+	u32 flow_hash;
 };
 
 int packet_create_data(struct sk_buff *skb, struct wireguard_peer *peer, void(*callback)(struct sk_buff *, struct wireguard_peer *), bool parallel);
 void packet_consume_data(struct sk_buff *skb, size_t offset, struct wireguard_device *wg, void(*callback)(struct sk_buff *, struct wireguard_peer *, struct sockaddr_storage *, bool used_new_key, int err));
+#ifdef CONFIG_WIREGUARD_PARALLEL
+void packet_parallel_wait(struct wireguard_device *wg);
+#endif
 
 #define DATA_PACKET_HEAD_ROOM ALIGN(sizeof(struct message_data) + max(sizeof(struct packet_data_encryption_ctx), SKB_HEADER_LEN), 4)
 
@@ -6,6 +6,7 @@
 #include "timers.h"
 #include "hashtables.h"
 #include "noise.h"
+#include "netlink.h"
 #include <linux/kref.h>
 #include <linux/lockdep.h>
 #include <linux/rcupdate.h>
@@ -18,25 +19,35 @@ struct wireguard_peer *peer_create(struct wireguard_device *wg, const u8 public_
 	struct wireguard_peer *peer;
 	lockdep_assert_held(&wg->device_update_lock);
 
-	if (peer_total_count(wg) >= MAX_PEERS_PER_DEVICE)
+	if (wg->num_peers >= MAX_PEERS_PER_DEVICE)
 		return NULL;
 
 	peer = kzalloc(sizeof(struct wireguard_peer), GFP_KERNEL);
 	if (!peer)
 		return NULL;
+	peer->endpoint_cache = __alloc_percpu(sizeof(struct endpoint_cache) * MAX_ENDPOINTS_PER_PEER, __alignof__(struct endpoint_cache));
+	if (!peer->endpoint_cache) {
+		kfree(peer);
+		return NULL;
+	}
 
 	peer->internal_id = atomic64_inc_return(&peer_counter);
 	peer->device = wg;
+	peer->max_endpoints = 1;
 	cookie_init(&peer->latest_cookie);
 	noise_handshake_init(&peer->handshake, &wg->static_identity, public_key, peer);
 	mutex_init(&peer->keypairs.keypair_update_lock);
 	INIT_WORK(&peer->transmit_handshake_work, packet_send_queued_handshakes);
-	rwlock_init(&peer->endpoint_lock);
+	INIT_WORK(&peer->clear_peer_work, timers_queued_expired_kill_ephemerals);
+	spin_lock_init(&peer->endpoint_lock);
+	spin_lock_init(&peer->event_lock);
 	skb_queue_head_init(&peer->tx_packet_queue);
 	kref_init(&peer->refcount);
 	pubkey_hashtable_add(&wg->peer_hashtable, peer);
 	list_add_tail(&peer->peer_list, &wg->peer_list);
+	++wg->num_peers;
 	pr_debug("Peer %Lu created\n", peer->internal_id);
+	netlink_notify_peer(peer, WG_PEER_EVENT_CREATED, NULL);
 	return peer;
 }
 
@@ -54,21 +65,55 @@ struct wireguard_peer *peer_get(struct wireguard_peer *peer)
 	return peer;
 }
 
-void peer_remove(struct wireguard_peer *peer)
+/* Takes the peer off of the device and moves it onto `removed`. The caller has already taken its
+ * entries out of the routing table, so that nothing new gets queued to it once it's dead. */
+static void peer_unlink(struct wireguard_peer *peer, struct list_head *removed)
+{
+	peer->is_dead = true;
+	list_move_tail(&peer->peer_list, removed);
+	--peer->device->num_peers;
+	noise_handshake_clear(&peer->handshake);
+	noise_keypairs_clear(&peer->keypairs);
+	pubkey_hashtable_remove(&peer->device->peer_hashtable, peer);
+}
+
+void peer_remove_deferred(struct wireguard_peer *peer, struct list_head *removed)
 {
 	if (!peer)
 		return;
 	lockdep_assert_held(&peer->device->device_update_lock);
-
-	list_del(&peer->peer_list);
-	noise_handshake_clear(&peer->handshake);
-	noise_keypairs_clear(&peer->keypairs);
+	netlink_notify_peer(peer, WG_PEER_EVENT_REMOVED, NULL);
 	routing_table_remove_by_peer(&peer->device->peer_routing_table, peer);
-	pubkey_hashtable_remove(&peer->device->peer_hashtable, peer);
-	if (peer->device->workqueue)
-		flush_workqueue(peer->device->workqueue);
-	skb_queue_purge(&peer->tx_packet_queue);
-	peer_put(peer);
+	peer_unlink(peer, removed);
+}
+
+void peer_remove_finish(struct wireguard_device *wg, struct list_head *removed)
+{
+	struct wireguard_peer *peer, *temp;
+	lockdep_assert_held(&wg->device_update_lock);
+
+	if (list_empty(removed))
+		return;
+	list_for_each_entry_safe(peer, temp, removed, peer_list) {
+		list_del(&peer->peer_list);
+		/* The workqueues are shared by every device, so we only wait on this peer's own work. Queued
+		 * work holds a reference, which we drop for it when we cancel it before it runs. */
+		if (cancel_work_sync(&peer->transmit_handshake_work))
+			peer_put(peer);
+		if (cancel_work_sync(&peer->clear_peer_work))
+			peer_put(peer);
+		skb_queue_purge(&peer->tx_packet_queue);
+		peer_put(peer);
+	}
+}
+
+void peer_remove(struct wireguard_peer *peer)
+{
+	LIST_HEAD(removed);
+	if (!peer)
+		return;
+	peer_remove_deferred(peer, &removed);
+	peer_remove_finish(peer->device, &removed);
 }
 
 static void rcu_release(struct rcu_head *rcu)
@@ -77,8 +122,7 @@ static void rcu_release(struct rcu_head *rcu)
 	pr_debug("Peer %Lu (%pISpfsc) destroyed\n", peer->internal_id, &peer->endpoint_addr);
 	timers_uninit_peer(peer);
 	skb_queue_purge(&peer->tx_packet_queue);
-	if (peer->endpoint_dst)
-		dst_release(peer->endpoint_dst);
+	socket_free_peer_endpoint(peer);
 	memzero_explicit(peer, sizeof(struct wireguard_peer));
 	kfree(peer);
 }
@@ -128,17 +172,18 @@ int peer_for_each(struct wireguard_device *wg, int (*fn)(struct wireguard_peer *
 void peer_remove_all(struct wireguard_device *wg)
 {
 	struct wireguard_peer *peer, *temp;
+	LIST_HEAD(removed);
 	lockdep_assert_held(&wg->device_update_lock);
+
+	/* Since every peer is going, we can drop the whole routing table at once, instead of walking it. */
+	routing_table_free(&wg->peer_routing_table);
 	list_for_each_entry_safe(peer, temp, &wg->peer_list, peer_list)
-		peer_remove(peer);
+		peer_unlink(peer, &removed);
+	peer_remove_finish(wg, &removed);
 }
 
 unsigned int peer_total_count(struct wireguard_device *wg)
 {
-	unsigned int i = 0;
-	struct wireguard_peer *peer;
 	lockdep_assert_held(&wg->device_update_lock);
-	list_for_each_entry(peer, &wg->peer_list, peer_list)
-		++i;
-	return i;
+	return wg->num_peers;
 }
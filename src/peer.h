@@ -11,15 +11,41 @@
 #include <linux/spinlock.h>
 #include <linux/kref.h>
 
+#define MAX_ENDPOINTS_PER_PEER 4
+
+/* Endpoints are published through RCU, so that the data path never takes endpoint_lock. The address
+ * is never modified once published, and the serial tells the route caches which endpoint they're for.
+ * Only last_received, the jiffies of the latest authenticated packet from there, and mtu, that of the
+ * path there as last seen by the send path, are updated in place. */
+struct endpoint {
+	struct sockaddr_storage addr;
+	unsigned long serial;
+	unsigned long last_received;
+	unsigned int mtu;
+	struct rcu_head rcu;
+};
+
+/* Each CPU keeps its own route to the endpoint, valid for as long as both the serial of the
+ * endpoint and the global route generation, which route related notifiers bump, are unchanged. */
+struct endpoint_cache {
+	struct dst_entry *dst;
+	union {
+		__be32 saddr4;
+		struct in6_addr saddr6;
+	};
+	unsigned long serial;
+	unsigned int generation;
+};
+
 struct wireguard_peer {
 	struct wireguard_device *device;
-	struct sockaddr_storage endpoint_addr;
-	struct dst_entry *endpoint_dst;
-	union {
-		struct flowi4 fl4;
-		struct flowi6 fl6;
-	} endpoint_flow;
-	rwlock_t endpoint_lock;
+	struct endpoint __rcu *endpoints[MAX_ENDPOINTS_PER_PEER]; /* Filled from the start, without gaps. */
+	struct endpoint_cache __percpu *endpoint_cache; /* One per endpoint slot. */
+	struct sockaddr_storage endpoint_addr; /* Latest endpoint, for the control path, protected by endpoint_lock. */
+	unsigned long endpoint_serial;
+	unsigned int max_endpoints;
+	spinlock_t endpoint_lock;
+	unsigned int mtu; /* Largest inner packet the path to the endpoint carries unfragmented, or 0 if unknown. */
 	struct noise_handshake handshake;
 	struct noise_keypairs keypairs;
 	uint64_t last_sent_handshake;
@@ -29,13 +55,19 @@ struct wireguard_peer {
 	uint64_t rx_bytes, tx_bytes;
 	struct timer_list timer_retransmit_handshake, timer_send_keepalive, timer_new_handshake, timer_kill_ephemerals;
 	unsigned int timer_handshake_attempts;
-	bool timer_need_another_keepalive;
+	unsigned long rekey_jitter;
+	bool timer_awaiting_reply, timer_owing_reply; /* Only written when they flip, and read with READ_ONCE. */
+	unsigned long timer_awaiting_reply_since, timer_owing_reply_since;
 	struct timeval walltime_last_handshake;
 	struct sk_buff_head tx_packet_queue;
+	spinlock_t event_lock;
+	unsigned long event_window; /* Jiffies at which the current window of netlink events began. */
+	unsigned int events_in_window, events_suppressed;
 	struct kref refcount;
 	struct rcu_head rcu;
 	struct list_head peer_list;
 	uint64_t internal_id;
+	bool is_dead, replacing_ipmasks;
 };
 
 struct wireguard_peer *peer_create(struct wireguard_device *wg, const u8 public_key[NOISE_PUBLIC_KEY_LEN]);
@@ -44,6 +76,8 @@ struct wireguard_peer *peer_get(struct wireguard_peer *peer);
 void peer_put(struct wireguard_peer *peer);
 void peer_remove(struct wireguard_peer *peer);
 void peer_remove_all(struct wireguard_device *wg);
+void peer_remove_deferred(struct wireguard_peer *peer, struct list_head *removed);
+void peer_remove_finish(struct wireguard_device *wg, struct list_head *removed);
 
 struct wireguard_peer *peer_lookup_by_index(struct wireguard_device *wg, u32 index);
 
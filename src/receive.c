@@ -6,9 +6,14 @@
 #include "timers.h"
 #include "messages.h"
 #include "cookie.h"
+#include "trace.h"
+#include "latency.h"
+#include "drops.h"
+#include "netlink.h"
 #include <linux/ip.h>
 #include <linux/ipv6.h>
 #include <linux/udp.h>
+#include <linux/random.h>
 
 static inline void rx_stats(struct wireguard_peer *peer, size_t len)
 {
@@ -93,7 +98,7 @@ static void receive_handshake_packet(struct wireguard_device *wg, void *data, si
 		return;
 	}
 
-	under_load = skb_queue_len(&wg->incoming_handshakes) >= MAX_QUEUED_HANDSHAKES / 2;
+	under_load = atomic_read(&wg->incoming_handshakes_count) >= MAX_QUEUED_HANDSHAKES / 2;
 	mac_state = cookie_validate_packet(&wg->cookie_checker, skb, data, len, under_load);
 	if ((under_load && mac_state == VALID_MAC_WITH_COOKIE) || (!under_load && mac_state == VALID_MAC_BUT_NO_COOKIE))
 		packet_needs_cookie = false;
@@ -135,6 +140,7 @@ static void receive_handshake_packet(struct wireguard_device *wg, void *data, si
 		if (noise_handshake_begin_session(&peer->handshake, &peer->keypairs, true)) {
 			timers_ephemeral_key_created(peer);
 			timers_handshake_complete(peer);
+			netlink_notify_peer(peer, WG_PEER_EVENT_HANDSHAKE_COMPLETE, NULL);
 			packet_send_queue(peer);
 		}
 		break;
@@ -152,16 +158,73 @@ static void receive_handshake_packet(struct wireguard_device *wg, void *data, si
 	peer_put(peer);
 }
 
+/*
+ * Incoming handshakes are spread over buckets keyed by a hash of their source address, and
+ * the worker serves the buckets round robin. During a reconnect storm, a few sources
+ * retransmitting aggressively can then only fill their own buckets, rather than starving
+ * everybody else out of a single shared queue.
+ */
+void packet_handshake_queue_init(struct wireguard_device *wg)
+{
+	size_t i;
+
+	for (i = 0; i < HANDSHAKE_QUEUE_BUCKETS; ++i)
+		skb_queue_head_init(&wg->incoming_handshakes[i]);
+	atomic_set(&wg->incoming_handshakes_count, 0);
+	wg->incoming_handshakes_next = 0;
+	get_random_bytes(wg->incoming_handshakes_key, SIPHASH24_KEY_LEN);
+}
+
+void packet_handshake_queue_purge(struct wireguard_device *wg)
+{
+	struct sk_buff *skb;
+	size_t i;
+
+	for (i = 0; i < HANDSHAKE_QUEUE_BUCKETS; ++i) {
+		while ((skb = skb_dequeue(&wg->incoming_handshakes[i])) != NULL) {
+			atomic_dec(&wg->incoming_handshakes_count);
+			dev_kfree_skb(skb);
+		}
+	}
+}
+
+static inline struct sk_buff_head *handshake_queue_for_skb(struct wireguard_device *wg, struct sk_buff *skb)
+{
+	uint64_t hash;
+
+	if (ip_hdr(skb)->version == 4)
+		hash = siphash24((u8 *)&ip_hdr(skb)->saddr, sizeof(ip_hdr(skb)->saddr), wg->incoming_handshakes_key);
+	else
+		hash = siphash24((u8 *)&ipv6_hdr(skb)->saddr, sizeof(ipv6_hdr(skb)->saddr), wg->incoming_handshakes_key);
+	return &wg->incoming_handshakes[hash & (HANDSHAKE_QUEUE_BUCKETS - 1)];
+}
+
 void packet_process_queued_handshake_packets(struct work_struct *work)
 {
 	struct wireguard_device *wg = container_of(work, struct wireguard_device, incoming_handshakes_work);
+	struct sk_buff_head *queue;
 	struct sk_buff *skb;
 	size_t len, offset;
-	size_t num_processed = 0;
-
-	while ((skb = skb_dequeue(&wg->incoming_handshakes)) != NULL) {
-		if (!skb_data_offset(skb, &offset, &len))
+	size_t num_processed = 0, num_empty = 0;
+	u64 latency;
+
+	/* This work item never runs concurrently with itself, so it owns incoming_handshakes_next. */
+	while (atomic_read(&wg->incoming_handshakes_count) > 0 && num_empty < HANDSHAKE_QUEUE_BUCKETS) {
+		queue = &wg->incoming_handshakes[wg->incoming_handshakes_next];
+		skb = skb_dequeue(queue);
+		wg->incoming_handshakes_next = (wg->incoming_handshakes_next + 1) % HANDSHAKE_QUEUE_BUCKETS;
+		if (!skb) {
+			++num_empty;
+			continue;
+		}
+		num_empty = 0;
+		atomic_dec(&wg->incoming_handshakes_count);
+		latency = latency_record(wg, LATENCY_HANDSHAKE_QUEUE, LATENCY_CB(skb)->queued);
+		if (!skb_data_offset(skb, &offset, &len)) {
+			trace_wg_handshake_consume(wg, ((struct message_header *)(skb->data + offset))->type, len, skb_queue_len(queue));
 			receive_handshake_packet(wg, skb->data + offset, len, skb);
+		}
+		latency_record(wg, LATENCY_HANDSHAKE_PROCESS, latency);
 		dev_kfree_skb(skb);
 		if (++num_processed == MAX_BURST_HANDSHAKES) {
 			queue_work(wg->workqueue, &wg->incoming_handshakes_work);
@@ -175,6 +238,11 @@ static void receive_data_packet(struct sk_buff *skb, struct wireguard_peer *peer
 	struct net_device *dev;
 	struct wireguard_peer *routed_peer;
 	struct wireguard_device *wg;
+	unsigned int len;
+	u64 latency;
+	int ret;
+
+	trace_wg_receive_data_packet(peer, skb->len, used_new_key, err);
 
 	if (unlikely(err < 0 || !peer || !addr)) {
 		dev_kfree_skb(skb);
@@ -194,15 +262,13 @@ static void receive_data_packet(struct sk_buff *skb, struct wireguard_peer *peer
 	}
 
 	if (unlikely(skb->len < sizeof(struct iphdr))) {
-		++dev->stats.rx_errors;
-		++dev->stats.rx_length_errors;
+		drop_count(wg, WG_DROP_RX_INVALID_LENGTH);
 		net_dbg_ratelimited("Packet missing ip header from peer %Lu (%pISpfsc)\n", peer->internal_id, addr);
 		goto packet_processed;
 	}
 
 	if (!pskb_may_pull(skb, 1 /* For checking the ip version below */)) {
-		++dev->stats.rx_errors;
-		++dev->stats.rx_length_errors;
+		drop_count(wg, WG_DROP_RX_INVALID_LENGTH);
 		net_dbg_ratelimited("Packet missing IP version from peer %Lu (%pISpfsc)\n", peer->internal_id, addr);
 		goto packet_processed;
 	}
@@ -213,15 +279,13 @@ static void receive_data_packet(struct sk_buff *skb, struct wireguard_peer *peer
 		skb->protocol = htons(ETH_P_IP);
 	else if (ip_hdr(skb)->version == 6) {
 		if (unlikely(skb->len < sizeof(struct ipv6hdr))) {
-			++dev->stats.rx_errors;
-			++dev->stats.rx_length_errors;
+			drop_count(wg, WG_DROP_RX_INVALID_LENGTH);
 			net_dbg_ratelimited("Packet missing ipv6 header from peer %Lu (%pISpfsc)\n", peer->internal_id, addr);
 			goto packet_processed;
 		}
 		skb->protocol = htons(ETH_P_IPV6);
 	} else {
-		++dev->stats.rx_errors;
-		++dev->stats.rx_length_errors;
+		drop_count(wg, WG_DROP_RX_INVALID_LENGTH);
 		net_dbg_ratelimited("Packet neither ipv4 nor ipv6 from peer %Lu (%pISpfsc)\n", peer->internal_id, addr);
 		goto packet_processed;
 	}
@@ -237,16 +301,19 @@ static void receive_data_packet(struct sk_buff *skb, struct wireguard_peer *peer
 		socket_addr_from_skb(&unencrypted_addr, skb);
 		net_dbg_ratelimited("Packet has unallowed src IP (%pISc) from peer %Lu (%pISpfsc)\n", &unencrypted_addr, peer->internal_id, addr);
 #endif
-		++dev->stats.rx_errors;
-		++dev->stats.rx_frame_errors;
+		drop_count(wg, WG_DROP_RX_UNALLOWED_SOURCE);
 		goto packet_processed;
 	}
 
 	dev->last_rx = jiffies;
-	if (netif_rx(skb) == NET_RX_SUCCESS)
-		rx_stats(peer, skb->len);
+	len = skb->len;
+	latency = latency_now(wg);
+	ret = netif_rx(skb);
+	latency_record(wg, LATENCY_RX_DELIVER, latency);
+	if (ret == NET_RX_SUCCESS)
+		rx_stats(peer, len);
 	else {
-		++dev->stats.rx_dropped;
+		drop_count(wg, WG_DROP_RX_STACK);
 		net_dbg_ratelimited("Failed to give packet to userspace from peer %Lu (%pISpfsc)\n", peer->internal_id, addr);
 	}
 	goto continue_processing;
@@ -261,6 +328,7 @@ continue_processing:
 
 void packet_receive(struct wireguard_device *wg, struct sk_buff *skb)
 {
+	struct sk_buff_head *queue;
 	size_t len, offset;
 #ifdef DEBUG
 	struct sockaddr_storage addr = { 0 };
@@ -269,21 +337,30 @@ void packet_receive(struct wireguard_device *wg, struct sk_buff *skb)
 	static const u8 addr;
 #endif
 
-	if (skb_data_offset(skb, &offset, &len) < 0)
+	if (skb_data_offset(skb, &offset, &len) < 0) {
+		drop_count(wg, WG_DROP_RX_INVALID);
 		goto err;
+	}
 	switch (message_determine_type(skb->data + offset, len)) {
 	case MESSAGE_HANDSHAKE_INITIATION:
 	case MESSAGE_HANDSHAKE_RESPONSE:
 	case MESSAGE_HANDSHAKE_COOKIE:
-		if (skb_queue_len(&wg->incoming_handshakes) > MAX_QUEUED_HANDSHAKES) {
+		queue = handshake_queue_for_skb(wg, skb);
+		if (atomic_read(&wg->incoming_handshakes_count) > MAX_QUEUED_HANDSHAKES || skb_queue_len(queue) >= MAX_QUEUED_HANDSHAKES_PER_BUCKET) {
 			net_dbg_ratelimited("Too many handshakes queued, dropping packet from %pISpfsc\n", &addr);
+			drop_count(wg, WG_DROP_RX_HANDSHAKE_QUEUE_FULL);
 			goto err;
 		}
 		if (skb_linearize(skb) < 0) {
 			net_dbg_ratelimited("Unable to linearize handshake skb from %pISpfsc\n", &addr);
+			drop_count(wg, WG_DROP_RX_NO_MEMORY);
 			goto err;
 		}
-		skb_queue_tail(&wg->incoming_handshakes, skb);
+		/* Count it before it becomes visible, so that the count never drops below zero. */
+		atomic_inc(&wg->incoming_handshakes_count);
+		trace_wg_handshake_enqueue(wg, ((struct message_header *)(skb->data + offset))->type, len, skb_queue_len(queue));
+		LATENCY_CB(skb)->queued = latency_now(wg);
+		skb_queue_tail(queue, skb);
 		/* Queues up a call to packet_process_queued_handshake_packets(skb): */
 		queue_work(wg->workqueue, &wg->incoming_handshakes_work);
 		break;
@@ -292,6 +369,7 @@ void packet_receive(struct wireguard_device *wg, struct sk_buff *skb)
 		break;
 	default:
 		net_dbg_ratelimited("Invalid packet from %pISpfsc\n", &addr);
+		drop_count(wg, WG_DROP_RX_INVALID);
 		goto err;
 	}
 	return;
@@ -10,6 +10,7 @@ struct routing_table_node {
 	uint8_t cidr;
 	uint8_t bit_at_a, bit_at_b;
 	bool incidental;
+	bool stale;
 	uint8_t bits[];
 };
 
@@ -67,6 +68,7 @@ static void free_node(struct routing_table_node *top, struct mutex *lock)
 }
 #undef push
 #define push(p) do { BUG_ON(len >= 128); stack[len++] = p; } while (0)
+/* Removes the nodes of `peer`, or, if `peer` is NULL, every stale node and the nodes of every peer that is_dead. */
 static bool walk_remove_by_peer(struct routing_table_node __rcu **top, struct wireguard_peer *peer, struct mutex *lock)
 {
 	struct routing_table_node __rcu **stack[128];
@@ -93,10 +95,11 @@ static bool walk_remove_by_peer(struct routing_table_node __rcu **top, struct wi
 			if (ref(node->bit[1]))
 				push(&node->bit[1]);
 		} else {
-			if (node->peer == peer) {
+			if (node->peer && (peer ? node->peer == peer : (node->stale || node->peer->is_dead))) {
 				ret = true;
 				node->peer = NULL;
 				node->incidental = true;
+				node->stale = false;
 				if (!node->bit[0] || !node->bit[1]) {
 					/* collapse (even if both are null) */
 					rcu_assign_pointer(*nptr, rcu_dereference_protected(node->bit[!node->bit[0]], lockdep_is_held(lock)));
@@ -223,6 +226,7 @@ static int add(struct routing_table_node __rcu **trie, uint8_t bits, const uint8
 	if (node_placement(*trie, key, cidr, &node, lock)) {
 		/* exact match */
 		node->incidental = false;
+		node->stale = false;
 		node->peer = peer;
 		return 0;
 	}
@@ -342,6 +346,26 @@ static int walk_ips_by_peer(struct routing_table_node *top, int family, void *ct
 	}
 	return 0;
 }
+static void walk_mark_stale(struct routing_table_node *top, struct mutex *maybe_lock)
+{
+	struct routing_table_node *stack[128];
+	struct routing_table_node *node;
+	unsigned int len = 0;
+
+	if (!top)
+		return;
+
+	stack[len++] = top;
+	while (len > 0) {
+		node = stack[--len];
+
+		if (node->peer && node->peer->replacing_ipmasks)
+			node->stale = true;
+
+		push(node->bit[0]);
+		push(node->bit[1]);
+	}
+}
 #undef push
 
 void routing_table_init(struct routing_table *table)
@@ -431,12 +455,35 @@ int routing_table_remove_v6(struct routing_table *table, const struct in6_addr *
 int routing_table_remove_by_peer(struct routing_table *table, struct wireguard_peer *peer)
 {
 	bool found;
+	if (!peer)
+		return -EINVAL;
 	mutex_lock(&table->table_update_lock);
 	found = walk_remove_by_peer(&table->root4, peer, &table->table_update_lock) | walk_remove_by_peer(&table->root6, peer, &table->table_update_lock);
 	mutex_unlock(&table->table_update_lock);
 	return found ? 0 : -EINVAL;
 }
 
+/* Marks every entry whose peer is replacing_ipmasks as stale. Entries that get inserted again afterwards
+ * lose the mark, and routing_table_remove_stale then removes the rest, so that replacing a peer's ipmasks
+ * never leaves a moment where an unchanged ipmask is missing from the table. */
+void routing_table_mark_stale(struct routing_table *table)
+{
+	mutex_lock(&table->table_update_lock);
+	walk_mark_stale(rcu_dereference_protected(table->root4, lockdep_is_held(&table->table_update_lock)), &table->table_update_lock);
+	walk_mark_stale(rcu_dereference_protected(table->root6, lockdep_is_held(&table->table_update_lock)), &table->table_update_lock);
+	mutex_unlock(&table->table_update_lock);
+}
+
+/* Removes every stale entry, along with the entries of every dead peer, in a single walk, rather than one walk per peer. */
+int routing_table_remove_stale(struct routing_table *table)
+{
+	bool found;
+	mutex_lock(&table->table_update_lock);
+	found = walk_remove_by_peer(&table->root4, NULL, &table->table_update_lock) | walk_remove_by_peer(&table->root6, NULL, &table->table_update_lock);
+	mutex_unlock(&table->table_update_lock);
+	return found ? 0 : -EINVAL;
+}
+
 /* Calls func with a strong reference to each peer, before putting it when the function has completed.
  * It's thus up to the caller to call peer_put on it if it's going to be used elsewhere after or stored. */
 int routing_table_walk_ips(struct routing_table *table, void *ctx, int (*func)(void *ctx, struct wireguard_peer *peer, union nf_inet_addr ip, uint8_t cidr, int family))
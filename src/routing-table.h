@@ -24,6 +24,8 @@ int routing_table_insert_v6(struct routing_table *table, const struct in6_addr *
 int routing_table_remove_v4(struct routing_table *table, const struct in_addr *ip, uint8_t cidr);
 int routing_table_remove_v6(struct routing_table *table, const struct in6_addr *ip, uint8_t cidr);
 int routing_table_remove_by_peer(struct routing_table *table, struct wireguard_peer *peer);
+void routing_table_mark_stale(struct routing_table *table);
+int routing_table_remove_stale(struct routing_table *table);
 int routing_table_walk_ips(struct routing_table *table, void *ctx, int (*func)(void *ctx, struct wireguard_peer *peer, union nf_inet_addr ip, uint8_t cidr, int family));
 int routing_table_walk_ips_by_peer(struct routing_table *table, void *ctx, struct wireguard_peer *peer, int (*func)(void *ctx, union nf_inet_addr ip, uint8_t cidr, int family));
 int routing_table_walk_ips_by_peer_sleepable(struct routing_table *table, void *ctx, struct wireguard_peer *peer, int (*func)(void *ctx, union nf_inet_addr ip, uint8_t cidr, int family));
@@ -7,6 +7,11 @@
 #include "socket.h"
 #include "messages.h"
 #include "cookie.h"
+#include "skbpool.h"
+#include "trace.h"
+#include "latency.h"
+#include "drops.h"
+#include "netlink.h"
 #include <net/udp.h>
 #include <net/sock.h>
 #include <linux/uio.h>
@@ -40,6 +45,7 @@ void packet_send_handshake_response(struct wireguard_peer *peer)
 		if (noise_handshake_begin_session(&peer->handshake, &peer->keypairs, false)) {
 			timers_ephemeral_key_created(peer);
 			socket_send_buffer_to_peer(peer, &packet, sizeof(struct message_handshake_response), HANDSHAKE_DSCP);
+			netlink_notify_peer(peer, WG_PEER_EVENT_HANDSHAKE_COMPLETE, NULL);
 		}
 	}
 }
@@ -60,7 +66,7 @@ void packet_queue_send_handshake_initiation(struct wireguard_peer *peer)
 	if (!peer)
 		return;
 	/* Queues up calling packet_send_queued_handshakes(peer), where we do a peer_put(peer) after: */
-	if (!queue_work(peer->device->workqueue, &peer->transmit_handshake_work))
+	if (!queue_work(peer->device->handshake_send_wq, &peer->transmit_handshake_work))
 		peer_put(peer); /* If the work was already queued, we want to drop the extra reference */
 }
 
@@ -84,10 +90,34 @@ void packet_send_handshake_cookie(struct wireguard_device *wg, struct sk_buff *i
 	socket_send_buffer_as_reply_to_skb(initiating_skb, &packet, sizeof(packet), wg);
 }
 
+/* Caps how many rekeys per second the whole device starts. Rekeys ahead of their deadline get a
+ * smaller share, so that they never crowd out those that are due. Rekeys that are turned away here
+ * are simply retried on a later packet, which spreads a cohort that came due together over the
+ * following seconds, until MAX_REKEY_DEFERRAL past the deadline, when they bypass this limit. */
+static bool rekey_allowed(struct wireguard_device *wg, unsigned int limit)
+{
+	bool ret = false;
+	uint64_t now = get_jiffies_64();
+
+	spin_lock_bh(&wg->rekey_limit_lock);
+	if (time_after_eq64(now, wg->rekey_limit_window + HZ)) {
+		wg->rekey_limit_window = now;
+		wg->rekey_limit_count = 0;
+	}
+	if (wg->rekey_limit_count < limit) {
+		++wg->rekey_limit_count;
+		ret = true;
+	}
+	spin_unlock_bh(&wg->rekey_limit_lock);
+	return ret;
+}
+
 static inline void keep_key_fresh(struct wireguard_peer *peer)
 {
 	struct noise_keypair *keypair;
 	unsigned long rekey_after_time = REKEY_AFTER_TIME;
+	unsigned int limit = 0;
+	bool send = false;
 
 	rcu_read_lock();
 	keypair = rcu_dereference(peer->keypairs.current_keypair);
@@ -101,20 +131,30 @@ static inline void keep_key_fresh(struct wireguard_peer *peer)
 		rekey_after_time += REKEY_TIMEOUT * 2;
 
 	if (atomic64_read(&keypair->sending.counter.counter) > REKEY_AFTER_MESSAGES ||
-	    time_is_before_eq_jiffies64(keypair->sending.birthdate + rekey_after_time)) {
-		rcu_read_unlock();
+	    time_is_before_eq_jiffies64(keypair->sending.birthdate + rekey_after_time + MAX_REKEY_DEFERRAL))
+		send = true;
+	else if (time_is_before_eq_jiffies64(keypair->sending.birthdate + rekey_after_time))
+		limit = MAX_REKEYS_PER_SECOND;
+	/* The initiator spreads its rekeys out over the window before the deadline. The responder
+	 * keeps its later deadline as-is, so that it still only steps in when the initiator didn't. */
+	else if (keypair->i_am_the_initiator &&
+		 time_is_before_eq_jiffies64(keypair->sending.birthdate + rekey_after_time - REKEY_JITTER_WINDOW + peer->rekey_jitter))
+		limit = MAX_EARLY_REKEYS_PER_SECOND;
+	rcu_read_unlock();
+
+	if (limit && time_is_before_jiffies64(peer->last_sent_handshake + REKEY_TIMEOUT))
+		send = rekey_allowed(peer->device, limit);
+	if (send)
 		ratelimit_packet_send_handshake_initiation(peer);
-	} else
-		rcu_read_unlock();
 }
 
 void packet_send_keepalive(struct wireguard_peer *peer)
 {
-	struct sk_buff *skb = alloc_skb(DATA_PACKET_HEAD_ROOM + MESSAGE_MINIMUM_LENGTH, GFP_ATOMIC);
+	struct sk_buff *skb = skb_pool_alloc(0);
 	if (unlikely(!skb))
 		return;
-	skb_reserve(skb, DATA_PACKET_HEAD_ROOM);
 	skb->dev = netdev_pub(peer->device);
+	LATENCY_CB(skb)->queued = latency_now(peer->device);
 	skb_queue_tail(&peer->tx_packet_queue, skb);
 	packet_send_queue(peer);
 }
@@ -127,13 +167,34 @@ struct packet_bundle {
 static inline void send_off_bundle(struct packet_bundle *bundle, struct wireguard_peer *peer)
 {
 	struct sk_buff *skb, *next;
+	bool data_sent = false;
+	u64 latency;
+
+	if (trace_wg_send_off_bundle_enabled()) {
+		unsigned int packets = 0, bytes = 0;
+		for (skb = bundle->first; skb; skb = skb->next) {
+			++packets;
+			bytes += skb->len;
+		}
+		trace_wg_send_off_bundle(peer, packets, bytes);
+	}
+
 	for (skb = bundle->first; skb; skb = next) {
 		/* We store the next pointer locally because socket_send_skb_to_peer
 		 * consumes the packet before the top of the loop comes again. */
 		next = skb->next;
+		latency = latency_now(peer->device);
 		if (likely(!socket_send_skb_to_peer(peer, skb, 0 /* TODO: Should we copy the DSCP value from the enclosed packet? */)))
-			timers_data_sent(peer);
+			data_sent = true;
+		else
+			drop_count(peer->device, WG_DROP_TX_SEND);
+		latency_record(peer->device, LATENCY_TX_SEND, latency);
 	}
+	/* The timers and the key freshness only care about whether something went out and
+	 * when, not how many packets did, so we only do this bookkeeping once per bundle. */
+	if (likely(data_sent))
+		timers_data_sent(peer);
+	keep_key_fresh(peer);
 }
 
 static void message_create_data_done(struct sk_buff *skb, struct wireguard_peer *peer)
@@ -143,7 +204,6 @@ static void message_create_data_done(struct sk_buff *skb, struct wireguard_peer
 	 * remaining, and if we hit zero we can send it off. */
 	if (atomic_dec_and_test(&bundle->count))
 		send_off_bundle(bundle, peer);
-	keep_key_fresh(peer);
 }
 
 int packet_send_queue(struct wireguard_peer *peer)
@@ -153,6 +213,7 @@ int packet_send_queue(struct wireguard_peer *peer)
 	struct sk_buff *skb, *next, *first;
 	unsigned long flags;
 	bool parallel = true;
+	int ret;
 
 	/* Steal the current queue into our local one. */
 	skb_queue_head_init(&local_queue);
@@ -188,7 +249,8 @@ int packet_send_queue(struct wireguard_peer *peer)
 		*(struct packet_bundle **)skb->cb = bundle;
 
 		/* We submit it for encryption and sending. */
-		switch (packet_create_data(skb, peer, message_create_data_done, parallel)) {
+		ret = packet_create_data(skb, peer, message_create_data_done, parallel);
+		switch (ret) {
 		case 0:
 			/* If all goes well, we can simply deincrement the queue counter. Even
 			 * though skb_dequeue() would do this for us, we don't want to break the
@@ -248,6 +310,7 @@ int packet_send_queue(struct wireguard_peer *peer)
 			if (skb->next)
 				skb->next->prev = skb->prev;
 			kfree_skb(skb);
+			drop_count(peer->device, ret == -ENOMEM ? WG_DROP_TX_NO_MEMORY : WG_DROP_TX_ENCRYPT);
 			if (atomic_dec_and_test(&bundle->count)) {
 				/* As above, if this failed packet pushes the count to zero, we have to
 				 * be the ones to send it off only in the case that there's something to
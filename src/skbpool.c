@@ -0,0 +1,95 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#include "skbpool.h"
+#include "packets.h"
+#include "messages.h"
+#include <linux/percpu.h>
+#include <linux/skbuff.h>
+#include <linux/workqueue.h>
+
+/* Keepalives, handshake messages and cookie replies are small, and are all sent from atomic context,
+ * which is often when memory is tightest. Each CPU therefore keeps a few buffers already shaped for them,
+ * which the system workqueue tops back up with GFP_KERNEL whenever they run low. Pools start out empty,
+ * and fill up the first time their CPU sends something. */
+
+enum {
+	SKB_POOL_SIZE = 16,
+	SKB_POOL_LOW_WATERMARK = SKB_POOL_SIZE / 2
+};
+
+#define SKB_POOL_DATA_LEN max3(sizeof(struct message_handshake_initiation), sizeof(struct message_handshake_response), sizeof(struct message_handshake_cookie))
+/* The tailroom takes the auth tag, so that encrypting a keepalive never has to copy it. */
+#define SKB_POOL_TAIL_ROOM noise_encrypted_len(0)
+
+struct skb_pool {
+	struct sk_buff_head skbs;
+	struct work_struct refill_work;
+};
+
+static struct skb_pool __percpu *skb_pools;
+
+static void refill(struct work_struct *work)
+{
+	struct skb_pool *pool = container_of(work, struct skb_pool, refill_work);
+	struct sk_buff *skb;
+
+	while (skb_queue_len(&pool->skbs) < SKB_POOL_SIZE) {
+		skb = alloc_skb(DATA_PACKET_HEAD_ROOM + SKB_POOL_DATA_LEN + SKB_POOL_TAIL_ROOM, GFP_KERNEL);
+		if (!skb)
+			break;
+		skb_reserve(skb, DATA_PACKET_HEAD_ROOM);
+		skb_queue_tail(&pool->skbs, skb);
+	}
+}
+
+/* Returns an empty skb with DATA_PACKET_HEAD_ROOM of headroom and room after that for len bytes and an
+ * auth tag, taken from this CPU's pool when len allows, and from the slab allocator otherwise. */
+struct sk_buff *skb_pool_alloc(size_t len)
+{
+	struct skb_pool *pool;
+	struct sk_buff *skb;
+
+	if (likely(len <= SKB_POOL_DATA_LEN)) {
+		/* The queue's lock is what protects it, since refill may run on any CPU. Staying on this
+		 * one just keeps the pool we drain the same as the pool we ask to be refilled. */
+		pool = get_cpu_ptr(skb_pools);
+		skb = skb_dequeue(&pool->skbs);
+		if (skb_queue_len(&pool->skbs) < SKB_POOL_LOW_WATERMARK)
+			schedule_work(&pool->refill_work);
+		put_cpu_ptr(skb_pools);
+		if (likely(skb))
+			return skb;
+	}
+
+	skb = alloc_skb(DATA_PACKET_HEAD_ROOM + len + SKB_POOL_TAIL_ROOM, GFP_ATOMIC);
+	if (likely(skb))
+		skb_reserve(skb, DATA_PACKET_HEAD_ROOM);
+	return skb;
+}
+
+int skb_pool_init(void)
+{
+	int cpu;
+
+	skb_pools = alloc_percpu(struct skb_pool);
+	if (!skb_pools)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct skb_pool *pool = per_cpu_ptr(skb_pools, cpu);
+		skb_queue_head_init(&pool->skbs);
+		INIT_WORK(&pool->refill_work, refill);
+	}
+	return 0;
+}
+
+void skb_pool_uninit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct skb_pool *pool = per_cpu_ptr(skb_pools, cpu);
+		cancel_work_sync(&pool->refill_work);
+		skb_queue_purge(&pool->skbs);
+	}
+	free_percpu(skb_pools);
+}
@@ -0,0 +1,15 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#ifndef WGSKBPOOL_H
+#define WGSKBPOOL_H
+
+#include <linux/types.h>
+
+struct sk_buff;
+
+int skb_pool_init(void);
+void skb_pool_uninit(void);
+
+struct sk_buff *skb_pool_alloc(size_t len);
+
+#endif
@@ -4,12 +4,31 @@
 #include "socket.h"
 #include "packets.h"
 #include "messages.h"
+#include "uapi.h"
+#include "skbpool.h"
+#include "netlink.h"
+#include "cpumap.h"
 
 #include <linux/net.h>
 #include <linux/if_vlan.h>
 #include <linux/if_ether.h>
+#include <linux/inetdevice.h>
+#include <linux/rtnetlink.h>
+#include <net/ip.h>
 #include <net/udp_tunnel.h>
 #include <net/ipv6.h>
+#include <net/addrconf.h>
+#include <net/netevent.h>
+#include <net/xfrm.h>
+#include <linux/netfilter.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+#include <net/sock_reuseport.h>
+#include <linux/filter.h>
+#endif
+
+/* An endpoint that hasn't been heard from in a keepalive interval and a handshake timeout no longer
+ * gets flows of its own. */
+#define ENDPOINT_LIVE_TIMEOUT (10 * HZ + REKEY_TIMEOUT)
 
 int socket_addr_from_skb(struct sockaddr_storage *sockaddr, struct sk_buff *skb)
 {
@@ -60,7 +79,8 @@ static inline struct dst_entry *route(struct wireguard_device *wg, struct flowi4
 		rt = ip_route_output_flow(sock_net(sock4), fl4, sock4);
 		if (unlikely(IS_ERR(rt)))
 			dst = ERR_PTR(PTR_ERR(rt));
-		dst = &rt->dst;
+		else
+			dst = &rt->dst;
 	} else if (addr->ss_family == AF_INET6) {
 		int ret;
 		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
@@ -88,7 +108,10 @@ static inline struct dst_entry *route(struct wireguard_device *wg, struct flowi4
 	return dst;
 }
 
-static inline int send(struct net_device *dev, struct sk_buff *skb, struct dst_entry *dst, struct flowi4 *fl4, struct flowi6 *fl6, struct sockaddr_storage *addr, struct sock *sock4, struct sock *sock6, u8 dscp)
+/* The outer headers are built per packet by the UDP tunnel helpers, rather than copied from a template
+ * kept per peer, since those helpers also take care of checksum offload, IP ID selection and scrubbing,
+ * each differently on the kernels we support. */
+static inline int send(struct net_device *dev, struct sk_buff *skb, struct dst_entry *dst, struct flowi4 *fl4, struct flowi6 *fl6, struct sockaddr_storage *addr, struct sock *sock4, struct sock *sock6, u8 dscp, __be16 df)
 {
 	int ret = -EAFNOSUPPORT;
 
@@ -104,7 +127,7 @@ static inline int send(struct net_device *dev, struct sk_buff *skb, struct dst_e
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
 		ret = udp_tunnel_xmit_skb((struct rtable *)dst, sock4, skb,
 					  fl4->saddr, fl4->daddr,
-					  dscp, ip4_dst_hoplimit(dst), 0,
+					  dscp, ip4_dst_hoplimit(dst), df,
 					  fl4->fl4_sport, fl4->fl4_dport,
 					  false, false);
 		iptunnel_xmit_stats(ret, &dev->stats, dev->tstats);
@@ -112,7 +135,7 @@ static inline int send(struct net_device *dev, struct sk_buff *skb, struct dst_e
 #else
 		udp_tunnel_xmit_skb((struct rtable *)dst, sock4, skb,
 				    fl4->saddr, fl4->daddr,
-				    dscp, ip4_dst_hoplimit(dst), 0,
+				    dscp, ip4_dst_hoplimit(dst), df,
 				    fl4->fl4_sport, fl4->fl4_dport,
 				    false, false);
 		return 0;
@@ -139,7 +162,7 @@ static inline int send(struct net_device *dev, struct sk_buff *skb, struct dst_e
 #else
 		udp_tunnel6_xmit_skb(dst, sock6, skb, dev,
 				     &fl6->saddr, &fl6->daddr,
-				     dscp, ip6_dst_hoplimit(dst), 0,
+				     dscp, ip6_dst_hoplimit(dst), fl6->flowlabel,
 				     fl6->fl6_sport, fl6->fl6_dport,
 				     false);
 		return 0;
@@ -152,119 +175,388 @@ err:
 	return ret;
 }
 
-static inline void __socket_set_peer_dst(struct wireguard_peer *peer)
+static atomic_t route_generation = ATOMIC_INIT(0);
+
+/* When the other end spreads its source ports, packets from the same address and from any port
+ * in the range that goes with the one we have on record still come from the same endpoint.
+ * Following each one of them would only churn the endpoint and its route caches. */
+static inline bool within_port_spread(__be16 port, __be16 known_port)
 {
-	struct dst_entry *old_dst, *new_dst;
-	lockdep_assert_held(&peer->endpoint_lock);
+	return (u16)(ntohs(port) - WG_SOURCE_PORT_SPREAD_BASE(ntohs(known_port))) < WG_SOURCE_PORT_SPREAD;
+}
 
-	old_dst = peer->endpoint_dst;
-	peer->endpoint_dst = NULL;
-	wmb();
-	if (old_dst)
-		dst_release(old_dst);
+static inline bool within_port_spread_of(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	if (a->ss_family == AF_INET && b->ss_family == AF_INET)
+		return ((struct sockaddr_in *)a)->sin_addr.s_addr == ((struct sockaddr_in *)b)->sin_addr.s_addr &&
+		       within_port_spread(((struct sockaddr_in *)a)->sin_port, ((struct sockaddr_in *)b)->sin_port);
+	if (a->ss_family == AF_INET6 && b->ss_family == AF_INET6)
+		return ipv6_addr_equal(&((struct sockaddr_in6 *)a)->sin6_addr, &((struct sockaddr_in6 *)b)->sin6_addr) &&
+		       ((struct sockaddr_in6 *)a)->sin6_scope_id == ((struct sockaddr_in6 *)b)->sin6_scope_id &&
+		       within_port_spread(((struct sockaddr_in6 *)a)->sin6_port, ((struct sockaddr_in6 *)b)->sin6_port);
+	return false;
+}
 
+static inline size_t endpoint_addr_len(const struct sockaddr_storage *addr)
+{
+	if (addr->ss_family == AF_INET)
+		return sizeof(struct sockaddr_in);
+	if (addr->ss_family == AF_INET6)
+		return sizeof(struct sockaddr_in6);
+	return 0;
+}
+
+static inline bool endpoint_matches(struct wireguard_peer *peer, struct endpoint *endpoint, struct sockaddr_storage *sockaddr, size_t len)
+{
+	return !memcmp(sockaddr, &endpoint->addr, len) || (peer->device->spread_source_ports && within_port_spread_of(sockaddr, &endpoint->addr));
+}
+
+static struct endpoint *endpoint_alloc(struct sockaddr_storage *sockaddr, size_t len, gfp_t gfp)
+{
+	struct endpoint *endpoint = kzalloc(sizeof(struct endpoint), gfp);
+	if (unlikely(!endpoint))
+		return NULL;
+	memcpy(&endpoint->addr, sockaddr, len);
+	endpoint->last_received = jiffies;
+	return endpoint;
+}
+
+void socket_set_peer_addr(struct wireguard_peer *peer, struct sockaddr_storage *sockaddr)
+{
+	struct endpoint *endpoint, *old, *oldest = NULL;
+	unsigned int i, slot = 0;
+	unsigned long now = jiffies;
+	size_t len = endpoint_addr_len(sockaddr);
+
+	if (!len)
+		return;
+
+	/* This is called for every received packet, and nearly always the endpoint is one we know. Its
+	 * timestamp is only written once per jiffy, so that every packet doesn't dirty the cacheline. */
 	rcu_read_lock();
-	new_dst = route(peer->device, &peer->endpoint_flow.fl4, &peer->endpoint_flow.fl6, &peer->endpoint_addr, rcu_dereference(peer->device->sock4), rcu_dereference(peer->device->sock6));
+	for (i = 0; i < MAX_ENDPOINTS_PER_PEER; ++i) {
+		endpoint = rcu_dereference(peer->endpoints[i]);
+		if (!endpoint)
+			break;
+		if (likely(endpoint_matches(peer, endpoint, sockaddr, len))) {
+			if (READ_ONCE(endpoint->last_received) != now)
+				WRITE_ONCE(endpoint->last_received, now);
+			rcu_read_unlock();
+			return;
+		}
+	}
 	rcu_read_unlock();
 
-	if (likely(!IS_ERR(new_dst))) {
-		peer->endpoint_dst = new_dst;
-		wmb();
+	endpoint = endpoint_alloc(sockaddr, len, GFP_ATOMIC);
+	if (unlikely(!endpoint))
+		return;
+
+	/* With a single endpoint, a new address means the peer has roamed. With several, it is another one
+	 * of the peer's addresses, which takes a free slot, or else the slot heard from least recently. */
+	spin_lock_bh(&peer->endpoint_lock);
+	for (i = 0; i < peer->max_endpoints; ++i) {
+		old = rcu_dereference_protected(peer->endpoints[i], lockdep_is_held(&peer->endpoint_lock));
+		if (!old) {
+			slot = i;
+			break;
+		}
+		if (!memcmp(sockaddr, &old->addr, len)) {
+			spin_unlock_bh(&peer->endpoint_lock);
+			kfree(endpoint);
+			return;
+		}
+		if (!oldest || time_before(READ_ONCE(old->last_received), READ_ONCE(oldest->last_received))) {
+			oldest = old;
+			slot = i;
+		}
 	}
+	old = rcu_dereference_protected(peer->endpoints[slot], lockdep_is_held(&peer->endpoint_lock));
+	endpoint->serial = ++peer->endpoint_serial;
+	peer->endpoint_addr = endpoint->addr;
+	rcu_assign_pointer(peer->endpoints[slot], endpoint);
+	spin_unlock_bh(&peer->endpoint_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+	netlink_notify_peer(peer, WG_PEER_EVENT_ENDPOINT_CHANGED, sockaddr);
 }
 
-void socket_set_peer_dst(struct wireguard_peer *peer)
+/* Replaces all of the peer's endpoints with those given, allowing it at least that many. */
+void socket_set_peer_endpoints(struct wireguard_peer *peer, struct sockaddr_storage *addrs, unsigned int count)
 {
-	write_lock_bh(&peer->endpoint_lock);
-	__socket_set_peer_dst(peer);
-	write_unlock_bh(&peer->endpoint_lock);
+	struct endpoint *endpoints[MAX_ENDPOINTS_PER_PEER] = { NULL }, *old[MAX_ENDPOINTS_PER_PEER];
+	unsigned int i, n = 0;
+	size_t len;
+
+	for (i = 0; i < count && n < MAX_ENDPOINTS_PER_PEER; ++i) {
+		len = endpoint_addr_len(&addrs[i]);
+		if (!len)
+			continue;
+		endpoints[n] = endpoint_alloc(&addrs[i], len, GFP_KERNEL);
+		if (!endpoints[n])
+			break;
+		++n;
+	}
+	if (!n)
+		return;
+
+	spin_lock_bh(&peer->endpoint_lock);
+	if (peer->max_endpoints < n)
+		peer->max_endpoints = n;
+	for (i = 0; i < MAX_ENDPOINTS_PER_PEER; ++i) {
+		old[i] = rcu_dereference_protected(peer->endpoints[i], lockdep_is_held(&peer->endpoint_lock));
+		if (endpoints[i])
+			endpoints[i]->serial = ++peer->endpoint_serial;
+		rcu_assign_pointer(peer->endpoints[i], endpoints[i]);
+	}
+	peer->endpoint_addr = endpoints[0]->addr;
+	spin_unlock_bh(&peer->endpoint_lock);
+
+	for (i = 0; i < MAX_ENDPOINTS_PER_PEER; ++i) {
+		if (old[i])
+			kfree_rcu(old[i], rcu);
+	}
 }
 
-void socket_set_peer_addr(struct wireguard_peer *peer, struct sockaddr_storage *sockaddr)
+/* Lowering the limit lets go of the endpoints in the slots beyond it. */
+void socket_set_peer_max_endpoints(struct wireguard_peer *peer, unsigned int max)
 {
-	if (sockaddr->ss_family == AF_INET) {
-		read_lock_bh(&peer->endpoint_lock);
-		if (!memcmp(sockaddr, &peer->endpoint_addr, sizeof(struct sockaddr_in)))
-			goto out;
-		read_unlock_bh(&peer->endpoint_lock);
-		write_lock_bh(&peer->endpoint_lock);
-		memcpy(&peer->endpoint_addr, sockaddr, sizeof(struct sockaddr_in));
-	} else if (sockaddr->ss_family == AF_INET6) {
-		read_lock_bh(&peer->endpoint_lock);
-		if (!memcmp(sockaddr, &peer->endpoint_addr, sizeof(struct sockaddr_in6)))
-			goto out;
-		read_unlock_bh(&peer->endpoint_lock);
-		write_lock_bh(&peer->endpoint_lock);
-		memcpy(&peer->endpoint_addr, sockaddr, sizeof(struct sockaddr_in6));
-	} else
-		return;
-	__socket_set_peer_dst(peer);
-	write_unlock_bh(&peer->endpoint_lock);
-	return;
-out:
-	read_unlock_bh(&peer->endpoint_lock);
+	struct endpoint *old[MAX_ENDPOINTS_PER_PEER] = { NULL };
+	unsigned int i;
+
+	max = clamp_t(unsigned int, max, 1, MAX_ENDPOINTS_PER_PEER);
+	spin_lock_bh(&peer->endpoint_lock);
+	peer->max_endpoints = max;
+	for (i = max; i < MAX_ENDPOINTS_PER_PEER; ++i) {
+		old[i] = rcu_dereference_protected(peer->endpoints[i], lockdep_is_held(&peer->endpoint_lock));
+		RCU_INIT_POINTER(peer->endpoints[i], NULL);
+	}
+	spin_unlock_bh(&peer->endpoint_lock);
+
+	for (i = max; i < MAX_ENDPOINTS_PER_PEER; ++i) {
+		if (old[i])
+			kfree_rcu(old[i], rcu);
+	}
 }
 
-static inline struct dst_entry *peer_dst_get(struct wireguard_peer *peer)
+unsigned int socket_get_peer_endpoints(struct wireguard_peer *peer, struct sockaddr_storage *addrs)
 {
-	struct dst_entry *dst = NULL;
-	read_lock_bh(&peer->endpoint_lock);
+	struct endpoint *endpoint;
+	unsigned int i;
 
-	if (!peer->endpoint_dst || (peer->endpoint_dst->obsolete && !peer->endpoint_dst->ops->check(peer->endpoint_dst, 0))) {
-		read_unlock_bh(&peer->endpoint_lock);
-		socket_set_peer_dst(peer);
-		read_lock_bh(&peer->endpoint_lock);
-		if (!peer->endpoint_dst)
-			goto out;
+	spin_lock_bh(&peer->endpoint_lock);
+	for (i = 0; i < MAX_ENDPOINTS_PER_PEER; ++i) {
+		endpoint = rcu_dereference_protected(peer->endpoints[i], lockdep_is_held(&peer->endpoint_lock));
+		if (!endpoint)
+			break;
+		addrs[i] = endpoint->addr;
 	}
+	spin_unlock_bh(&peer->endpoint_lock);
+	return i;
+}
 
-	if (!atomic_inc_not_zero(&peer->endpoint_dst->__refcnt))
-		goto out;
-	dst = peer->endpoint_dst;
+/* Only called once the peer is unreachable and no CPU can be using its caches any longer. */
+void socket_free_peer_endpoint(struct wireguard_peer *peer)
+{
+	struct endpoint_cache *cache;
+	unsigned int i;
+	int cpu;
 
-out:
-	read_unlock_bh(&peer->endpoint_lock);
+	for_each_possible_cpu (cpu) {
+		cache = per_cpu_ptr(peer->endpoint_cache, cpu);
+		for (i = 0; i < MAX_ENDPOINTS_PER_PEER; ++i) {
+			if (cache[i].dst)
+				dst_release(cache[i].dst);
+		}
+	}
+	free_percpu(peer->endpoint_cache);
+	for (i = 0; i < MAX_ENDPOINTS_PER_PEER; ++i)
+		kfree(rcu_dereference_protected(peer->endpoints[i], true));
+}
+
+/* Flows are spread over the endpoints heard from recently, so that a peer with several uplinks gets
+ * to use all of them, while each flow keeps to one path and isn't reordered. Packets without a flow,
+ * like handshakes and keepalives, go to the endpoint heard from last, as does everything when there
+ * is only one endpoint, or none has been heard from in a while. */
+static inline struct endpoint *choose_endpoint(struct wireguard_peer *peer, struct sk_buff *skb, unsigned int *slot)
+{
+	struct endpoint *endpoint, *latest = NULL;
+	unsigned int i, live_slots[MAX_ENDPOINTS_PER_PEER], num_live = 0;
+	unsigned long last_received;
+
+	for (i = 0; i < MAX_ENDPOINTS_PER_PEER; ++i) {
+		endpoint = rcu_dereference(peer->endpoints[i]);
+		if (!endpoint)
+			break;
+		last_received = READ_ONCE(endpoint->last_received);
+		if (!latest || time_after(last_received, READ_ONCE(latest->last_received))) {
+			latest = endpoint;
+			*slot = i;
+		}
+		if (time_is_after_jiffies(last_received + ENDPOINT_LIVE_TIMEOUT))
+			live_slots[num_live++] = i;
+	}
+	if (num_live > 1 && skb->hash) {
+		*slot = live_slots[reciprocal_scale(skb->hash, num_live)];
+		return rcu_dereference(peer->endpoints[*slot]);
+	}
+	return latest;
+}
+
+/* Must be called with bottom halves disabled, since the cache belongs to the current CPU. On a hit,
+ * only the fields of the flow that send() needs are filled in. The dst returned is owned by the cache. */
+static inline struct dst_entry *endpoint_cache_get(struct wireguard_peer *peer, struct endpoint *endpoint, struct endpoint_cache *cache, struct flowi4 *fl4, struct flowi6 *fl6, struct sock *sock4, struct sock *sock6)
+{
+	struct dst_entry *dst = cache->dst;
+	unsigned long serial = endpoint->serial;
+	unsigned int generation = atomic_read(&route_generation);
+
+	/* Plenty of route changes don't fire any of our notifiers, but those do mark the dst obsolete. */
+	if (likely(dst && cache->serial == serial && cache->generation == generation && (!dst->obsolete || dst->ops->check(dst, 0)))) {
+		if (endpoint->addr.ss_family == AF_INET) {
+			fl4->saddr = cache->saddr4;
+			fl4->daddr = ((struct sockaddr_in *)&endpoint->addr)->sin_addr.s_addr;
+			fl4->fl4_sport = htons(peer->device->incoming_port);
+			fl4->fl4_dport = ((struct sockaddr_in *)&endpoint->addr)->sin_port;
+		} else {
+			fl6->saddr = cache->saddr6;
+			fl6->daddr = ((struct sockaddr_in6 *)&endpoint->addr)->sin6_addr;
+			fl6->fl6_sport = htons(peer->device->incoming_port);
+			fl6->fl6_dport = ((struct sockaddr_in6 *)&endpoint->addr)->sin6_port;
+		}
+		return dst;
+	}
+
+	cache->dst = NULL;
+	if (dst)
+		dst_release(dst);
+
+	dst = route(peer->device, fl4, fl6, &endpoint->addr, sock4, sock6);
+	if (unlikely(IS_ERR(dst)))
+		return dst;
+	if (endpoint->addr.ss_family == AF_INET)
+		cache->saddr4 = fl4->saddr;
+	else
+		cache->saddr6 = fl6->saddr;
+	cache->serial = serial;
+	cache->generation = generation;
+	cache->dst = dst;
 	return dst;
 }
 
+/* The peer is held to the smallest MTU of the paths to its endpoints, since xmit can't know which
+ * of them a packet will take. This only runs when one of them changes. */
+static void update_peer_mtu(struct wireguard_peer *peer)
+{
+	struct endpoint *endpoint;
+	unsigned int i, endpoint_mtu, mtu = 0;
+
+	for (i = 0; i < MAX_ENDPOINTS_PER_PEER; ++i) {
+		endpoint = rcu_dereference(peer->endpoints[i]);
+		if (!endpoint)
+			break;
+		endpoint_mtu = READ_ONCE(endpoint->mtu);
+		if (endpoint_mtu && (!mtu || endpoint_mtu < mtu))
+			mtu = endpoint_mtu;
+	}
+	if (READ_ONCE(peer->mtu) == mtu)
+		return;
+	WRITE_ONCE(peer->mtu, mtu);
+	if (peer->device->auto_mtu)
+		schedule_work(&peer->device->mtu_work);
+}
 
 int socket_send_skb_to_peer(struct wireguard_peer *peer, struct sk_buff *skb, u8 dscp)
 {
 	struct net_device *dev = netdev_pub(peer->device);
+	struct endpoint *endpoint;
 	struct dst_entry *dst;
+	struct sock *sock4, *sock6;
+	union {
+		struct flowi4 fl4;
+		struct flowi6 fl6;
+	} fl;
+	struct endpoint_cache *cache;
 	size_t skb_len = skb->len;
+	unsigned int slot = 0, overhead, path_mtu, inner_mtu;
+	__be16 df = 0;
 	int ret = 0;
 
-	dst = peer_dst_get(peer);
-	if (unlikely(!dst)) {
-		net_dbg_ratelimited("No route to %pISpfsc for peer %Lu\n", &peer->endpoint_addr, peer->internal_id);
+	local_bh_disable();
+	rcu_read_lock();
+
+	endpoint = choose_endpoint(peer, skb, &slot);
+	if (unlikely(!endpoint)) {
 		kfree_skb(skb);
-		return -EHOSTUNREACH;
+		ret = -EHOSTUNREACH;
+		goto out;
+	}
+	sock4 = rcu_dereference(peer->device->sock4);
+	sock6 = rcu_dereference(peer->device->sock6);
+
+	cache = this_cpu_ptr(peer->endpoint_cache) + slot;
+	dst = endpoint_cache_get(peer, endpoint, cache, &fl.fl4, &fl.fl6, sock4, sock6);
+	if (unlikely(IS_ERR(dst))) {
+		net_dbg_ratelimited("No route to %pISpfsc for peer %Lu\n", &endpoint->addr, peer->internal_id);
+		kfree_skb(skb);
+		ret = -EHOSTUNREACH;
+		goto out;
 	} else if (unlikely(dst->dev == dev)) {
-		net_dbg_ratelimited("Avoiding routing loop to %pISpfsc for peer %Lu\n", &peer->endpoint_addr, peer->internal_id);
+		net_dbg_ratelimited("Avoiding routing loop to %pISpfsc for peer %Lu\n", &endpoint->addr, peer->internal_id);
 		kfree_skb(skb);
-		return -ELOOP;
+		ret = -ELOOP;
+		goto out;
 	}
 
-	rcu_read_lock();
-	read_lock_bh(&peer->endpoint_lock);
+	/* Spreading the outer source port over a small range by inner flow lets the receiving NIC steer
+	 * the flows of a single peer to different queues. Packets without a flow, such as handshakes
+	 * and keepalives, keep coming from the listening port itself, which is what the other end learns. */
+	if (peer->device->spread_source_ports && skb->hash) {
+		__be16 sport = htons(WG_SOURCE_PORT_SPREAD_BASE(peer->device->incoming_port) + reciprocal_scale(skb->hash, WG_SOURCE_PORT_SPREAD));
+		if (endpoint->addr.ss_family == AF_INET)
+			fl.fl4.fl4_sport = sport;
+		else {
+			fl.fl6.fl6_sport = sport;
+			fl.fl6.flowlabel = htonl(skb->hash & IPV6_FLOWLABEL_MASK);
+		}
+	}
 
-	ret = send(dev, skb, dst, &peer->endpoint_flow.fl4, &peer->endpoint_flow.fl6, &peer->endpoint_addr, rcu_dereference(peer->device->sock4), rcu_dereference(peer->device->sock6), dscp);
+	/* ICMP feedback on our sockets lowers the MTU of the route, so the path MTU is read afresh for each
+	 * packet. With automatic MTU, packets that fit are sent with DF, so that routers tell us when the path
+	 * shrinks, and those that don't, which can only be inner packets that allow fragmentation, are
+	 * fragmented here instead. Otherwise, as ICMP may well be filtered along the way, routers are left
+	 * to fragment whatever they must. */
+	overhead = (endpoint->addr.ss_family == AF_INET ? sizeof(struct iphdr) : sizeof(struct ipv6hdr)) + sizeof(struct udphdr);
+	path_mtu = dst_mtu(dst);
+	inner_mtu = path_mtu > overhead + MESSAGE_MINIMUM_LENGTH ? path_mtu - overhead - MESSAGE_MINIMUM_LENGTH : 0;
+	if (unlikely(READ_ONCE(endpoint->mtu) != inner_mtu)) {
+		WRITE_ONCE(endpoint->mtu, inner_mtu);
+		update_peer_mtu(peer);
+	}
+	if (peer->device->auto_mtu) {
+		if (likely(skb->len + overhead <= path_mtu))
+			df = htons(IP_DF);
+		else
+			skb->ignore_df = 1;
+	}
+
+	/* The cache keeps its own reference, so unlike a shared dst, this one can't drop to zero under us. */
+	dst_hold(dst);
+	ret = send(dev, skb, dst, &fl.fl4, &fl.fl6, &endpoint->addr, sock4, sock6, dscp, df);
 	if (!ret)
 		peer->tx_bytes += skb_len;
 
-	read_unlock_bh(&peer->endpoint_lock);
+out:
 	rcu_read_unlock();
-
+	local_bh_enable();
 	return ret;
 }
 
 int socket_send_buffer_to_peer(struct wireguard_peer *peer, void *buffer, size_t len, u8 dscp)
 {
-	struct sk_buff *skb = alloc_skb(len + SKB_HEADER_LEN, GFP_ATOMIC);
+	struct sk_buff *skb = skb_pool_alloc(len);
 	if (!skb)
 		return -ENOMEM;
-	skb_reserve(skb, SKB_HEADER_LEN);
 	memcpy(skb_put(skb, len), buffer, len);
 	return socket_send_skb_to_peer(peer, skb, dscp);
 }
@@ -290,7 +582,7 @@ static int send_to_sockaddr(struct sk_buff *skb, struct wireguard_device *wg, st
 		return -ELOOP;
 	}
 
-	return send(dev, skb, dst, &fl.fl4, &fl.fl6, addr, sock4, sock6, 0);
+	return send(dev, skb, dst, &fl.fl4, &fl.fl6, addr, sock4, sock6, 0, 0);
 }
 
 int socket_send_buffer_as_reply_to_skb(struct sk_buff *in_skb, void *out_buffer, size_t len, struct wireguard_device *wg)
@@ -305,10 +597,9 @@ int socket_send_buffer_as_reply_to_skb(struct sk_buff *in_skb, void *out_buffer,
 	if (ret < 0)
 		return ret;
 
-	skb = alloc_skb(len + SKB_HEADER_LEN, GFP_ATOMIC);
+	skb = skb_pool_alloc(len);
 	if (!skb)
 		return -ENOMEM;
-	skb_reserve(skb, SKB_HEADER_LEN);
 	memcpy(skb_put(skb, len), out_buffer, len);
 
 	rcu_read_lock();
@@ -335,6 +626,136 @@ err:
 	return 0;
 }
 
+/* Whether anything in the namespace wants to see or police packets on the way in, which the fast path
+ * would skip: netfilter's PRE_ROUTING and LOCAL_IN hooks, conntrack among them, and inbound XFRM policy. */
+static inline bool fast_path_would_bypass_policy(struct net *net, u8 pf)
+{
+#ifdef CONFIG_XFRM
+	if (net->xfrm.policy_count[XFRM_POLICY_IN] || net->xfrm.policy_count[XFRM_POLICY_IN + XFRM_POLICY_MAX])
+		return true;
+#endif
+#ifdef CONFIG_NETFILTER
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#if IS_ENABLED(CONFIG_IPV6)
+	if (pf == NFPROTO_IPV6)
+		return rcu_access_pointer(net->nf.hooks_ipv6[NF_INET_PRE_ROUTING]) || rcu_access_pointer(net->nf.hooks_ipv6[NF_INET_LOCAL_IN]);
+#endif
+	return rcu_access_pointer(net->nf.hooks_ipv4[NF_INET_PRE_ROUTING]) || rcu_access_pointer(net->nf.hooks_ipv4[NF_INET_LOCAL_IN]);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+	return rcu_access_pointer(net->nf.hooks[pf][NF_INET_PRE_ROUTING]) || rcu_access_pointer(net->nf.hooks[pf][NF_INET_LOCAL_IN]);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+	return !list_empty(&net->nf.hooks[pf][NF_INET_PRE_ROUTING]) || !list_empty(&net->nf.hooks[pf][NF_INET_LOCAL_IN]);
+#else
+	return !list_empty(&nf_hooks[pf][NF_INET_PRE_ROUTING]) || !list_empty(&nf_hooks[pf][NF_INET_LOCAL_IN]);
+#endif
+#else
+	return false;
+#endif
+}
+
+/* Data messages make up nearly all of what a busy device receives, and they don't need anything the
+ * IP and UDP receive paths do for them, since decryption authenticates them anyway. So, optionally,
+ * the underlying interface hands those straight to us, before the IP layer sees them. Anything that
+ * isn't plainly a data message to one of our local addresses and our port continues on as usual, and
+ * so does everything while a firewall, conntrack, or IPsec policy is in place for that family. */
+static rx_handler_result_t fast_path_receive(struct sk_buff **pskb)
+{
+	struct sk_buff *skb = *pskb;
+	struct wireguard_device *wg = rcu_dereference(skb->dev->rx_handler_data);
+	unsigned int header_len, len;
+	struct udphdr *udp;
+
+	if (skb->pkt_type != PACKET_HOST || !skb_csum_unnecessary(skb))
+		return RX_HANDLER_PASS;
+
+	if (skb->protocol == htons(ETH_P_IP)) {
+		struct iphdr *ip4;
+
+		header_len = sizeof(struct iphdr);
+		if (!rcu_access_pointer(wg->sock4) || fast_path_would_bypass_policy(dev_net(skb->dev), NFPROTO_IPV4) || !pskb_may_pull(skb, header_len + sizeof(struct udphdr) + sizeof(struct message_header)))
+			return RX_HANDLER_PASS;
+		ip4 = ip_hdr(skb);
+		if (ip4->version != 4 || ip4->ihl != 5 || ip4->protocol != IPPROTO_UDP || ip_is_fragment(ip4) || ip_fast_csum((u8 *)ip4, ip4->ihl))
+			return RX_HANDLER_PASS;
+		udp = (struct udphdr *)(skb->data + header_len);
+		if (udp->dest != htons(wg->incoming_port) || !__ip_dev_find(dev_net(skb->dev), ip4->daddr, false))
+			return RX_HANDLER_PASS;
+		len = ntohs(ip4->tot_len);
+#if IS_ENABLED(CONFIG_IPV6)
+	} else if (skb->protocol == htons(ETH_P_IPV6)) {
+		struct ipv6hdr *ip6;
+
+		header_len = sizeof(struct ipv6hdr);
+		if (!rcu_access_pointer(wg->sock6) || fast_path_would_bypass_policy(dev_net(skb->dev), NFPROTO_IPV6) || !pskb_may_pull(skb, header_len + sizeof(struct udphdr) + sizeof(struct message_header)))
+			return RX_HANDLER_PASS;
+		ip6 = ipv6_hdr(skb);
+		if (ip6->version != 6 || ip6->nexthdr != IPPROTO_UDP)
+			return RX_HANDLER_PASS;
+		udp = (struct udphdr *)(skb->data + header_len);
+		if (udp->dest != htons(wg->incoming_port) || !ipv6_chk_addr(dev_net(skb->dev), &ip6->daddr, NULL, 0))
+			return RX_HANDLER_PASS;
+		len = header_len + ntohs(ip6->payload_len);
+#endif
+	} else
+		return RX_HANDLER_PASS;
+
+	if (((struct message_header *)(udp + 1))->type != MESSAGE_DATA || len < header_len + sizeof(struct udphdr) || len > skb->len)
+		return RX_HANDLER_PASS;
+	/* Like the IP layer would, we drop whatever link layer padding follows the packet. */
+	if (pskb_trim_rcsum(skb, len))
+		return RX_HANDLER_PASS;
+	skb_set_transport_header(skb, header_len);
+	packet_receive(wg, skb);
+	return RX_HANDLER_CONSUMED;
+}
+
+void socket_uninit_fast_path(struct wireguard_device *wg)
+{
+	ASSERT_RTNL();
+	if (!wg->fast_path_dev)
+		return;
+	/* This waits for any receive still running on the interface, so nothing reaches us afterwards. */
+	netdev_rx_handler_unregister(wg->fast_path_dev);
+	WRITE_ONCE(wg->fast_path_dev, NULL);
+	cpu_map_set_node(wg, NUMA_NO_NODE);
+}
+
+int socket_set_fast_path(struct wireguard_device *wg, int ifindex)
+{
+	struct net_device *dev = NULL;
+	int ret;
+
+	ASSERT_RTNL();
+	if (ifindex) {
+		dev = __dev_get_by_index(wg->creating_net, ifindex);
+		if (!dev)
+			return -ENODEV;
+		if (dev == wg->fast_path_dev)
+			return 0;
+		if (dev == netdev_pub(wg))
+			return -EINVAL;
+	}
+	socket_uninit_fast_path(wg);
+	if (!dev)
+		return 0;
+	/* This fails with -EBUSY if the interface already belongs to a bridge, a bond, or the like. */
+	ret = netdev_rx_handler_register(dev, fast_path_receive, wg);
+	if (ret < 0)
+		return ret;
+	WRITE_ONCE(wg->fast_path_dev, dev);
+	cpu_map_set_node(wg, dev_to_node(&dev->dev));
+	return 0;
+}
+
+/* The handler has to be gone before the interface is, and it goes as well when the interface moves
+ * to another namespace, which also comes through here, since our sockets stay where they are. */
+static void fast_path_netdevice_unregister(struct net_device *dev)
+{
+	if (rcu_access_pointer(dev->rx_handler) != fast_path_receive)
+		return;
+	socket_uninit_fast_path(rtnl_dereference(dev->rx_handler_data));
+}
+
 /* Generates a default port from the interface name.
  * wg0 --> 51820
  * wg1 --> 51821
@@ -389,22 +810,93 @@ static inline void set_sock_opts(struct socket *sock)
 	sk_set_memalloc(sock->sk);
 }
 
-int socket_init(struct wireguard_device *wg)
+/* This is udp_sock_create(), except that the socket may join a reuseport group before binding, so
+ * that several of them can share the listening port. */
+static int create_socket(struct wireguard_device *wg, int family, bool reuseport, struct socket **sockp)
 {
-	struct udp_port_cfg port4 = {
-		.family = AF_INET,
-		.local_ip.s_addr = htonl(INADDR_ANY),
-		.use_udp_checksums = true
+	struct sockaddr_in addr4 = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+		.sin_port = htons(wg->incoming_port)
 	};
-	struct udp_port_cfg port6 = {
-		.family = AF_INET6,
-		.local_ip6 = IN6ADDR_ANY_INIT,
-		.use_udp6_tx_checksums = true,
-		.use_udp6_rx_checksums = true,
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
-		.ipv6_v6only = true
+	struct sockaddr_in6 addr6 = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_ANY_INIT,
+		.sin6_port = htons(wg->incoming_port)
+	};
+	struct socket *sock = NULL;
+	int ret, one = 1;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	ret = sock_create_kern(wg->creating_net, family, SOCK_DGRAM, 0, &sock);
+#else
+	ret = sock_create_kern(family, SOCK_DGRAM, 0, &sock);
+	if (!ret)
+		sk_change_net(sock->sk, wg->creating_net);
 #endif
+	if (ret < 0) {
+		sock = NULL;
+		goto err;
+	}
+
+	if (reuseport) {
+		ret = kernel_setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *)&one, sizeof(one));
+		if (ret < 0)
+			goto err;
+	}
+	if (family == AF_INET6) {
+		ret = kernel_setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&one, sizeof(one));
+		if (ret < 0)
+			goto err;
+		ret = kernel_bind(sock, (struct sockaddr *)&addr6, sizeof(addr6));
+	} else
+		ret = kernel_bind(sock, (struct sockaddr *)&addr4, sizeof(addr4));
+	if (ret < 0)
+		goto err;
+
+	*sockp = sock;
+	return 0;
+
+err:
+	if (sock)
+		udp_tunnel_sock_release(sock);
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+/* Any other socket of the same user may join a reuseport group by binding its port with SO_REUSEPORT, and
+ * the stack would then hand it a share of our flows. So once all of ours are bound, we make sure that they
+ * are the first num_socks of the group, and attach a program that picks among just those, by the CPU that
+ * received the packet. Sockets that join later come after ours, and so never get anything while we're up. */
+static int claim_reuseport_group(struct socket **socks, unsigned int num_socks)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_socks),
+		BPF_STMT(BPF_RET | BPF_A, 0)
 	};
+	struct sock_fprog prog = { .len = ARRAY_SIZE(code), .filter = code };
+	struct sock_reuseport *reuse;
+	unsigned int i;
+	int ret = 0;
+
+	rcu_read_lock();
+	reuse = rcu_dereference(socks[0]->sk->sk_reuseport_cb);
+	if (!reuse || reuse->num_socks < num_socks)
+		ret = -EADDRINUSE;
+	for (i = 0; !ret && i < num_socks; ++i) {
+		if (reuse->socks[i] != socks[i]->sk)
+			ret = -EADDRINUSE;
+	}
+	rcu_read_unlock();
+	if (ret < 0)
+		return ret;
+	return kernel_setsockopt(socks[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, (char *)&prog, sizeof(prog));
+}
+#endif
+
+int socket_init(struct wireguard_device *wg)
+{
 	struct udp_tunnel_sock_cfg cfg = {
 		.sk_user_data = wg,
 		.encap_type = 1,
@@ -412,10 +904,8 @@ int socket_init(struct wireguard_device *wg)
 	};
 
 	int ret = 0;
-	struct socket *new4 = NULL, *new6 = NULL;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
-	int old_bindv6only;
-#endif
+	unsigned int i, num_socks;
+	struct socket *new4[MAX_RECEIVE_SOCKETS] = { NULL }, *new6[MAX_RECEIVE_SOCKETS] = { NULL };
 
 	mutex_lock(&wg->socket_update_lock);
 
@@ -427,53 +917,159 @@ int socket_init(struct wireguard_device *wg)
 
 	if (!wg->incoming_port)
 		wg->incoming_port = generate_default_incoming_port(wg);
-	port4.local_udp_port = port6.local_udp_port = htons(wg->incoming_port);
 
-	ret = udp_sock_create(wg->creating_net, &port4, &new4);
-	if (ret < 0) {
-		pr_err("Could not create outgoing IPv4 socket\n");
-		goto out;
-	}
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
-	/* Since udp_port_cfg only learned of ipv6_v6only in 4.3, we do this horrible
-	 * hack here and set the sysctl variable temporarily to something that will
-	 * set the right option for us in sock_create. It's super racey! */
-	old_bindv6only = wg->creating_net->ipv6.sysctl.bindv6only;
-	wg->creating_net->ipv6.sysctl.bindv6only = 1;
-#endif
-	ret = udp_sock_create(wg->creating_net, &port6, &new6);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
-	wg->creating_net->ipv6.sysctl.bindv6only = old_bindv6only;
+	/* The first socket of each family also sends. The others only spread out the receive
+	 * side, which otherwise funnels every peer through one socket. Without a way to keep
+	 * other sockets out of the group, we stick to one socket, which owns the port outright. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	num_socks = min_t(unsigned int, num_online_cpus(), MAX_RECEIVE_SOCKETS);
+#else
+	num_socks = 1;
 #endif
-	if (ret < 0) {
-		pr_err("Could not create outgoing IPv6 socket\n");
-		udp_tunnel_sock_release(new4);
-		goto out;
+	for (i = 0; i < num_socks; ++i) {
+		ret = create_socket(wg, AF_INET, num_socks > 1, &new4[i]);
+		if (ret < 0) {
+			pr_err("Could not create IPv4 socket\n");
+			goto err;
+		}
+		ret = create_socket(wg, AF_INET6, num_socks > 1, &new6[i]);
+		if (ret < 0) {
+			pr_err("Could not create IPv6 socket\n");
+			goto err;
+		}
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	if (num_socks > 1) {
+		ret = claim_reuseport_group(new4, num_socks);
+		if (!ret)
+			ret = claim_reuseport_group(new6, num_socks);
+		if (ret < 0) {
+			pr_err("Could not claim the reuseport group of port %u\n", wg->incoming_port);
+			goto err;
+		}
 	}
+#endif
 
-	set_sock_opts(new4);
-	set_sock_opts(new6);
-	setup_udp_tunnel_sock(wg->creating_net, new4, &cfg);
-	setup_udp_tunnel_sock(wg->creating_net, new6, &cfg);
-	rcu_assign_pointer(wg->sock4, new4->sk);
-	rcu_assign_pointer(wg->sock6, new6->sk);
+	for (i = 0; i < num_socks; ++i) {
+		set_sock_opts(new4[i]);
+		set_sock_opts(new6[i]);
+		setup_udp_tunnel_sock(wg->creating_net, new4[i], &cfg);
+		setup_udp_tunnel_sock(wg->creating_net, new6[i], &cfg);
+		if (i) {
+			wg->receive_socks4[i - 1] = new4[i]->sk;
+			wg->receive_socks6[i - 1] = new6[i]->sk;
+		}
+	}
+	rcu_assign_pointer(wg->sock4, new4[0]->sk);
+	rcu_assign_pointer(wg->sock6, new6[0]->sk);
+	/* Routes cached for the previous sockets, or for the previous port, are now stale. Rather
+	 * than walking every peer to look them up again, we let each be looked up on first use. */
+	atomic_inc(&route_generation);
+	goto out;
 
+err:
+	for (i = 0; i < num_socks; ++i) {
+		if (new4[i])
+			udp_tunnel_sock_release(new4[i]);
+		if (new6[i])
+			udp_tunnel_sock_release(new6[i]);
+	}
 out:
 	mutex_unlock(&wg->socket_update_lock);
 	return ret;
 }
 
+static int route_changed(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+	atomic_inc(&route_generation);
+	return NOTIFY_DONE;
+}
+
+static int netdevice_route_changed(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+	if (event == NETDEV_UNREGISTER)
+		fast_path_netdevice_unregister(netdev_notifier_info_to_dev(ptr));
+
+	switch (event) {
+	case NETDEV_UP:
+	case NETDEV_DOWN:
+	case NETDEV_CHANGE:
+	case NETDEV_CHANGEMTU:
+	case NETDEV_UNREGISTER:
+		atomic_inc(&route_generation);
+	}
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block netdevice_notifier = { .notifier_call = netdevice_route_changed };
+static struct notifier_block inetaddr_notifier = { .notifier_call = route_changed };
+static struct notifier_block netevent_notifier = { .notifier_call = route_changed };
+#if IS_ENABLED(CONFIG_IPV6)
+static struct notifier_block inet6addr_notifier = { .notifier_call = route_changed };
+#endif
+
+int socket_init_route_notifiers(void)
+{
+	int ret;
+
+	ret = register_netdevice_notifier(&netdevice_notifier);
+	if (ret < 0)
+		return ret;
+	ret = register_inetaddr_notifier(&inetaddr_notifier);
+	if (ret < 0)
+		goto err_netdevice;
+	ret = register_netevent_notifier(&netevent_notifier);
+	if (ret < 0)
+		goto err_inetaddr;
+#if IS_ENABLED(CONFIG_IPV6)
+	ret = register_inet6addr_notifier(&inet6addr_notifier);
+	if (ret < 0)
+		goto err_netevent;
+#endif
+	return 0;
+
+#if IS_ENABLED(CONFIG_IPV6)
+err_netevent:
+	unregister_netevent_notifier(&netevent_notifier);
+#endif
+err_inetaddr:
+	unregister_inetaddr_notifier(&inetaddr_notifier);
+err_netdevice:
+	unregister_netdevice_notifier(&netdevice_notifier);
+	return ret;
+}
+
+void socket_uninit_route_notifiers(void)
+{
+#if IS_ENABLED(CONFIG_IPV6)
+	unregister_inet6addr_notifier(&inet6addr_notifier);
+#endif
+	unregister_netevent_notifier(&netevent_notifier);
+	unregister_inetaddr_notifier(&inetaddr_notifier);
+	unregister_netdevice_notifier(&netdevice_notifier);
+}
+
 void socket_uninit(struct wireguard_device *wg)
 {
 	struct sock *old4, *old6;
+	struct sock *old_receive4[MAX_RECEIVE_SOCKETS - 1], *old_receive6[MAX_RECEIVE_SOCKETS - 1];
+	unsigned int i;
+
 	mutex_lock(&wg->socket_update_lock);
 	old4 = rcu_dereference_protected(wg->sock4, lockdep_is_held(&wg->socket_update_lock));
 	old6 = rcu_dereference_protected(wg->sock6, lockdep_is_held(&wg->socket_update_lock));
 	rcu_assign_pointer(wg->sock4, NULL);
 	rcu_assign_pointer(wg->sock6, NULL);
+	memcpy(old_receive4, wg->receive_socks4, sizeof(old_receive4));
+	memcpy(old_receive6, wg->receive_socks6, sizeof(old_receive6));
+	memset(wg->receive_socks4, 0, sizeof(wg->receive_socks4));
+	memset(wg->receive_socks6, 0, sizeof(wg->receive_socks6));
 	mutex_unlock(&wg->socket_update_lock);
 	synchronize_rcu();
 	sock_free(old4);
 	sock_free(old6);
+	for (i = 0; i < MAX_RECEIVE_SOCKETS - 1; ++i) {
+		sock_free(old_receive4[i]);
+		sock_free(old_receive6[i]);
+	}
 }
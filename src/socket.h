@@ -20,6 +20,15 @@ int socket_send_buffer_as_reply_to_skb(struct sk_buff *in_skb, void *out_buffer,
 
 int socket_addr_from_skb(struct sockaddr_storage *sockaddr, struct sk_buff *skb);
 void socket_set_peer_addr(struct wireguard_peer *peer, struct sockaddr_storage *sockaddr);
-void socket_set_peer_dst(struct wireguard_peer *peer);
+void socket_set_peer_endpoints(struct wireguard_peer *peer, struct sockaddr_storage *addrs, unsigned int count);
+void socket_set_peer_max_endpoints(struct wireguard_peer *peer, unsigned int max);
+unsigned int socket_get_peer_endpoints(struct wireguard_peer *peer, struct sockaddr_storage *addrs);
+void socket_free_peer_endpoint(struct wireguard_peer *peer);
+
+int socket_set_fast_path(struct wireguard_device *wg, int ifindex);
+void socket_uninit_fast_path(struct wireguard_device *wg);
+
+int socket_init_route_notifiers(void);
+void socket_uninit_route_notifiers(void);
 
 #endif
@@ -4,29 +4,45 @@
 #include "timers.h"
 #include "packets.h"
 #include "device.h"
+#include "trace.h"
+#include "drops.h"
+#include "netlink.h"
+#include <linux/random.h>
 
 enum {
 	KEEPALIVE = 10 * HZ,
+	REKEY_TIMEOUT_JITTER_MAX = HZ / 3,
 	MAX_TIMER_HANDSHAKES = (90 * HZ) / REKEY_TIMEOUT
 };
 
 /*
- * Timer for retransmitting the handshake if we don't hear back after `REKEY_TIMEOUT` ms
+ * Timer for retransmitting the handshake if we don't hear back after `REKEY_TIMEOUT` ms, plus some jitter so that peers that lost a common endpoint at once don't keep retrying in lockstep
  * Timer for sending empty packet if we have received a packet but after have not sent one for `KEEPALIVE` ms
  * Timer for initiating new handshake if we have sent a packet but after have not received one (even empty) for `(KEEPALIVE + REKEY_TIMEOUT)` ms
  * Timer for zeroing out all ephemeral keys after `(REJECT_AFTER_TIME * 3)` ms if no new keys have been received
+ *
+ * The keepalive and new handshake timers are lazy. The data path only flips a flag, with the jiffies at which
+ * it was raised, when something goes unanswered or gets answered, and arms a timer if it isn't already pending,
+ * so that we never take the timer base lock per packet, nor dirty the peer's cacheline while the state stays the
+ * same. When one of these timers expires, it looks at the flag to decide whether its deadline has actually passed,
+ * and if not, it simply rearms itself for the real deadline.
  */
 
 static void expired_retransmit_handshake(unsigned long ptr)
 {
 	struct wireguard_peer *peer = (struct wireguard_peer *)ptr;
+	struct sk_buff *skb;
 
+	trace_wg_timer_retransmit_handshake(peer);
 	pr_debug("Handshake for peer %Lu (%pISpfsc) did not complete after %d seconds, retrying\n", peer->internal_id, &peer->endpoint_addr, REKEY_TIMEOUT / HZ);
 	if (peer->timer_handshake_attempts > MAX_TIMER_HANDSHAKES) {
 		del_timer(&peer->timer_send_keepalive);
 		/* We remove all existing packets and don't try again,
 		 * if we try unsuccessfully for too long to make a handshake. */
-		skb_queue_purge(&peer->tx_packet_queue);
+		while ((skb = skb_dequeue(&peer->tx_packet_queue)) != NULL) {
+			drop_count(peer->device, WG_DROP_TX_HANDSHAKE_TIMEOUT);
+			kfree_skb(skb);
+		}
 		return;
 	}
 	packet_queue_send_handshake_initiation(peer);
@@ -36,19 +52,39 @@ static void expired_retransmit_handshake(unsigned long ptr)
 static void expired_send_keepalive(unsigned long ptr)
 {
 	struct wireguard_peer *peer = (struct wireguard_peer *)ptr;
+	unsigned long deadline;
 
+	if (!READ_ONCE(peer->timer_owing_reply))
+		return;
+	smp_rmb(); /* Pairs with the smp_wmb() that raised the flag. */
+	deadline = READ_ONCE(peer->timer_owing_reply_since) + KEEPALIVE;
+	if (time_is_after_jiffies(deadline)) {
+		mod_timer(&peer->timer_send_keepalive, deadline);
+		return;
+	}
+
+	trace_wg_timer_send_keepalive(peer);
 	pr_debug("Sending keep alive packet to peer %Lu (%pISpfsc), since we received data, but haven't sent any for %d seconds\n", peer->internal_id, &peer->endpoint_addr, KEEPALIVE / HZ);
+	/* We mark it answered right away, rather than when the keepalive leaves, so that data received in the meantime starts a new interval. */
+	WRITE_ONCE(peer->timer_owing_reply, false);
 	packet_send_keepalive(peer);
-	if (peer->timer_need_another_keepalive) {
-		peer->timer_need_another_keepalive = false;
-		mod_timer(&peer->timer_send_keepalive, jiffies + KEEPALIVE);
-	}
 }
 
 static void expired_new_handshake(unsigned long ptr)
 {
 	struct wireguard_peer *peer = (struct wireguard_peer *)ptr;
+	unsigned long deadline;
+
+	if (!READ_ONCE(peer->timer_awaiting_reply))
+		return;
+	smp_rmb(); /* As above. */
+	deadline = READ_ONCE(peer->timer_awaiting_reply_since) + KEEPALIVE + REKEY_TIMEOUT;
+	if (time_is_after_jiffies(deadline)) {
+		mod_timer(&peer->timer_new_handshake, deadline);
+		return;
+	}
 
+	trace_wg_timer_new_handshake(peer);
 	pr_debug("Retrying handshake with peer %Lu (%pISpfsc) because we stopped hearing back after %d seconds\n", peer->internal_id, &peer->endpoint_addr, (KEEPALIVE + REKEY_TIMEOUT) / HZ);
 	packet_queue_send_handshake_initiation(peer);
 }
@@ -57,6 +93,7 @@ static void expired_kill_ephemerals(unsigned long ptr)
 {
 	struct wireguard_peer *peer = (struct wireguard_peer *)ptr;
 
+	trace_wg_timer_kill_ephemerals(peer);
 	rcu_read_lock();
 	peer = peer_get(peer);
 	rcu_read_unlock();
@@ -66,37 +103,51 @@ static void expired_kill_ephemerals(unsigned long ptr)
 	if (!queue_work(peer->device->workqueue, &peer->clear_peer_work))
 		peer_put(peer); /* If the work was already on the queue, we want to drop the extra reference */
 }
-static void queued_expired_kill_ephemerals(struct work_struct *work)
+void timers_queued_expired_kill_ephemerals(struct work_struct *work)
 {
 	struct wireguard_peer *peer = container_of(work, struct wireguard_peer, clear_peer_work);
 
 	pr_debug("Zeroing out all keys for peer %Lu (%pISpfsc), since we haven't received a new one in %d seconds\n", peer->internal_id, &peer->endpoint_addr, (REJECT_AFTER_TIME * 3) / HZ);
 	noise_handshake_clear(&peer->handshake);
 	noise_keypairs_clear(&peer->keypairs);
+	netlink_notify_peer(peer, WG_PEER_EVENT_KEYS_EXPIRED, NULL);
 	peer_put(peer);
 }
 
 void timers_data_sent(struct wireguard_peer *peer)
 {
-	if (likely(peer->timer_send_keepalive.data))
-		del_timer(&peer->timer_send_keepalive);
+	unsigned long now = jiffies;
+
+	if (READ_ONCE(peer->timer_owing_reply))
+		WRITE_ONCE(peer->timer_owing_reply, false);
+	if (!READ_ONCE(peer->timer_awaiting_reply)) {
+		WRITE_ONCE(peer->timer_awaiting_reply_since, now);
+		smp_wmb(); /* The timer mustn't see the flag raised with the old time. */
+		WRITE_ONCE(peer->timer_awaiting_reply, true);
+	}
 
 	if (likely(peer->timer_new_handshake.data) && !timer_pending(&peer->timer_new_handshake))
-		mod_timer(&peer->timer_new_handshake, jiffies + KEEPALIVE + REKEY_TIMEOUT);
+		mod_timer(&peer->timer_new_handshake, now + KEEPALIVE + REKEY_TIMEOUT);
 }
 
 void timers_data_received(struct wireguard_peer *peer)
 {
+	unsigned long now = jiffies;
+
+	if (!READ_ONCE(peer->timer_owing_reply)) {
+		WRITE_ONCE(peer->timer_owing_reply_since, now);
+		smp_wmb(); /* As above. */
+		WRITE_ONCE(peer->timer_owing_reply, true);
+	}
+
 	if (likely(peer->timer_send_keepalive.data) && !timer_pending(&peer->timer_send_keepalive))
-		mod_timer(&peer->timer_send_keepalive, jiffies + KEEPALIVE);
-	else
-		peer->timer_need_another_keepalive = true;
+		mod_timer(&peer->timer_send_keepalive, now + KEEPALIVE);
 }
 
 void timers_any_authorized_packet_received(struct wireguard_peer *peer)
 {
-	if (likely(peer->timer_new_handshake.data))
-		del_timer(&peer->timer_new_handshake);
+	if (READ_ONCE(peer->timer_awaiting_reply))
+		WRITE_ONCE(peer->timer_awaiting_reply, false);
 }
 
 void timers_handshake_initiated(struct wireguard_peer *peer)
@@ -104,7 +155,7 @@ void timers_handshake_initiated(struct wireguard_peer *peer)
 	if (likely(peer->timer_send_keepalive.data))
 		del_timer(&peer->timer_send_keepalive);
 	if (likely(peer->timer_retransmit_handshake.data))
-		mod_timer(&peer->timer_retransmit_handshake, jiffies + REKEY_TIMEOUT);
+		mod_timer(&peer->timer_retransmit_handshake, jiffies + REKEY_TIMEOUT + prandom_u32_max(REKEY_TIMEOUT_JITTER_MAX));
 }
 
 void timers_handshake_complete(struct wireguard_peer *peer)
@@ -119,6 +170,9 @@ void timers_ephemeral_key_created(struct wireguard_peer *peer)
 	if (likely(peer->timer_kill_ephemerals.data))
 		mod_timer(&peer->timer_kill_ephemerals, jiffies + (REJECT_AFTER_TIME * 3));
 	do_gettimeofday(&peer->walltime_last_handshake);
+	/* Each session picks how early within the jitter window it will try to rekey, so
+	 * that peers whose sessions began together don't all rekey together. */
+	peer->rekey_jitter = prandom_u32_max(REKEY_JITTER_WINDOW);
 }
 
 void timers_init_peer(struct wireguard_peer *peer)
@@ -135,11 +189,30 @@ void timers_init_peer(struct wireguard_peer *peer)
 	peer->timer_new_handshake.function = expired_new_handshake;
 	peer->timer_new_handshake.data = (unsigned long)peer;
 
+	/* Kept sessions leave this armed across the device going down and up again, so that they're
+	 * still zeroed out on the schedule they were created with. */
+	if (peer->timer_kill_ephemerals.data)
+		return;
 	init_timer(&peer->timer_kill_ephemerals);
 	peer->timer_kill_ephemerals.function = expired_kill_ephemerals;
 	peer->timer_kill_ephemerals.data = (unsigned long)peer;
+}
 
-	INIT_WORK(&peer->clear_peer_work, queued_expired_kill_ephemerals);
+/* Stops everything but the timer that zeroes out the keys, which keeps running while the device is down. */
+void timers_uninit_peer_keeping_sessions(struct wireguard_peer *peer)
+{
+	if (peer->timer_retransmit_handshake.data) {
+		del_timer(&peer->timer_retransmit_handshake);
+		peer->timer_retransmit_handshake.data = 0;
+	}
+	if (peer->timer_send_keepalive.data) {
+		del_timer(&peer->timer_send_keepalive);
+		peer->timer_send_keepalive.data = 0;
+	}
+	if (peer->timer_new_handshake.data) {
+		del_timer(&peer->timer_new_handshake);
+		peer->timer_new_handshake.data = 0;
+	}
 }
 
 void timers_uninit_peer(struct wireguard_peer *peer)
@@ -4,10 +4,12 @@
 #define WGTIMERS_H
 
 struct wireguard_peer;
+struct work_struct;
 
 void timers_init_peer(struct wireguard_peer *peer);
 void timers_uninit_peer(struct wireguard_peer *peer);
 void timers_uninit_peer_wait(struct wireguard_peer *peer);
+void timers_uninit_peer_keeping_sessions(struct wireguard_peer *peer);
 
 void timers_data_sent(struct wireguard_peer *peer);
 void timers_data_received(struct wireguard_peer *peer);
@@ -16,4 +18,6 @@ void timers_handshake_initiated(struct wireguard_peer *peer);
 void timers_handshake_complete(struct wireguard_peer *peer);
 void timers_ephemeral_key_created(struct wireguard_peer *peer);
 
+void timers_queued_expired_kill_ephemerals(struct work_struct *work);
+
 #endif
@@ -56,6 +56,65 @@ static const char *get_value(const char *line, const char *key)
 	return line + keylen;
 }
 
+static inline int parse_switch(const char *value)
+{
+	if (!strcasecmp(value, "on") || !strcasecmp(value, "true") || !strcmp(value, "1"))
+		return 1;
+	if (!strcasecmp(value, "off") || !strcasecmp(value, "false") || !strcmp(value, "0"))
+		return 0;
+	fprintf(stderr, "Unable to parse switch: `%s'\n", value);
+	return -1;
+}
+
+/* Parses a list of CPUs and CPU ranges, like "0-3,8", into a mask. The empty string means every CPU. */
+static inline bool parse_cpus(__u64 mask[WG_CPUMASK_WORDS], const char *value)
+{
+	const char *start = value;
+	unsigned long first, last;
+	char *end;
+
+	memset(mask, 0, sizeof(__u64) * WG_CPUMASK_WORDS);
+	while (*value) {
+		first = last = strtoul(value, &end, 10);
+		if (end == value)
+			goto error;
+		if (*end == '-') {
+			value = end + 1;
+			last = strtoul(value, &end, 10);
+			if (end == value)
+				goto error;
+		}
+		if (first > last || last >= WG_CPUMASK_WORDS * 64)
+			goto error;
+		for (; first <= last; ++first)
+			mask[first / 64] |= 1ULL << (first % 64);
+		if (*end == ',')
+			++end;
+		else if (*end)
+			goto error;
+		value = end;
+	}
+	return true;
+
+error:
+	fprintf(stderr, "Unable to parse CPU list: `%s'\n", start);
+	return false;
+}
+
+static inline bool parse_fast_path(int32_t *ifindex, const char *value)
+{
+	if (!strcmp(value, "off")) {
+		*ifindex = 0;
+		return true;
+	}
+	*ifindex = if_nametoindex(value);
+	if (!*ifindex) {
+		fprintf(stderr, "Unable to find interface for fast path: `%s'\n", value);
+		return false;
+	}
+	return true;
+}
+
 static inline uint16_t parse_port(const char *value)
 {
 	int ret;
@@ -186,6 +245,59 @@ static inline bool parse_endpoint(struct sockaddr_storage *endpoint, const char
 	return true;
 }
 
+static inline bool parse_endpoints(struct sockaddr_storage endpoints[WG_MAX_ENDPOINTS], const char *value)
+{
+	char *mutable = strdup(value), *sep, *token;
+	size_t i = 0;
+
+	if (!mutable) {
+		perror("strdup");
+		return false;
+	}
+	memset(endpoints, 0, sizeof(struct sockaddr_storage) * WG_MAX_ENDPOINTS);
+	for (sep = mutable; (token = strsep(&sep, ",")); ++i) {
+		while (isspace(*token))
+			++token;
+		if (i == WG_MAX_ENDPOINTS) {
+			fprintf(stderr, "Only %d endpoints are allowed per peer: `%s`\n", WG_MAX_ENDPOINTS, value);
+			free(mutable);
+			return false;
+		}
+		if (!parse_endpoint(&endpoints[i], token)) {
+			free(mutable);
+			return false;
+		}
+	}
+	free(mutable);
+	return true;
+}
+
+static inline bool parse_max_endpoints(uint8_t *max_endpoints, const char *value)
+{
+	char *end;
+	unsigned long max = strtoul(value, &end, 10);
+
+	if (!*value || *end || !max || max > WG_MAX_ENDPOINTS) {
+		fprintf(stderr, "Maximum number of endpoints must be between 1 and %d: `%s`\n", WG_MAX_ENDPOINTS, value);
+		return false;
+	}
+	*max_endpoints = max;
+	return true;
+}
+
+static inline bool parse_replay_window(uint32_t *replay_window, const char *value)
+{
+	char *end;
+	unsigned long window = strtoul(value, &end, 10);
+
+	if (!*value || *end || window < WG_REPLAY_WINDOW_MIN || window > WG_REPLAY_WINDOW_MAX || (window & (window - 1))) {
+		fprintf(stderr, "Replay window must be a power of two between %d and %d: `%s`\n", WG_REPLAY_WINDOW_MIN, WG_REPLAY_WINDOW_MAX, value);
+		return false;
+	}
+	*replay_window = window;
+	return true;
+}
+
 static inline bool parse_ipmasks(struct inflatable_device *buf, size_t peer_offset, const char *value)
 {
 	struct wgpeer *peer;
@@ -275,7 +387,30 @@ static bool process_line(struct config_ctx *ctx, const char *line)
 	if (ctx->is_device_section) {
 		if (key_match("ListenPort"))
 			ret = !!(ctx->buf.dev->port = parse_port(value));
-		else if (key_match("PrivateKey")) {
+		else if (key_match("SpreadSourcePorts")) {
+			int on = parse_switch(value);
+			ret = on >= 0;
+			ctx->buf.dev->spread_source_ports = on > 0;
+			ctx->buf.dev->set_spread_source_ports = ret;
+		} else if (key_match("KeepSessions")) {
+			int on = parse_switch(value);
+			ret = on >= 0;
+			ctx->buf.dev->keep_sessions = on > 0;
+			ctx->buf.dev->set_keep_sessions = ret;
+		} else if (key_match("AutoMTU")) {
+			int on = parse_switch(value);
+			ret = on >= 0;
+			ctx->buf.dev->auto_mtu = on > 0;
+			ctx->buf.dev->set_auto_mtu = ret;
+		} else if (key_match("ReplayWindow"))
+			ret = parse_replay_window(&ctx->buf.dev->replay_window, value);
+		else if (key_match("FastPath")) {
+			ret = parse_fast_path(&ctx->buf.dev->fast_path_ifindex, value);
+			ctx->buf.dev->set_fast_path = ret;
+		} else if (key_match("CryptoCPUs")) {
+			ret = parse_cpus(ctx->buf.dev->crypto_cpus, value);
+			ctx->buf.dev->set_crypto_cpus = ret;
+		} else if (key_match("PrivateKey")) {
 			ret = parse_key(ctx->buf.dev->private_key, value);
 			if (!ret)
 				memset(ctx->buf.dev->private_key, 0, WG_KEY_LEN);
@@ -287,7 +422,9 @@ static bool process_line(struct config_ctx *ctx, const char *line)
 			goto error;
 	} else if (ctx->is_peer_section) {
 		if (key_match("Endpoint"))
-			ret = parse_endpoint(&peer_from_offset(ctx->buf.dev, ctx->peer_offset)->endpoint, value);
+			ret = parse_endpoints(peer_from_offset(ctx->buf.dev, ctx->peer_offset)->endpoints, value);
+		else if (key_match("MaxEndpoints"))
+			ret = parse_max_endpoints(&peer_from_offset(ctx->buf.dev, ctx->peer_offset)->max_endpoints, value);
 		else if (key_match("PublicKey"))
 			ret = parse_key(peer_from_offset(ctx->buf.dev, ctx->peer_offset)->public_key, value);
 		else if (key_match("AllowedIPs"))
@@ -444,6 +581,47 @@ bool config_read_cmd(struct wgdevice **device, char *argv[], int argc)
 				goto error;
 			argv += 2;
 			argc -= 2;
+		} else if (!strcmp(argv[0], "spread-source-ports") && argc >= 2 && !buf.dev->num_peers) {
+			int on = parse_switch(argv[1]);
+			if (on < 0)
+				goto error;
+			buf.dev->spread_source_ports = on;
+			buf.dev->set_spread_source_ports = true;
+			argv += 2;
+			argc -= 2;
+		} else if (!strcmp(argv[0], "keep-sessions") && argc >= 2 && !buf.dev->num_peers) {
+			int on = parse_switch(argv[1]);
+			if (on < 0)
+				goto error;
+			buf.dev->keep_sessions = on;
+			buf.dev->set_keep_sessions = true;
+			argv += 2;
+			argc -= 2;
+		} else if (!strcmp(argv[0], "auto-mtu") && argc >= 2 && !buf.dev->num_peers) {
+			int on = parse_switch(argv[1]);
+			if (on < 0)
+				goto error;
+			buf.dev->auto_mtu = on;
+			buf.dev->set_auto_mtu = true;
+			argv += 2;
+			argc -= 2;
+		} else if (!strcmp(argv[0], "replay-window") && argc >= 2 && !buf.dev->num_peers) {
+			if (!parse_replay_window(&buf.dev->replay_window, argv[1]))
+				goto error;
+			argv += 2;
+			argc -= 2;
+		} else if (!strcmp(argv[0], "fast-path") && argc >= 2 && !buf.dev->num_peers) {
+			if (!parse_fast_path(&buf.dev->fast_path_ifindex, argv[1]))
+				goto error;
+			buf.dev->set_fast_path = true;
+			argv += 2;
+			argc -= 2;
+		} else if (!strcmp(argv[0], "crypto-cpus") && argc >= 2 && !buf.dev->num_peers) {
+			if (!parse_cpus(buf.dev->crypto_cpus, argv[1]))
+				goto error;
+			buf.dev->set_crypto_cpus = true;
+			argv += 2;
+			argc -= 2;
 		} else if (!strcmp(argv[0], "private-key") && argc >= 2 && !buf.dev->num_peers) {
 			char *line;
 			int ret = read_line(&line, argv[1]);
@@ -490,7 +668,12 @@ bool config_read_cmd(struct wgdevice **device, char *argv[], int argc)
 			argv += 1;
 			argc -= 1;
 		} else if (!strcmp(argv[0], "endpoint") && argc >= 2 && buf.dev->num_peers) {
-			if (!parse_endpoint(&peer_from_offset(buf.dev, peer_offset)->endpoint, argv[1]))
+			if (!parse_endpoints(peer_from_offset(buf.dev, peer_offset)->endpoints, argv[1]))
+				goto error;
+			argv += 2;
+			argc -= 2;
+		} else if (!strcmp(argv[0], "max-endpoints") && argc >= 2 && buf.dev->num_peers) {
+			if (!parse_max_endpoints(&peer_from_offset(buf.dev, peer_offset)->max_endpoints, argv[1]))
 				goto error;
 			argv += 2;
 			argc -= 2;
@@ -516,3 +699,23 @@ error:
 	free(buf.dev);
 	return false;
 }
+
+char *config_cpulist(const __u64 mask[WG_CPUMASK_WORDS])
+{
+	static char buf[WG_CPUMASK_WORDS * 64 * 6];
+	unsigned int cpu, last;
+	size_t len = 0;
+
+	buf[0] = '\0';
+	for (cpu = 0; cpu < WG_CPUMASK_WORDS * 64; ++cpu) {
+		if (!(mask[cpu / 64] & (1ULL << (cpu % 64))))
+			continue;
+		for (last = cpu; last + 1 < WG_CPUMASK_WORDS * 64 && (mask[(last + 1) / 64] & (1ULL << ((last + 1) % 64))); ++last);
+		if (last == cpu)
+			len += snprintf(buf + len, sizeof(buf) - len, "%s%u", len ? "," : "", cpu);
+		else
+			len += snprintf(buf + len, sizeof(buf) - len, "%s%u-%u", len ? "," : "", cpu, last);
+		cpu = last;
+	}
+	return buf;
+}
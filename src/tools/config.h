@@ -31,4 +31,6 @@ bool config_read_init(struct config_ctx *ctx, struct wgdevice **device, bool app
 bool config_read_line(struct config_ctx *ctx, const char *line);
 bool config_read_finish(struct config_ctx *ctx);
 
+char *config_cpulist(const __u64 mask[WG_CPUMASK_WORDS]);
+
 #endif
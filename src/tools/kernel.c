@@ -2,6 +2,7 @@
 
 #include <errno.h>
 #include <libmnl/libmnl.h>
+#include <linux/genetlink.h>
 #include <linux/if_link.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
@@ -29,6 +30,7 @@ struct inflatable_buffer {
 };
 
 #define max(a, b) (a > b ? a : b)
+#define MAX_DUMP_ATTEMPTS 10
 
 static int add_next_to_inflatable_buffer(struct inflatable_buffer *buffer)
 {
@@ -203,12 +205,13 @@ static int do_ioctl(int req, struct ifreq *ifreq)
 int kernel_set_device(struct wgdevice *dev)
 {
 	struct ifreq ifreq = { .ifr_data = (char *)dev };
+	dev->version_magic = WG_API_VERSION_MAGIC;
 	memcpy(&ifreq.ifr_name, dev->interface, IFNAMSIZ);
 	ifreq.ifr_name[IFNAMSIZ - 1] = 0;
 	return do_ioctl(WG_SET_DEVICE, &ifreq);
 }
 
-int kernel_get_device(struct wgdevice **dev, const char *interface)
+static int kernel_get_device_ioctl(struct wgdevice **dev, const char *interface)
 {
 	int ret;
 	struct ifreq ifreq = { 0 };
@@ -226,12 +229,16 @@ int kernel_get_device(struct wgdevice **dev, const char *interface)
 			ret = -ENOMEM;
 			goto out;
 		}
+		(*dev)->version_magic = WG_API_VERSION_MAGIC;
 		(*dev)->peers_size = ret;
 		ifreq.ifr_data = (char *)*dev;
 		memcpy(&ifreq.ifr_name, interface, IFNAMSIZ);
 		ifreq.ifr_name[IFNAMSIZ - 1] = 0;
 		ret = do_ioctl(WG_GET_DEVICE, &ifreq);
 	} while (ret == -EMSGSIZE);
+	/* Modules from before there was a version write something else over it. */
+	if (!ret && (*dev)->version_magic != WG_API_VERSION_MAGIC)
+		ret = -EPROTO;
 	if (ret < 0) {
 		free(*dev);
 		*dev = NULL;
@@ -240,3 +247,387 @@ out:
 	errno = -ret;
 	return ret;
 }
+
+static int get_family_id_cb(const struct nlmsghdr *nlh, void *data)
+{
+	uint16_t *family = data;
+	struct nlattr *attr;
+
+	mnl_attr_for_each(attr, nlh, sizeof(struct genlmsghdr)) {
+		if (mnl_attr_get_type(attr) == CTRL_ATTR_FAMILY_ID && !mnl_attr_validate(attr, MNL_TYPE_U16))
+			*family = mnl_attr_get_u16(attr);
+	}
+	return MNL_CB_OK;
+}
+
+static int get_family_id(struct mnl_socket *nl, char *buffer, uint16_t *family)
+{
+	unsigned int portid = mnl_socket_get_portid(nl), seq = time(NULL);
+	struct nlmsghdr *nlh;
+	struct genlmsghdr *genl;
+	ssize_t len;
+
+	*family = 0;
+	nlh = mnl_nlmsg_put_header(buffer);
+	nlh->nlmsg_type = GENL_ID_CTRL;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	nlh->nlmsg_seq = seq;
+	genl = mnl_nlmsg_put_extra_header(nlh, sizeof(*genl));
+	genl->cmd = CTRL_CMD_GETFAMILY;
+	genl->version = 1;
+	mnl_attr_put_strz(nlh, CTRL_ATTR_FAMILY_NAME, WG_GENL_NAME);
+
+	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
+		return -errno;
+	do {
+		if ((len = mnl_socket_recvfrom(nl, buffer, MNL_SOCKET_BUFFER_SIZE)) < 0)
+			return -errno;
+		if ((len = mnl_cb_run(buffer, len, seq, portid, get_family_id_cb, family)) < 0)
+			return -errno;
+	} while (len > 0);
+	return *family ? 0 : -ENOENT;
+}
+
+/* The dump is put back together into the same layout that the ioctl returns. */
+struct device_buffer {
+	struct wgdevice *dev;
+	size_t len, size;
+	size_t peer; /* Offset of the peer being filled, or 0 if there is none yet. */
+	unsigned int endpoints;
+	bool interrupted;
+};
+
+#define CURRENT_PEER(buffer) ((struct wgpeer *)((uint8_t *)(buffer)->dev + (buffer)->peer))
+
+static void *extend_device_buffer(struct device_buffer *buffer, size_t len)
+{
+	size_t expand_to;
+	void *new_buffer;
+
+	if (buffer->size - buffer->len < len) {
+		expand_to = max(buffer->size * 2, buffer->len + len);
+		new_buffer = realloc(buffer->dev, expand_to);
+		if (!new_buffer)
+			return NULL;
+		buffer->dev = new_buffer;
+		buffer->size = expand_to;
+	}
+	new_buffer = (uint8_t *)buffer->dev + buffer->len;
+	memset(new_buffer, 0, len);
+	buffer->len += len;
+	return new_buffer;
+}
+
+static int parse_ipmask(const struct nlattr *attr, void *data)
+{
+	struct wgipmask *ipmask = data;
+
+	switch (mnl_attr_get_type(attr)) {
+	case WGIPMASK_A_FAMILY:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U16))
+			ipmask->family = mnl_attr_get_u16(attr);
+		break;
+	case WGIPMASK_A_IP:
+		if (mnl_attr_get_payload_len(attr) == sizeof(ipmask->ip4))
+			memcpy(&ipmask->ip4, mnl_attr_get_payload(attr), sizeof(ipmask->ip4));
+		else if (mnl_attr_get_payload_len(attr) == sizeof(ipmask->ip6))
+			memcpy(&ipmask->ip6, mnl_attr_get_payload(attr), sizeof(ipmask->ip6));
+		break;
+	case WGIPMASK_A_CIDR:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U8))
+			ipmask->cidr = mnl_attr_get_u8(attr);
+		break;
+	}
+	return MNL_CB_OK;
+}
+
+static int parse_ipmasks(const struct nlattr *attr, void *data)
+{
+	struct device_buffer *buffer = data;
+	struct wgipmask *ipmask = extend_device_buffer(buffer, sizeof(struct wgipmask));
+
+	if (!ipmask) {
+		errno = ENOMEM;
+		return MNL_CB_ERROR;
+	}
+	++CURRENT_PEER(buffer)->num_ipmasks;
+	return mnl_attr_parse_nested(attr, parse_ipmask, ipmask);
+}
+
+static int parse_endpoints(const struct nlattr *attr, void *data)
+{
+	struct device_buffer *buffer = data;
+	struct wgpeer *peer = CURRENT_PEER(buffer);
+	size_t len = mnl_attr_get_payload_len(attr);
+
+	if (buffer->endpoints >= WG_MAX_ENDPOINTS)
+		return MNL_CB_OK;
+	if (len == sizeof(struct sockaddr_in) || len == sizeof(struct sockaddr_in6))
+		memcpy(&peer->endpoints[buffer->endpoints++], mnl_attr_get_payload(attr), len);
+	return MNL_CB_OK;
+}
+
+static int parse_peer(const struct nlattr *attr, void *data)
+{
+	struct device_buffer *buffer = data;
+	struct wgpeer *peer = CURRENT_PEER(buffer);
+
+	switch (mnl_attr_get_type(attr)) {
+	case WGPEER_A_MAX_ENDPOINTS:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U8))
+			peer->max_endpoints = mnl_attr_get_u8(attr);
+		break;
+	case WGPEER_A_LAST_HANDSHAKE_TIME:
+		if (mnl_attr_get_payload_len(attr) == sizeof(peer->last_handshake_time))
+			memcpy(&peer->last_handshake_time, mnl_attr_get_payload(attr), sizeof(peer->last_handshake_time));
+		break;
+	case WGPEER_A_RX_BYTES:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U64))
+			peer->rx_bytes = mnl_attr_get_u64(attr);
+		break;
+	case WGPEER_A_TX_BYTES:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U64))
+			peer->tx_bytes = mnl_attr_get_u64(attr);
+		break;
+	case WGPEER_A_MTU:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U32))
+			peer->mtu = mnl_attr_get_u32(attr);
+		break;
+	case WGPEER_A_ENDPOINTS:
+		buffer->endpoints = 0;
+		return mnl_attr_parse_nested(attr, parse_endpoints, buffer);
+	case WGPEER_A_IPMASKS:
+		return mnl_attr_parse_nested(attr, parse_ipmasks, buffer);
+	}
+	return MNL_CB_OK;
+}
+
+static int parse_peers(const struct nlattr *attr, void *data)
+{
+	struct device_buffer *buffer = data;
+	const uint8_t *public_key = NULL;
+	struct wgpeer *peer;
+	struct nlattr *nested;
+
+	mnl_attr_for_each_nested(nested, attr) {
+		if (mnl_attr_get_type(nested) == WGPEER_A_PUBLIC_KEY && mnl_attr_get_payload_len(nested) == WG_KEY_LEN)
+			public_key = mnl_attr_get_payload(nested);
+	}
+	if (!public_key)
+		return MNL_CB_OK;
+
+	/* A peer that didn't fit in the last message is continued at the start of this one. */
+	if (!buffer->peer || memcmp(CURRENT_PEER(buffer)->public_key, public_key, WG_KEY_LEN)) {
+		peer = extend_device_buffer(buffer, sizeof(struct wgpeer));
+		if (!peer) {
+			errno = ENOMEM;
+			return MNL_CB_ERROR;
+		}
+		buffer->peer = (uint8_t *)peer - (uint8_t *)buffer->dev;
+		memcpy(peer->public_key, public_key, WG_KEY_LEN);
+		++buffer->dev->num_peers;
+	}
+	return mnl_attr_parse_nested(attr, parse_peer, buffer);
+}
+
+static int parse_device(const struct nlattr *attr, void *data)
+{
+	struct device_buffer *buffer = data;
+	struct wgdevice *dev = buffer->dev;
+	size_t len = mnl_attr_get_payload_len(attr);
+
+	switch (mnl_attr_get_type(attr)) {
+	case WGDEVICE_A_IFNAME:
+		if (!mnl_attr_validate(attr, MNL_TYPE_STRING)) {
+			strncpy(dev->interface, mnl_attr_get_str(attr), IFNAMSIZ - 1);
+			dev->interface[IFNAMSIZ - 1] = '\0';
+		}
+		break;
+	case WGDEVICE_A_PRIVATE_KEY:
+		if (len == WG_KEY_LEN)
+			memcpy(dev->private_key, mnl_attr_get_payload(attr), WG_KEY_LEN);
+		break;
+	case WGDEVICE_A_PUBLIC_KEY:
+		if (len == WG_KEY_LEN)
+			memcpy(dev->public_key, mnl_attr_get_payload(attr), WG_KEY_LEN);
+		break;
+	case WGDEVICE_A_PRESHARED_KEY:
+		if (len == WG_KEY_LEN)
+			memcpy(dev->preshared_key, mnl_attr_get_payload(attr), WG_KEY_LEN);
+		break;
+	case WGDEVICE_A_LISTEN_PORT:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U16))
+			dev->port = mnl_attr_get_u16(attr);
+		break;
+	case WGDEVICE_A_SPREAD_SOURCE_PORTS:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U8))
+			dev->spread_source_ports = !!mnl_attr_get_u8(attr);
+		break;
+	case WGDEVICE_A_KEEP_SESSIONS:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U8))
+			dev->keep_sessions = !!mnl_attr_get_u8(attr);
+		break;
+	case WGDEVICE_A_AUTO_MTU:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U8))
+			dev->auto_mtu = !!mnl_attr_get_u8(attr);
+		break;
+	case WGDEVICE_A_REPLAY_WINDOW:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U32))
+			dev->replay_window = mnl_attr_get_u32(attr);
+		break;
+	case WGDEVICE_A_FAST_PATH_IFINDEX:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U32))
+			dev->fast_path_ifindex = mnl_attr_get_u32(attr);
+		break;
+	case WGDEVICE_A_CRYPTO_CPUS:
+		memcpy(dev->crypto_cpus, mnl_attr_get_payload(attr), len < sizeof(dev->crypto_cpus) ? len : sizeof(dev->crypto_cpus));
+		break;
+	case WGDEVICE_A_DROPS:
+		memcpy(dev->drops, mnl_attr_get_payload(attr), len < sizeof(dev->drops) ? len : sizeof(dev->drops));
+		break;
+	case WGDEVICE_A_PEERS:
+		return mnl_attr_parse_nested(attr, parse_peers, buffer);
+	}
+	return MNL_CB_OK;
+}
+
+static int read_device_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct device_buffer *buffer = data;
+
+	if (nlh->nlmsg_flags & NLM_F_DUMP_INTR)
+		buffer->interrupted = true;
+	return mnl_attr_parse(nlh, sizeof(struct genlmsghdr), parse_device, buffer);
+}
+
+/* Errors finding the device come back in the NLMSG_DONE that ends the dump, rather than in an NLMSG_ERROR. */
+static int read_done_cb(const struct nlmsghdr *nlh, __attribute__((unused)) void *data)
+{
+	const int *error = mnl_nlmsg_get_payload(nlh);
+
+	if (nlh->nlmsg_len >= mnl_nlmsg_size(sizeof(*error)) && *error < 0) {
+		errno = -*error;
+		return MNL_CB_ERROR;
+	}
+	return MNL_CB_STOP;
+}
+
+static int read_error_cb(const struct nlmsghdr *nlh, __attribute__((unused)) void *data)
+{
+	const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+
+	if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(*err))) {
+		errno = EBADMSG;
+		return MNL_CB_ERROR;
+	}
+	if (err->error < 0) {
+		errno = -err->error;
+		return MNL_CB_ERROR;
+	}
+	return MNL_CB_STOP;
+}
+
+static const mnl_cb_t read_device_ctl_cbs[NLMSG_MIN_TYPE] = {
+	[NLMSG_ERROR] = read_error_cb,
+	[NLMSG_DONE] = read_done_cb
+};
+
+static int kernel_get_device_netlink(struct wgdevice **dev, const char *interface)
+{
+	struct mnl_socket *nl = NULL;
+	struct device_buffer buffer = { 0 };
+	struct nlmsghdr *nlh;
+	struct genlmsghdr *genl;
+	unsigned int portid, seq, attempts = 0;
+	char *nl_buffer = NULL;
+	uint16_t family;
+	ssize_t len;
+	int ret = 0;
+
+	nl_buffer = calloc(MNL_SOCKET_BUFFER_SIZE, 1);
+	if (!nl_buffer) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	nl = mnl_socket_open(NETLINK_GENERIC);
+	if (!nl) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	ret = get_family_id(nl, nl_buffer, &family);
+	if (ret < 0)
+		goto cleanup;
+	portid = mnl_socket_get_portid(nl);
+	seq = time(NULL);
+
+try_again:
+	free(buffer.dev);
+	memset(&buffer, 0, sizeof(buffer));
+	if (!extend_device_buffer(&buffer, sizeof(struct wgdevice))) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	nlh = mnl_nlmsg_put_header(nl_buffer);
+	nlh->nlmsg_type = family;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_seq = ++seq;
+	genl = mnl_nlmsg_put_extra_header(nlh, sizeof(*genl));
+	genl->cmd = WG_CMD_GET_DEVICE;
+	genl->version = WG_GENL_VERSION;
+	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, interface);
+
+	if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
+		ret = -errno;
+		goto cleanup;
+	}
+	do {
+		if ((len = mnl_socket_recvfrom(nl, nl_buffer, MNL_SOCKET_BUFFER_SIZE)) < 0) {
+			ret = -errno;
+			goto cleanup;
+		}
+		if ((len = mnl_cb_run2(nl_buffer, len, seq, portid, read_device_cb, &buffer, read_device_ctl_cbs, NLMSG_MIN_TYPE)) < 0) {
+			ret = -errno;
+			goto cleanup;
+		}
+	} while (len > 0);
+
+	/* The device changed while it was being dumped, so what we have may not be coherent. If it keeps
+	 * changing, we give up rather than dumping forever. */
+	if (buffer.interrupted) {
+		if (++attempts < MAX_DUMP_ATTEMPTS)
+			goto try_again;
+		ret = -EAGAIN;
+		goto cleanup;
+	}
+
+	*dev = buffer.dev;
+	buffer.dev = NULL;
+
+cleanup:
+	free(buffer.dev);
+	free(nl_buffer);
+	if (nl)
+		mnl_socket_close(nl);
+	return ret;
+}
+
+int kernel_get_device(struct wgdevice **dev, const char *interface)
+{
+	int ret;
+
+	*dev = NULL;
+	ret = kernel_get_device_netlink(dev, interface);
+	/* Modules from before there was a netlink family only have the ioctl. */
+	if (ret == -ENOENT)
+		return kernel_get_device_ioctl(dev, interface);
+	errno = -ret;
+	return ret;
+}
@@ -13,7 +13,7 @@ int set_main(int argc, char *argv[])
 	int ret = 1;
 
 	if (argc < 3) {
-		fprintf(stderr, "Usage: %s %s <interface> [listen-port <port>] [private-key <file path>] [peer <base64 public key> [remove] [endpoint <ip>:<port>] [allowed-ips <ip1>/<cidr1>[,<ip2>/<cidr2>]...] ]...\n", PROG_NAME, argv[0]);
+		fprintf(stderr, "Usage: %s %s <interface> [listen-port <port>] [spread-source-ports on|off] [keep-sessions on|off] [auto-mtu on|off] [replay-window <packets>] [fast-path <interface>|off] [crypto-cpus <cpu list>] [private-key <file path>] [peer <base64 public key> [remove] [endpoint <ip>:<port>[,<ip>:<port>]...] [max-endpoints <count>] [allowed-ips <ip1>/<cidr1>[,<ip2>/<cidr2>]...] ]...\n", PROG_NAME, argv[0]);
 		return 1;
 	}
 
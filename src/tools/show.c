@@ -18,6 +18,7 @@
 #include "subcommands.h"
 #include "terminal.h"
 #include "base64.h"
+#include "config.h"
 #include "../uapi.h"
 
 static int peer_cmp(const void *first, const void *second)
@@ -173,17 +174,42 @@ static char *bytes(uint64_t b)
 	return buf;
 }
 
+static const char *drop_reasons[WG_DROP_REASON_COUNT] = {
+	[WG_DROP_TX_NO_PEER] = "tx-no-peer",
+	[WG_DROP_TX_NO_ENDPOINT] = "tx-no-endpoint",
+	[WG_DROP_TX_LOOP] = "tx-loop",
+	[WG_DROP_TX_GSO] = "tx-gso",
+	[WG_DROP_TX_TOO_BIG] = "tx-too-big",
+	[WG_DROP_TX_QUEUE_FULL] = "tx-queue-full",
+	[WG_DROP_TX_NO_MEMORY] = "tx-no-memory",
+	[WG_DROP_TX_ENCRYPT] = "tx-encrypt",
+	[WG_DROP_TX_SEND] = "tx-send",
+	[WG_DROP_TX_HANDSHAKE_TIMEOUT] = "tx-handshake-timeout",
+	[WG_DROP_RX_INVALID] = "rx-invalid",
+	[WG_DROP_RX_HANDSHAKE_QUEUE_FULL] = "rx-handshake-queue-full",
+	[WG_DROP_RX_NO_MEMORY] = "rx-no-memory",
+	[WG_DROP_RX_NO_KEYPAIR] = "rx-no-keypair",
+	[WG_DROP_RX_BUSY] = "rx-busy",
+	[WG_DROP_RX_DECRYPT] = "rx-decrypt",
+	[WG_DROP_RX_INVALID_NONCE] = "rx-invalid-nonce",
+	[WG_DROP_RX_INVALID_LENGTH] = "rx-invalid-length",
+	[WG_DROP_RX_UNALLOWED_SOURCE] = "rx-unallowed-source",
+	[WG_DROP_RX_STACK] = "rx-stack"
+};
+
 static const char *COMMAND_NAME = NULL;
 static void show_usage(void)
 {
-	fprintf(stderr, "Usage: %s %s { <interface> | all | interfaces } [public-key | private-key | preshared-key | listen-port | peers | endpoints | allowed-ips | latest-handshake | bandwidth]\n", PROG_NAME, COMMAND_NAME);
+	fprintf(stderr, "Usage: %s %s { <interface> | all | interfaces } [public-key | private-key | preshared-key | listen-port | peers | endpoints | allowed-ips | latest-handshake | bandwidth | drops]\n", PROG_NAME, COMMAND_NAME);
 }
 
 static void pretty_print(struct wgdevice *device)
 {
+	char ifname[IF_NAMESIZE];
 	size_t i, j;
 	struct wgpeer *peer;
 	struct wgipmask *ipmask;
+	bool dropped = false;
 
 	terminal_printf(TERMINAL_RESET);
 	terminal_printf(TERMINAL_FG_GREEN TERMINAL_BOLD "interface" TERMINAL_RESET ": " TERMINAL_FG_GREEN "%s" TERMINAL_RESET "\n", device->interface);
@@ -195,14 +221,41 @@ static void pretty_print(struct wgdevice *device)
 		terminal_printf("  " TERMINAL_BOLD "pre-shared key" TERMINAL_RESET ": %s\n", key(device->preshared_key));
 	if (device->port)
 		terminal_printf("  " TERMINAL_BOLD "listening port" TERMINAL_RESET ": %u\n", device->port);
+	if (device->spread_source_ports)
+		terminal_printf("  " TERMINAL_BOLD "spreading source ports" TERMINAL_RESET ": %u-%u\n", WG_SOURCE_PORT_SPREAD_BASE(device->port), WG_SOURCE_PORT_SPREAD_BASE(device->port) + WG_SOURCE_PORT_SPREAD - 1);
+	if (device->keep_sessions)
+		terminal_printf("  " TERMINAL_BOLD "keeping sessions" TERMINAL_RESET ": across down and up\n");
+	if (device->auto_mtu)
+		terminal_printf("  " TERMINAL_BOLD "mtu" TERMINAL_RESET ": automatic\n");
+	if (device->replay_window && device->replay_window != WG_REPLAY_WINDOW_MIN)
+		terminal_printf("  " TERMINAL_BOLD "replay window" TERMINAL_RESET ": %u packets\n", device->replay_window);
+	if (device->fast_path_ifindex && if_indextoname(device->fast_path_ifindex, ifname))
+		terminal_printf("  " TERMINAL_BOLD "fast path" TERMINAL_RESET ": %s\n", ifname);
+	if (*config_cpulist(device->crypto_cpus))
+		terminal_printf("  " TERMINAL_BOLD "crypto cpus" TERMINAL_RESET ": %s\n", config_cpulist(device->crypto_cpus));
+	for (i = 0; i < WG_DROP_REASON_COUNT; ++i) {
+		if (!device->drops[i])
+			continue;
+		if (!dropped)
+			terminal_printf("  " TERMINAL_BOLD "drops" TERMINAL_RESET ": ");
+		terminal_printf("%s%" PRIu64 " %s", dropped ? ", " : "", (uint64_t)device->drops[i], drop_reasons[i]);
+		dropped = true;
+	}
+	if (dropped)
+		terminal_printf("\n");
 	if (device->num_peers) {
 		sort_peers(device);
 		terminal_printf("\n");
 	}
 	for_each_wgpeer(device, peer, i) {
 		terminal_printf(TERMINAL_FG_YELLOW TERMINAL_BOLD "peer" TERMINAL_RESET ": " TERMINAL_FG_YELLOW "%s" TERMINAL_RESET "\n", key(peer->public_key));
-		if (peer->endpoint.ss_family == AF_INET || peer->endpoint.ss_family == AF_INET6)
-			terminal_printf("  " TERMINAL_BOLD "endpoint" TERMINAL_RESET ": %s\n", endpoint(&peer->endpoint));
+		for (j = 0; j < WG_MAX_ENDPOINTS && (peer->endpoints[j].ss_family == AF_INET || peer->endpoints[j].ss_family == AF_INET6); ++j) {
+			if (!j)
+				terminal_printf("  " TERMINAL_BOLD "endpoint" TERMINAL_RESET ": ");
+			terminal_printf("%s%s", j ? ", " : "", endpoint(&peer->endpoints[j]));
+		}
+		if (j)
+			terminal_printf("\n");
 		terminal_printf("  " TERMINAL_BOLD "allowed ips" TERMINAL_RESET ": ");
 		if (peer->num_ipmasks) {
 			for_each_wgipmask(peer, ipmask, j)
@@ -216,6 +269,8 @@ static void pretty_print(struct wgdevice *device)
 			terminal_printf("%s received, ", bytes(peer->rx_bytes));
 			terminal_printf("%s sent\n", bytes(peer->tx_bytes));
 		}
+		if (peer->mtu)
+			terminal_printf("  " TERMINAL_BOLD "path mtu" TERMINAL_RESET ": %u\n", peer->mtu);
 		if (i + 1 < device->num_peers)
 			terminal_printf("\n");
 	}
@@ -247,10 +302,9 @@ static bool ugly_print(struct wgdevice *device, const char *param, bool with_int
 			printf("%s\t", device->interface);
 		for_each_wgpeer(device, peer, i) {
 			printf("%s\t", key(peer->public_key));
-			if (peer->endpoint.ss_family == AF_INET || peer->endpoint.ss_family == AF_INET6)
-				printf("%s\n", endpoint(&peer->endpoint));
-			else
-				printf("(none)\n");
+			for (j = 0; j < WG_MAX_ENDPOINTS && (peer->endpoints[j].ss_family == AF_INET || peer->endpoints[j].ss_family == AF_INET6); ++j)
+				printf("%s%s", j ? ", " : "", endpoint(&peer->endpoints[j]));
+			printf("%s\n", j ? "" : "(none)");
 		}
 	} else if (!strcmp(param, "allowed-ips")) {
 		for_each_wgpeer(device, peer, i) {
@@ -275,6 +329,12 @@ static bool ugly_print(struct wgdevice *device, const char *param, bool with_int
 				printf("%s\t", device->interface);
 			printf("%s\t%" PRIu64 "\t%" PRIu64 "\n", key(peer->public_key), (uint64_t)peer->rx_bytes, (uint64_t)peer->tx_bytes);
 		}
+	} else if (!strcmp(param, "drops")) {
+		for (i = 0; i < WG_DROP_REASON_COUNT; ++i) {
+			if (with_interface)
+				printf("%s\t", device->interface);
+			printf("%s\t%" PRIu64 "\n", drop_reasons[i], (uint64_t)device->drops[i]);
+		}
 	} else if (!strcmp(param, "peers")) {
 		for_each_wgpeer(device, peer, i) {
 			if (with_interface)
@@ -13,6 +13,7 @@
 #include "subcommands.h"
 #include "base64.h"
 #include "kernel.h"
+#include "config.h"
 #include "../uapi.h"
 
 int showconf_main(int argc, char *argv[])
@@ -20,6 +21,7 @@ int showconf_main(int argc, char *argv[])
 	static const uint8_t zero[WG_KEY_LEN] = { 0 };
 	char b64[b64_len(WG_KEY_LEN)] = { 0 };
 	char ip[INET6_ADDRSTRLEN];
+	char ifname[IF_NAMESIZE];
 	struct wgdevice *device = NULL;
 	struct wgpeer *peer;
 	struct wgipmask *ipmask;
@@ -45,6 +47,18 @@ int showconf_main(int argc, char *argv[])
 	printf("[Interface]\n");
 	if (device->port)
 		printf("ListenPort = %d\n", device->port);
+	if (device->spread_source_ports)
+		printf("SpreadSourcePorts = on\n");
+	if (device->keep_sessions)
+		printf("KeepSessions = on\n");
+	if (device->auto_mtu)
+		printf("AutoMTU = on\n");
+	if (device->replay_window && device->replay_window != WG_REPLAY_WINDOW_MIN)
+		printf("ReplayWindow = %u\n", device->replay_window);
+	if (device->fast_path_ifindex && if_indextoname(device->fast_path_ifindex, ifname))
+		printf("FastPath = %s\n", ifname);
+	if (*config_cpulist(device->crypto_cpus))
+		printf("CryptoCPUs = %s\n", config_cpulist(device->crypto_cpus));
 	if (memcmp(device->private_key, zero, WG_KEY_LEN)) {
 		b64_ntop(device->private_key, WG_KEY_LEN, b64, b64_len(WG_KEY_LEN));
 		printf("PrivateKey = %s\n", b64);
@@ -75,21 +89,25 @@ int showconf_main(int argc, char *argv[])
 		if (peer->num_ipmasks)
 			printf("\n");
 
-		if (peer->endpoint.ss_family == AF_INET || peer->endpoint.ss_family == AF_INET6) {
+		for (j = 0; j < WG_MAX_ENDPOINTS && (peer->endpoints[j].ss_family == AF_INET || peer->endpoints[j].ss_family == AF_INET6); ++j) {
 			char host[4096 + 1];
 			char service[512 + 1];
 			static char buf[sizeof(host) + sizeof(service) + 4];
 			socklen_t addr_len = 0;
 			memset(buf, 0, sizeof(buf));
-			if (peer->endpoint.ss_family == AF_INET)
+			if (peer->endpoints[j].ss_family == AF_INET)
 				addr_len = sizeof(struct sockaddr_in);
-			else if (peer->endpoint.ss_family == AF_INET6)
+			else if (peer->endpoints[j].ss_family == AF_INET6)
 				addr_len = sizeof(struct sockaddr_in6);
-			if (!getnameinfo((struct sockaddr *)&peer->endpoint, addr_len, host, sizeof(host), service, sizeof(service), NI_DGRAM | NI_NUMERICSERV | NI_NUMERICHOST)) {
-				snprintf(buf, sizeof(buf) - 1, (peer->endpoint.ss_family == AF_INET6 && strchr(host, ':')) ? "[%s]:%s" : "%s:%s", host, service);
-				printf("Endpoint = %s\n", buf);
+			if (!getnameinfo((struct sockaddr *)&peer->endpoints[j], addr_len, host, sizeof(host), service, sizeof(service), NI_DGRAM | NI_NUMERICSERV | NI_NUMERICHOST)) {
+				snprintf(buf, sizeof(buf) - 1, (peer->endpoints[j].ss_family == AF_INET6 && strchr(host, ':')) ? "[%s]:%s" : "%s:%s", host, service);
+				printf("%s%s", j ? ", " : "Endpoint = ", buf);
 			}
 		}
+		if (j)
+			printf("\n");
+		if (peer->max_endpoints > 1)
+			printf("MaxEndpoints = %u\n", peer->max_endpoints);
 
 		if (i + 1 < device->num_peers)
 			printf("\n");
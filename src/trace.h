@@ -0,0 +1,217 @@
+/* Copyright 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM wireguard
+
+#if !defined(WGTRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define WGTRACE_H
+
+#include "peer.h"
+#include "messages.h"
+#include <linux/tracepoint.h>
+
+/* Static tracepoints along the data and handshake paths, for latency breakdowns with perf or bpftrace.
+ * Each is a patched out branch when not enabled, and arguments are only evaluated when it is. Peers are
+ * identified by their internal id, which is also what the debug messages print. */
+
+#define show_message_type(type) __print_symbolic(type, \
+	{ MESSAGE_HANDSHAKE_INITIATION, "initiation" }, \
+	{ MESSAGE_HANDSHAKE_RESPONSE, "response" }, \
+	{ MESSAGE_HANDSHAKE_COOKIE, "cookie" }, \
+	{ MESSAGE_DATA, "data" })
+
+TRACE_EVENT(wg_xmit,
+	TP_PROTO(struct wireguard_peer *peer, struct sk_buff *skb),
+	TP_ARGS(peer, skb),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(unsigned int, len)
+		__field(unsigned int, segs)
+		__field(unsigned int, queue_len)
+	),
+	TP_fast_assign(
+		__entry->peer_id = peer->internal_id;
+		__entry->len = skb->len;
+		__entry->segs = skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+		__entry->queue_len = skb_queue_len(&peer->tx_packet_queue);
+	),
+	TP_printk("peer=%llu len=%u segs=%u queue_len=%u", __entry->peer_id, __entry->len, __entry->segs, __entry->queue_len)
+);
+
+TRACE_EVENT(wg_packet_create_data,
+	TP_PROTO(struct wireguard_peer *peer, unsigned int len, unsigned int padding_len, u64 nonce, bool parallel),
+	TP_ARGS(peer, len, padding_len, nonce, parallel),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(u64, nonce)
+		__field(unsigned int, len)
+		__field(unsigned int, padding_len)
+		__field(bool, parallel)
+	),
+	TP_fast_assign(
+		__entry->peer_id = peer->internal_id;
+		__entry->nonce = nonce;
+		__entry->len = len;
+		__entry->padding_len = padding_len;
+		__entry->parallel = parallel;
+	),
+	TP_printk("peer=%llu len=%u padding=%u nonce=%llu parallel=%d", __entry->peer_id, __entry->len, __entry->padding_len, __entry->nonce, __entry->parallel)
+);
+
+DECLARE_EVENT_CLASS(wg_crypt,
+	TP_PROTO(struct wireguard_peer *peer, bool encrypt, unsigned int len, int cpu),
+	TP_ARGS(peer, encrypt, len, cpu),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(unsigned int, len)
+		__field(int, cpu)
+		__field(bool, encrypt)
+	),
+	TP_fast_assign(
+		__entry->peer_id = peer ? peer->internal_id : 0;
+		__entry->len = len;
+		__entry->cpu = cpu;
+		__entry->encrypt = encrypt;
+	),
+	TP_printk("peer=%llu %s len=%u cpu=%d", __entry->peer_id, __entry->encrypt ? "encrypt" : "decrypt", __entry->len, __entry->cpu)
+);
+
+/* The cpu of an enqueue is the one the work is sent to, and that of a dequeue the one handing results back. */
+DEFINE_EVENT(wg_crypt, wg_crypt_enqueue,
+	TP_PROTO(struct wireguard_peer *peer, bool encrypt, unsigned int len, int cpu),
+	TP_ARGS(peer, encrypt, len, cpu)
+);
+
+DEFINE_EVENT(wg_crypt, wg_crypt_dequeue,
+	TP_PROTO(struct wireguard_peer *peer, bool encrypt, unsigned int len, int cpu),
+	TP_ARGS(peer, encrypt, len, cpu)
+);
+
+TRACE_EVENT(wg_send_off_bundle,
+	TP_PROTO(struct wireguard_peer *peer, unsigned int packets, unsigned int bytes),
+	TP_ARGS(peer, packets, bytes),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(unsigned int, packets)
+		__field(unsigned int, bytes)
+		__field(unsigned int, queue_len)
+	),
+	TP_fast_assign(
+		__entry->peer_id = peer->internal_id;
+		__entry->packets = packets;
+		__entry->bytes = bytes;
+		__entry->queue_len = skb_queue_len(&peer->tx_packet_queue);
+	),
+	TP_printk("peer=%llu packets=%u bytes=%u queue_len=%u", __entry->peer_id, __entry->packets, __entry->bytes, __entry->queue_len)
+);
+
+TRACE_EVENT(wg_packet_consume_data,
+	TP_PROTO(struct wireguard_peer *peer, unsigned int len, u64 nonce, u32 key_idx),
+	TP_ARGS(peer, len, nonce, key_idx),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(u64, nonce)
+		__field(unsigned int, len)
+		__field(u32, key_idx)
+	),
+	TP_fast_assign(
+		__entry->peer_id = peer->internal_id;
+		__entry->nonce = nonce;
+		__entry->len = len;
+		__entry->key_idx = key_idx;
+	),
+	TP_printk("peer=%llu len=%u nonce=%llu key_idx=%08x", __entry->peer_id, __entry->len, __entry->nonce, __entry->key_idx)
+);
+
+TRACE_EVENT(wg_receive_data_packet,
+	TP_PROTO(struct wireguard_peer *peer, unsigned int len, bool used_new_key, int err),
+	TP_ARGS(peer, len, used_new_key, err),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(unsigned int, len)
+		__field(int, err)
+		__field(bool, used_new_key)
+	),
+	TP_fast_assign(
+		__entry->peer_id = peer ? peer->internal_id : 0;
+		__entry->len = len;
+		__entry->err = err;
+		__entry->used_new_key = used_new_key;
+	),
+	TP_printk("peer=%llu len=%u used_new_key=%d err=%d", __entry->peer_id, __entry->len, __entry->used_new_key, __entry->err)
+);
+
+DECLARE_EVENT_CLASS(wg_handshake_queue,
+	TP_PROTO(struct wireguard_device *wg, u8 type, unsigned int len, unsigned int queue_len),
+	TP_ARGS(wg, type, len, queue_len),
+	TP_STRUCT__entry(
+		__field(int, ifindex)
+		__field(unsigned int, len)
+		__field(unsigned int, queue_len)
+		__field(unsigned int, total)
+		__field(u8, type)
+	),
+	TP_fast_assign(
+		__entry->ifindex = netdev_pub(wg)->ifindex;
+		__entry->len = len;
+		__entry->queue_len = queue_len;
+		__entry->total = atomic_read(&wg->incoming_handshakes_count);
+		__entry->type = type;
+	),
+	TP_printk("ifindex=%d %s len=%u queue_len=%u total=%u", __entry->ifindex, show_message_type(__entry->type), __entry->len, __entry->queue_len, __entry->total)
+);
+
+/* The queue_len is that of the bucket the message's source address hashes to, and total is across buckets. */
+DEFINE_EVENT(wg_handshake_queue, wg_handshake_enqueue,
+	TP_PROTO(struct wireguard_device *wg, u8 type, unsigned int len, unsigned int queue_len),
+	TP_ARGS(wg, type, len, queue_len)
+);
+
+DEFINE_EVENT(wg_handshake_queue, wg_handshake_consume,
+	TP_PROTO(struct wireguard_device *wg, u8 type, unsigned int len, unsigned int queue_len),
+	TP_ARGS(wg, type, len, queue_len)
+);
+
+DECLARE_EVENT_CLASS(wg_timer,
+	TP_PROTO(struct wireguard_peer *peer),
+	TP_ARGS(peer),
+	TP_STRUCT__entry(
+		__field(u64, peer_id)
+		__field(unsigned int, handshake_attempts)
+		__field(unsigned int, queue_len)
+	),
+	TP_fast_assign(
+		__entry->peer_id = peer->internal_id;
+		__entry->handshake_attempts = peer->timer_handshake_attempts;
+		__entry->queue_len = skb_queue_len(&peer->tx_packet_queue);
+	),
+	TP_printk("peer=%llu handshake_attempts=%u queue_len=%u", __entry->peer_id, __entry->handshake_attempts, __entry->queue_len)
+);
+
+DEFINE_EVENT(wg_timer, wg_timer_retransmit_handshake,
+	TP_PROTO(struct wireguard_peer *peer),
+	TP_ARGS(peer)
+);
+
+DEFINE_EVENT(wg_timer, wg_timer_send_keepalive,
+	TP_PROTO(struct wireguard_peer *peer),
+	TP_ARGS(peer)
+);
+
+DEFINE_EVENT(wg_timer, wg_timer_new_handshake,
+	TP_PROTO(struct wireguard_peer *peer),
+	TP_ARGS(peer)
+);
+
+DEFINE_EVENT(wg_timer, wg_timer_kill_ephemerals,
+	TP_PROTO(struct wireguard_peer *peer),
+	TP_ARGS(peer)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
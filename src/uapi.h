@@ -3,6 +3,10 @@
  * Userspace API for WireGuard
  * ---------------------------
  *
+ * The layout of the structures below changes from one version to the next, so every call that passes them
+ * must set `wgdevice->version_magic` to WG_API_VERSION_MAGIC, and is refused with -EPROTO otherwise. Any
+ * change to the layout of wgdevice, wgpeer or wgipmask must bump WG_API_VERSION.
+ *
  * ioctl(WG_GET_DEVICE, { .ifr_name: "wg0", .ifr_data: NULL }):
  *
  *     Returns the number of bytes required to hold the peers of a device (`ret_peers_size`).
@@ -12,7 +16,7 @@
  *     Retrevies device info, peer info, and ipmask info.
  *
  *     `user_pointer` must point to a region of memory of size `sizeof(struct wgdevice) + ret_peers_size`
- *     and containing the structure `struct wgdevice { .peers_size: ret_peers_size }`.
+ *     and containing the structure `struct wgdevice { .version_magic: WG_API_VERSION_MAGIC, .peers_size: ret_peers_size }`.
  *
  *     Writes to `user_pointer` a succession of structs:
  *
@@ -48,15 +52,100 @@
  *                 struct wgipmask
  *             struct wgpeer { .num_ipmasks = 0 }
  *
- *     If `wgdevice->replace_peer_list` is true, removes all peers of device before adding new ones.
+ *     If `wgdevice->replace_peer_list` is true, removes all peers of device that are not in the new list, and replaces
+ *     the ipmasks of those that are. Peers that remain keep their sessions and endpoints.
  *     If `wgpeer->remove_me` is true, the peer identified by `wgpeer->public_key` is removed.
- *     If `wgpeer->replace_ipmasks` is true, removes all ipmasks before adding new ones.
+ *     If `wgpeer->replace_ipmasks` is true, removes all ipmasks that are not in the new list. Ipmasks that remain in the
+ *     new list are never removed, even briefly, so traffic to them is not interrupted.
+ *     If `wgpeer->endpoints[0]` is an IPv4 or IPv6 address, the endpoints of the peer are replaced by those that
+ *     are filled in of `wgpeer->endpoints`.
+ *     If `wgpeer->max_endpoints` is nonzero, the peer may have up to that many endpoints at once, and it is raised
+ *     to the number of endpoints given if lower. Peers start out with one, in which case an authenticated packet
+ *     from a new address replaces the endpoint. With more, new addresses are added, replacing the endpoint heard
+ *     from least recently once there is no room, and inner flows are spread over the endpoints heard from recently.
+ *     The whole peer list is checked before anything is applied, so a malformed request leaves the device unchanged.
  *     If `wgdevice->private_key` is filled with zeros, no action is taken on the private key.
  *     If `wgdevice->preshared_key` is filled with zeros, no action is taken on the pre-shared key.
  *     If `wgdevice->remove_private_key` is true, the private key is removed.
  *     If `wgdevice->remove_preshared_key` is true, the pre-shared key is removed.
+ *     On kernels 4.5 and later, the device listens on `wgdevice->port` with an SO_REUSEPORT group of up to eight
+ *     sockets per family, and packets go to the socket of the CPU that received them. Other sockets of the same
+ *     user may still bind the port with SO_REUSEPORT while the device is up, but they are never given a packet.
+ *     If `wgdevice->set_spread_source_ports` is true, source port spreading is turned on or off according to
+ *     `wgdevice->spread_source_ports`. When on, data packets are sent from a range of source ports starting at
+ *     WG_SOURCE_PORT_SPREAD_BASE of the listening port, chosen by inner flow, and packets from the range that
+ *     goes with a peer's known endpoint port are not treated as roaming. Both ends should agree on this setting.
+ *     If `wgdevice->set_keep_sessions` is true, keeping sessions is turned on or off according to
+ *     `wgdevice->keep_sessions`. When on, bringing the device down leaves each peer's keypairs and replay
+ *     state in place, so that traffic resumes without new handshakes when it comes back up, as long as
+ *     those keypairs haven't expired in the meantime. Kept keys are still zeroed out on their usual schedule
+ *     while the device is down.
+ *     If `wgdevice->set_auto_mtu` is true, automatic MTU is turned on or off according to `wgdevice->auto_mtu`.
+ *     When on, the MTU of the device follows the largest that the path to any of its peers allows, outer
+ *     packets are sent with DF set, so that routers along the path report when it shrinks, and inner packets
+ *     too big for the path to their peer are answered with ICMP, unless they may be fragmented. When off,
+ *     outer packets may be fragmented along the way, as before. Either way, the path MTU of each peer, as
+ *     far as it is known, is reported in `wgpeer->mtu`.
+ *     If `wgdevice->replay_window` is nonzero, it becomes the size in bits of the anti-replay bitmap of sessions
+ *     established from then on. It must be a power of two from 2048, the default, to 65536. A packet may arrive up
+ *     to that many, less one word, positions behind the newest and still be accepted. Each session costs that
+ *     many bits, and a peer has up to three sessions at once, so 24 KiB per peer at the maximum.
+ *     If `wgdevice->set_fast_path` is true, data messages arriving on the interface with index
+ *     `wgdevice->fast_path_ifindex` are taken straight from it, ahead of the IP and UDP receive paths, or
+ *     none are if it is 0. Packets that aren't data messages for the device continue on as usual, as do all
+ *     packets of a family for which the namespace has netfilter PRE_ROUTING or LOCAL_IN hooks, which includes
+ *     any firewall rules and conntrack, or inbound XFRM policies, since the fast path would skip them. The
+ *     interface must not belong to a bridge, bond or the like, and must be in the namespace the device
+ *     was created in.
+ *     If `wgdevice->set_crypto_cpus` is true, `wgdevice->crypto_cpus` becomes the bitmask of CPUs that do the
+ *     encryption and decryption of data packets, with bit N of word N / 64 standing for CPU N. An empty mask,
+ *     or one naming no online CPU, means every online CPU. Within the mask, CPUs on the same NUMA node as
+ *     the fast path interface, if there is one, are preferred.
  *
  *     Returns 0 on success, or -errno if an error occurred.
+ *
+ * Generic netlink family WG_GENL_NAME:
+ *
+ *     The same configuration is reachable over generic netlink, which, unlike the ioctls, never needs the whole
+ *     device in one buffer, nor holds the device locked for as long as it takes to copy all of it. Each command
+ *     names the device by WGDEVICE_A_IFINDEX or WGDEVICE_A_IFNAME, and requires CAP_NET_ADMIN. The attributes
+ *     mean what their counterparts in the structures above do.
+ *
+ *     WG_CMD_GET_DEVICE, which must be a dump (NLM_F_DUMP), returns the device over as many messages as it takes.
+ *     Each of them holds WGDEVICE_A_IFINDEX, WGDEVICE_A_IFNAME, and as many peers in WGDEVICE_A_PEERS as fit, and
+ *     the first also holds the rest of the device attributes. A peer whose ipmasks don't all fit is continued at
+ *     the start of the next message, which repeats only its WGPEER_A_PUBLIC_KEY along with the ipmasks that follow.
+ *     The device is only locked while each message is filled, so changes may come in between, in which case the
+ *     messages after them are flagged with NLM_F_DUMP_INTR, and the dump should be started over. An error finding
+ *     the device is returned in the NLMSG_DONE message.
+ *
+ *         WG_CMD_GET_DEVICE { WGDEVICE_A_IFINDEX, WGDEVICE_A_IFNAME, WGDEVICE_A_PRIVATE_KEY, ..., WGDEVICE_A_PEERS {
+ *             { WGPEER_A_PUBLIC_KEY, ..., WGPEER_A_IPMASKS { { WGIPMASK_A_FAMILY, WGIPMASK_A_IP, WGIPMASK_A_CIDR }, ... } },
+ *             ...
+ *             { WGPEER_A_PUBLIC_KEY, ..., WGPEER_A_IPMASKS { ... } } } }
+ *         WG_CMD_GET_DEVICE { WGDEVICE_A_IFINDEX, WGDEVICE_A_IFNAME, WGDEVICE_A_PEERS {
+ *             { WGPEER_A_PUBLIC_KEY, WGPEER_A_IPMASKS { ... } },
+ *             ... } }
+ *
+ *     WG_CMD_SET_DEVICE sets those of the device wide attributes that are present. WGDEVICE_A_FLAGS may hold
+ *     WGDEVICE_F_REMOVE_PRIVATE_KEY and WGDEVICE_F_REMOVE_PRESHARED_KEY. Peers are set with WG_CMD_SET_PEER.
+ *
+ *     WG_CMD_SET_PEER adds, changes or removes each of the peers in WGDEVICE_A_PEERS on its own. WGPEER_A_FLAGS
+ *     may hold WGPEER_F_REMOVE_ME and WGPEER_F_REPLACE_IPMASKS. The whole message is checked before anything is
+ *     applied, so a malformed one leaves the device unchanged. It holds RTNL and the device only for as long as
+ *     the peers it carries take, so that large configurations can be changed a few peers at a time without
+ *     holding up anything else for long.
+ *
+ *     The multicast group WG_GENL_MCGRP_PEERS carries a WG_CMD_PEER_EVENT message whenever something happens to
+ *     a peer, so that those watching it need not keep dumping the whole device. Joining it requires CAP_NET_ADMIN.
+ *     Each message holds a single peer, with its WGPEER_A_PUBLIC_KEY, the wg_peer_event that happened to it in
+ *     WGPEER_A_EVENT, and, for WG_PEER_EVENT_ENDPOINT_CHANGED, the new endpoint in WGPEER_A_ENDPOINTS. Events are
+ *     rate limited per peer, other than the creation and removal of peers, and the number left out since the last
+ *     one sent for the peer, if any were, is given in WGPEER_A_EVENTS_SUPPRESSED, in which case the peer should be
+ *     looked at with WG_CMD_GET_DEVICE. No removal events are sent when the whole device is deleted.
+ *
+ *         WG_CMD_PEER_EVENT { WGDEVICE_A_IFINDEX, WGDEVICE_A_PEERS {
+ *             { WGPEER_A_PUBLIC_KEY, WGPEER_A_EVENT, WGPEER_A_EVENTS_SUPPRESSED, WGPEER_A_ENDPOINTS { ... } } } }
  */
 
 
@@ -75,7 +164,45 @@
 #define WG_GET_DEVICE (SIOCDEVPRIVATE + 0)
 #define WG_SET_DEVICE (SIOCDEVPRIVATE + 1)
 
+#define WG_API_VERSION 1
+/* The lower half is zero, since it's where modules from before there was a version read the number of
+ * peers to set from, on little endian machines, so that those at least don't misparse any peers. */
+#define WG_API_VERSION_MAGIC (0x57000000U | (WG_API_VERSION << 16))
+
 #define WG_KEY_LEN 32
+#define WG_SOURCE_PORT_SPREAD 16
+/* The spread starts at the listening port, unless that would run past the last port. */
+#define WG_SOURCE_PORT_SPREAD_BASE(port) ((port) > 65536 - WG_SOURCE_PORT_SPREAD ? 65536 - WG_SOURCE_PORT_SPREAD : (port))
+#define WG_CPUMASK_WORDS 16
+#define WG_MAX_ENDPOINTS 4
+#define WG_REPLAY_WINDOW_MIN 2048
+#define WG_REPLAY_WINDOW_MAX 65536
+#define WG_DROP_REASONS 32
+
+/* Indices into `wgdevice->drops`, each counting packets dropped for that reason. */
+enum wg_drop_reason {
+	WG_DROP_TX_NO_PEER, /* No peer's allowed IPs match the destination. */
+	WG_DROP_TX_NO_ENDPOINT, /* The peer has no endpoint to send to. */
+	WG_DROP_TX_LOOP, /* The packet was routed back into a WireGuard interface too many times. */
+	WG_DROP_TX_GSO, /* Segmenting a large packet failed. */
+	WG_DROP_TX_TOO_BIG, /* Too big for the path to the peer, and may not be fragmented. */
+	WG_DROP_TX_QUEUE_FULL, /* Pushed out of the peer's full queue while waiting for a session. */
+	WG_DROP_TX_NO_MEMORY, /* Copying or expanding the packet failed. */
+	WG_DROP_TX_ENCRYPT, /* Encrypting failed for another reason. */
+	WG_DROP_TX_SEND, /* The outer packet could not be routed or handed to the socket. */
+	WG_DROP_TX_HANDSHAKE_TIMEOUT, /* Still queued when handshake attempts with the peer were given up. */
+	WG_DROP_RX_INVALID, /* Not a well formed message. */
+	WG_DROP_RX_HANDSHAKE_QUEUE_FULL, /* Too many handshake messages were already waiting. */
+	WG_DROP_RX_NO_MEMORY, /* Copying or linearizing the packet failed. */
+	WG_DROP_RX_NO_KEYPAIR, /* The key index of a data message matches no current session. */
+	WG_DROP_RX_BUSY, /* The parallel decryption workers were all full. */
+	WG_DROP_RX_DECRYPT, /* Authentication of a data message failed. */
+	WG_DROP_RX_INVALID_NONCE, /* A replayed data message, or one too far behind the replay window. */
+	WG_DROP_RX_INVALID_LENGTH, /* The decrypted packet is too short, or neither IPv4 nor IPv6. */
+	WG_DROP_RX_UNALLOWED_SOURCE, /* The decrypted packet's source isn't among the sending peer's allowed IPs. */
+	WG_DROP_RX_STACK, /* The network stack refused the decrypted packet. */
+	WG_DROP_REASON_COUNT
+};
 
 struct wgipmask {
 	__s32 family;
@@ -89,10 +216,12 @@ struct wgipmask {
 struct wgpeer {
 	__u8 public_key[WG_KEY_LEN]; /* Get/Set */
 
-	struct sockaddr_storage endpoint; /* Get/Set */
+	struct sockaddr_storage endpoints[WG_MAX_ENDPOINTS]; /* Get/Set */
+	__u8 max_endpoints; /* Get/Set */
 
 	struct timeval last_handshake_time; /* Get */
 	__u64 rx_bytes, tx_bytes; /* Get */
+	__u32 mtu; /* Get */
 
 	__u32 remove_me : 1; /* Set */
 	__u32 replace_ipmasks : 1; /* Set */
@@ -112,6 +241,21 @@ struct wgdevice {
 	__u32 replace_peer_list : 1; /* Set */
 	__u32 remove_private_key : 1; /* Set */
 	__u32 remove_preshared_key : 1; /* Set */
+	__u32 spread_source_ports : 1; /* Get/Set */
+	__u32 set_spread_source_ports : 1; /* Set */
+	__u32 keep_sessions : 1; /* Get/Set */
+	__u32 set_keep_sessions : 1; /* Set */
+	__u32 auto_mtu : 1; /* Get/Set */
+	__u32 set_auto_mtu : 1; /* Set */
+	__u32 set_crypto_cpus : 1; /* Set */
+	__u32 set_fast_path : 1; /* Set */
+
+	__u32 version_magic; /* Get/Set, must be WG_API_VERSION_MAGIC */
+
+	__u32 replay_window; /* Get/Set */
+	__s32 fast_path_ifindex; /* Get/Set */
+	__u64 crypto_cpus[WG_CPUMASK_WORDS]; /* Get/Set */
+	__u64 drops[WG_DROP_REASONS]; /* Get */
 
 	union {
 		__u16 num_peers; /* Get/Set */
@@ -119,4 +263,82 @@ struct wgdevice {
 	};
 };
 
+#define WG_GENL_NAME "wireguard"
+#define WG_GENL_VERSION 1
+#define WG_GENL_MCGRP_PEERS "peers"
+
+enum wg_cmd {
+	WG_CMD_GET_DEVICE,
+	WG_CMD_SET_DEVICE,
+	WG_CMD_SET_PEER,
+	WG_CMD_PEER_EVENT,
+	__WG_CMD_MAX
+};
+#define WG_CMD_MAX (__WG_CMD_MAX - 1)
+
+enum wgdevice_flag {
+	WGDEVICE_F_REMOVE_PRIVATE_KEY = 1U << 0,
+	WGDEVICE_F_REMOVE_PRESHARED_KEY = 1U << 1
+};
+
+enum wgdevice_attribute {
+	WGDEVICE_A_UNSPEC,
+	WGDEVICE_A_IFINDEX, /* u32 */
+	WGDEVICE_A_IFNAME, /* string */
+	WGDEVICE_A_PRIVATE_KEY, /* WG_KEY_LEN bytes, Get/Set */
+	WGDEVICE_A_PUBLIC_KEY, /* WG_KEY_LEN bytes, Get */
+	WGDEVICE_A_PRESHARED_KEY, /* WG_KEY_LEN bytes, Get/Set */
+	WGDEVICE_A_FLAGS, /* u32 of wgdevice_flag, Set */
+	WGDEVICE_A_LISTEN_PORT, /* u16, Get/Set */
+	WGDEVICE_A_SPREAD_SOURCE_PORTS, /* u8, Get/Set */
+	WGDEVICE_A_KEEP_SESSIONS, /* u8, Get/Set */
+	WGDEVICE_A_AUTO_MTU, /* u8, Get/Set */
+	WGDEVICE_A_REPLAY_WINDOW, /* u32, Get/Set */
+	WGDEVICE_A_FAST_PATH_IFINDEX, /* u32, Get/Set */
+	WGDEVICE_A_CRYPTO_CPUS, /* __u64[WG_CPUMASK_WORDS], Get/Set */
+	WGDEVICE_A_DROPS, /* __u64[WG_DROP_REASONS], Get */
+	WGDEVICE_A_PEERS, /* Nest of peers, each a nest of wgpeer_attribute */
+	__WGDEVICE_A_LAST
+};
+#define WGDEVICE_A_MAX (__WGDEVICE_A_LAST - 1)
+
+enum wgpeer_flag {
+	WGPEER_F_REMOVE_ME = 1U << 0,
+	WGPEER_F_REPLACE_IPMASKS = 1U << 1
+};
+
+enum wg_peer_event {
+	WG_PEER_EVENT_CREATED,
+	WG_PEER_EVENT_REMOVED,
+	WG_PEER_EVENT_HANDSHAKE_COMPLETE, /* A new session was established with the peer. */
+	WG_PEER_EVENT_ENDPOINT_CHANGED, /* The peer was heard from at a new address. */
+	WG_PEER_EVENT_KEYS_EXPIRED /* Nothing new was heard from the peer for long enough that all keys were zeroed. */
+};
+
+enum wgpeer_attribute {
+	WGPEER_A_UNSPEC,
+	WGPEER_A_PUBLIC_KEY, /* WG_KEY_LEN bytes, Get/Set */
+	WGPEER_A_FLAGS, /* u32 of wgpeer_flag, Set */
+	WGPEER_A_ENDPOINTS, /* Nest of up to WG_MAX_ENDPOINTS struct sockaddr_in or struct sockaddr_in6, Get/Set */
+	WGPEER_A_MAX_ENDPOINTS, /* u8, Get/Set */
+	WGPEER_A_LAST_HANDSHAKE_TIME, /* struct timeval, Get */
+	WGPEER_A_RX_BYTES, /* u64, Get */
+	WGPEER_A_TX_BYTES, /* u64, Get */
+	WGPEER_A_MTU, /* u32, Get */
+	WGPEER_A_IPMASKS, /* Nest of ipmasks, each a nest of wgipmask_attribute, Get/Set */
+	WGPEER_A_EVENT, /* u8 of wg_peer_event, Event */
+	WGPEER_A_EVENTS_SUPPRESSED, /* u32, Event */
+	__WGPEER_A_LAST
+};
+#define WGPEER_A_MAX (__WGPEER_A_LAST - 1)
+
+enum wgipmask_attribute {
+	WGIPMASK_A_UNSPEC,
+	WGIPMASK_A_FAMILY, /* u16 */
+	WGIPMASK_A_IP, /* struct in_addr or struct in6_addr */
+	WGIPMASK_A_CIDR, /* u8 */
+	__WGIPMASK_A_LAST
+};
+#define WGIPMASK_A_MAX (__WGIPMASK_A_LAST - 1)
+
 #endif
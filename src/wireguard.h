@@ -17,10 +17,12 @@
 #include <linux/timer.h>
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
+#include <linux/wait.h>
 #include <linux/mutex.h>
 #include <linux/kref.h>
 #include <linux/net.h>
 #include <linux/padata.h>
+#include <linux/cpumask.h>
 
 #include "crypto/chacha20poly1305.h"
 #include "crypto/curve25519.h"
@@ -36,22 +38,57 @@
 #define net_dbg_ratelimited(fmt, ...) do { if (0) no_printk(KERN_DEBUG pr_fmt(fmt), ##__VA_ARGS__); } while (0)
 #endif
 
+enum {
+	HANDSHAKE_QUEUE_BUCKETS = 64,
+	MAX_RECEIVE_SOCKETS = 8
+};
+
+struct cpu_map;
+struct latency_histograms;
+struct drop_counters;
+struct dentry;
+
 struct wireguard_device {
 	struct sock __rcu *sock4, *sock6;
+	struct sock *receive_socks4[MAX_RECEIVE_SOCKETS - 1], *receive_socks6[MAX_RECEIVE_SOCKETS - 1];
+	struct net_device *fast_path_dev; /* Protected by RTNL. */
 	u16 incoming_port;
+	bool spread_source_ports, keep_sessions, auto_mtu;
+	unsigned int replay_window; /* Bits of replay bitmap given to new keypairs. */
 	struct net *creating_net;
 	struct workqueue_struct *workqueue;
+	struct workqueue_struct *handshake_send_wq;
 	struct workqueue_struct *parallelqueue;
 	struct padata_instance *parallel_send, *parallel_receive;
+	atomic_t parallel_in_flight;
+	wait_queue_head_t parallel_drained;
+	struct cpu_map __rcu *crypt_cpu_map;
+	cpumask_var_t crypt_cpumask;
+	struct work_struct crypt_cpu_map_work;
+	struct mutex crypt_cpu_map_lock;
+	int crypt_node; /* Protected by crypt_cpu_map_lock. */
 	struct noise_static_identity static_identity;
-	struct sk_buff_head incoming_handshakes;
+	struct sk_buff_head incoming_handshakes[HANDSHAKE_QUEUE_BUCKETS];
+	atomic_t incoming_handshakes_count;
+	unsigned int incoming_handshakes_next;
+	u8 incoming_handshakes_key[SIPHASH24_KEY_LEN];
 	struct work_struct incoming_handshakes_work;
+	struct work_struct mtu_work;
+	struct latency_histograms __percpu *latency;
+	bool latency_enabled;
+	struct dentry *debugfs_dir;
+	struct drop_counters __percpu *drops;
 	struct cookie_checker cookie_checker;
 	struct pubkey_hashtable peer_hashtable;
 	struct index_hashtable index_hashtable;
 	struct routing_table peer_routing_table;
 	struct list_head peer_list;
+	unsigned int num_peers;
+	spinlock_t rekey_limit_lock;
+	uint64_t rekey_limit_window;
+	unsigned int rekey_limit_count;
 	struct mutex device_update_lock;
+	unsigned int device_update_gen; /* Bumped by every change under device_update_lock, to flag torn netlink dumps. */
 	struct mutex socket_update_lock;
 };
 